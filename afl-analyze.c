@@ -35,6 +35,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "map-size.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -58,6 +59,8 @@ static s32 child_pid;                 /* PID of the tested program         */
 
 static u8* trace_bits;                /* SHM with instrumentation bitmap   */
 
+static u32 map_size = MAP_SIZE;       /* Bytes in the map of the target    */
+
 static u8 *in_file,                   /* Analyzer input test case          */
           *prog_in,                   /* Targeted program input file       */
           *target_path,               /* Path to target binary             */
@@ -115,7 +118,7 @@ static u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -141,7 +144,7 @@ static void classify_counts(u8* mem) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
 
   while (i--) if (*(ptr++)) return 1;
 
@@ -166,7 +169,7 @@ static void setup_shm(void) {
 
   u8* shm_str;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, map_size + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -254,7 +257,7 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
   s32 prog_in_fd;
   u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   prog_in_fd = write_to_file(prog_in, mem, len);
@@ -347,7 +350,7 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace_bits, map_size, HASH_CONST);
 
   /* We don't actually care if the target is crashing or not,
      except that when it does, the checksum should be different. */
@@ -1058,12 +1061,15 @@ int main(int argc, char** argv) {
 
   use_hex_offsets = !!getenv("AFL_ANALYZE_HEX");
 
-  setup_shm();
   setup_signal_handlers();
 
   set_up_environment();
 
   find_binary(argv[optind]);
+
+  if (!qemu_mode) map_size = get_target_map_size(target_path, mem_limit, exec_tmout);
+
+  setup_shm();
   detect_file_args(argv + optind);
 
   if (qemu_mode)
@@ -42,6 +42,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "map-size.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -69,6 +70,10 @@
 
 #include <math.h>
 
+#ifndef __APPLE__
+#  include <elf.h>
+#endif /* !__APPLE__ */
+
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
 #  include <sys/sysctl.h>
 #endif /* __APPLE__ || __FreeBSD__ || __OpenBSD__ */
@@ -111,6 +116,20 @@ u8 aco_incdec = ACO_INC_ONLY;     /* only increase score or increase/decrease */
 u8 INIT_BYTE_SCORE = 0, MIN_BYTE_SCORE = 0, MAX_BYTE_SCORE = 0;
 u8 ACO_GRAV_BIAS = 0;
 
+/* Weight of each map entry, from CHURN_WEIGHTS_SECTION or AFLCHURN_WEIGHTS;
+   with these, the fitness is computed from the trace rather than in the
+   target */
+static float* churn_weights;
+static u8* churn_weighted;    /* 1 for the entries with a weight */
+static u8 fitness_once;       /* count hit entries once, not per hit */
+static double trace_fitness_sum, trace_fitness_cnt; /* of the last run */
+
+/* AFLCHURN_FORMULA: the fitness from the age, rank and churn channels of
+   binaries built with AFLCHURN_CHANNELS instead, as the average of one of
+   them, or the sum or product of the averages of two */
+static s32 formula_a = -1, formula_b = -1;
+static u8 formula_op;
+
 u32 scale_exponent = 3; // default
 float fitness_exponent = 0.3;
 
@@ -186,20 +205,43 @@ static s32 out_fd,                    /* Persistent fd for out_file       */
            fsrv_ctl_fd,               /* Fork server control pipe (write) */
            fsrv_st_fd;                /* Fork server status pipe (read)   */
 
+static u32 prev_timed_out;            /* Last child of the server killed? */
+
 static s32 forksrv_pid,               /* PID of the fork server           */
            child_pid = -1,            /* PID of the fuzzed program        */
            out_dir_fd = -1;           /* FD of the lock file              */
 
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
-EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
-           virgin_tmout[MAP_SIZE],    /* Bits we haven't seen in tmouts   */
-           virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
+EXP_ST u32 map_size = MAP_SIZE;       /* Bytes in the map of the target   */
 
-static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
+EXP_ST u8  *virgin_bits,              /* Regions yet untouched by fuzzing */
+           *virgin_tmout,             /* Bits we haven't seen in tmouts   */
+           *virgin_crash;             /* Bits we haven't seen in crashes  */
+
+static u8  *var_bytes;                /* Bytes that appear to be variable */
 
 static s32 shm_id;                    /* ID of the SHM region             */
 
+/* Dual-binary mode (-w): test cases of interest are run on a sanitized
+   build as well, which has a fork server and a SHM region of its own */
+
+static u8* san_path;                  /* Path to the sanitized build      */
+
+static u8* san_trace_bits,            /* Its SHM with the bitmap          */
+          *virgin_san_crash;          /* Bits it hasn't seen in crashes   */
+
+static s32 san_shm_id = -1,           /* ID of its SHM region             */
+           san_forksrv_pid,           /* PID of its fork server           */
+           san_ctl_fd,                /* Its control pipe (write)         */
+           san_st_fd;                 /* Its status pipe (read)           */
+
+static u32 san_prev_timed_out;        /* Its last child killed?           */
+
+static u64 san_execs,                 /* Test cases run on it             */
+           san_crashes,               /* ... that crash only there        */
+           san_confirmed;             /* Crashes it reproduced            */
+
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    clear_screen = 1,  /* Window resized?                  */
                    child_timed_out;   /* Traced process timed out?        */
@@ -325,8 +367,8 @@ static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
                           *queue_top, /* Top of the list                  */
                           *q_prev100; /* Previous 100 marker              */
 
-static struct queue_entry*
-  top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
+static struct queue_entry**
+  top_rated;                          /* Top entries for bitmap bytes     */
 
 struct extra_data {
   u8* data;                           /* Dictionary token data            */
@@ -440,22 +482,52 @@ static inline u32 UR(u32 limit) {
 }
 
 
-/* Get values of churn info from instrumentation  */
+/* Average of one channel over the blocks that had it; 0 if none did. */
+static double get_channel_fitness(u32 ch) {
+
+  u8* slot = trace_bits + map_size + CHURN_CHANNEL_SHM + 16 * ch;
+  u64 sum = *(u64*)slot;
+
+#ifdef WORD_SIZE_64
+  u64 cnt = *(u64*)(slot + 8);
+#else
+  u32 cnt = *(u32*)(slot + 8);
+#endif /* ^WORD_SIZE_64 */
+
+  if (!cnt) return 0;
+  return ldexp((double)sum, -CHURN_FIXED_SHIFT) / cnt;
+
+}
+
+/* Get values of churn info from instrumentation. Modules built with
+   AFLCHURN_FIXED_POINT add to the fixed-point sum, the others to the double;
+   a binary may contain both. */
 double get_raw_fitness_of_executed_input(){
   double inst_raw_fitness = 0.0;
 
-  double *sum_raw_fitness = (double *)(trace_bits + MAP_SIZE);
+  if (formula_a >= 0) {
+    double a = get_channel_fitness(formula_a), b;
+    if (formula_b < 0) return a;
+    b = get_channel_fitness(formula_b);
+    return formula_op == '*' ? a * b : a + b;
+  }
+
+  double *sum_raw_fitness = (double *)(trace_bits + map_size);
+  u64 *fixed_raw_fitness = (u64 *)(trace_bits + map_size + 16);
 
 #ifdef WORD_SIZE_64
-  u64 *count_raw_fitness = (u64 *)(trace_bits + MAP_SIZE + 8);
+  u64 *count_raw_fitness = (u64 *)(trace_bits + map_size + 8);
 
 #else
-  u32 *count_raw_fitness = (u32 *)(trace_bits + MAP_SIZE + 8);
+  u32 *count_raw_fitness = (u32 *)(trace_bits + map_size + 8);
 
 #endif
 
-  if ((*count_raw_fitness) != 0){ 
-    inst_raw_fitness = (*sum_raw_fitness) / (*count_raw_fitness);
+  /* Plus what the weight table gives for the trace */
+  if ((*count_raw_fitness) != 0 || trace_fitness_cnt != 0){ 
+    inst_raw_fitness = ((*sum_raw_fitness) + trace_fitness_sum +
+                        ldexp((double)(*fixed_raw_fitness), -CHURN_FIXED_SHIFT))
+                       / ((*count_raw_fitness) + trace_fitness_cnt);
   }
 
   return inst_raw_fitness;
@@ -1346,7 +1418,7 @@ EXP_ST void write_bitmap(void) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  ck_write(fd, virgin_bits, map_size, fname);
 
   close(fd);
   ck_free(fname);
@@ -1362,7 +1434,7 @@ EXP_ST void read_bitmap(u8* fname) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+  ck_read(fd, virgin_bits, map_size, fname);
 
   close(fd);
 
@@ -1384,14 +1456,14 @@ static inline u8 has_new_bits(u8* virgin_map) {
   u64* current = (u64*)trace_bits;
   u64* virgin  = (u64*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 3);
+  u32  i = (map_size >> 3);
 
 #else
 
   u32* current = (u32*)trace_bits;
   u32* virgin  = (u32*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 2);
+  u32  i = (map_size >> 2);
 
 #endif /* ^WORD_SIZE_64 */
 
@@ -1453,7 +1525,7 @@ static inline u8 has_new_bits(u8* virgin_map) {
 static u32 count_bits(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1488,7 +1560,7 @@ static u32 count_bits(u8* mem) {
 static u32 count_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1514,7 +1586,7 @@ static u32 count_bytes(u8* mem) {
 static u32 count_non_255_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
   while (i--) {
@@ -1553,7 +1625,7 @@ static const u8 simplify_lookup[256] = {
 
 static void simplify_trace(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
 
   while (i--) {
 
@@ -1584,7 +1656,7 @@ static void simplify_trace(u64* mem) {
 
 static void simplify_trace(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
 
   while (i--) {
 
@@ -1647,7 +1719,7 @@ EXP_ST void init_count_class16(void) {
 
 static inline void classify_counts(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
 
   while (i--) {
 
@@ -1674,7 +1746,7 @@ static inline void classify_counts(u64* mem) {
 
 static inline void classify_counts(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
 
   while (i--) {
 
@@ -1698,11 +1770,55 @@ static inline void classify_counts(u32* mem) {
 #endif /* ^WORD_SIZE_64 */
 
 
+/* classify_counts() for binaries with a weight table: also sums up the
+   weights of the hit entries, times their hit counts (or once each with
+   AFLCHURN_FITNESS_ONCE), and the number of those hits, before the counts
+   are bucketed. */
+
+static void classify_weighed_counts(u8* mem) {
+
+  u32 i, j;
+  double sum = 0, cnt = 0;
+
+  for (i = 0; i < map_size; i += 8) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*(u64*)(mem + i))) {
+
+      float word_sum = 0, word_cnt = 0;
+
+      for (j = 0; j < 8; j++) {
+
+        u8 hits = fitness_once ? !!mem[i + j] : mem[i + j];
+
+        word_sum += hits * churn_weights[i + j];
+        word_cnt += hits * churn_weighted[i + j];
+
+      }
+
+      sum += word_sum;
+      cnt += word_cnt;
+
+      for (j = 0; j < 8; j += 2)
+        *(u16*)(mem + i + j) = count_class_lookup16[*(u16*)(mem + i + j)];
+
+    }
+
+  }
+
+  trace_fitness_sum = sum;
+  trace_fitness_cnt = cnt;
+
+}
+
+
 /* Get rid of shared memory (atexit handler). */
 
 static void remove_shm(void) {
 
   shmctl(shm_id, IPC_RMID, NULL);
+  if (san_shm_id >= 0) shmctl(san_shm_id, IPC_RMID, NULL);
 
 }
 
@@ -1715,7 +1831,7 @@ static void minimize_bits(u8* dst, u8* src) {
 
   u32 i = 0;
 
-  while (i < MAP_SIZE) {
+  while (i < map_size) {
 
     if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
     i++;
@@ -1743,7 +1859,7 @@ static void update_bitmap_score(struct queue_entry* q) {
   /* For every byte set in trace_bits[], see if there is a previous winner,
      and how it compares to us. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
 
     if (trace_bits[i]) {
 
@@ -1769,7 +1885,7 @@ static void update_bitmap_score(struct queue_entry* q) {
        q->tc_ref++;
 
        if (!q->trace_mini) {
-         q->trace_mini = ck_alloc(MAP_SIZE >> 3);
+         q->trace_mini = ck_alloc(map_size >> 3);
          minimize_bits(q->trace_mini, trace_bits);
        }
 
@@ -1789,14 +1905,16 @@ static void update_bitmap_score(struct queue_entry* q) {
 static void cull_queue(void) {
 
   struct queue_entry* q;
-  static u8 temp_v[MAP_SIZE >> 3];
+  static u8* temp_v;
   u32 i;
 
   if (dumb_mode || !score_changed) return;
 
+  if (!temp_v) temp_v = ck_alloc(map_size >> 3);
+
   score_changed = 0;
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+  memset(temp_v, 255, map_size >> 3);
 
   queued_favored  = 0;
   pending_favored = 0;
@@ -1811,10 +1929,10 @@ static void cull_queue(void) {
   /* Let's see if anything in the bitmap isn't captured in temp_v.
      If yes, and if it has a top_rated[] contender, let's use it. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
     if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7)))) {
 
-      u32 j = MAP_SIZE >> 3;
+      u32 j = map_size >> 3;
 
       /* Remove all bits belonging to the current entry from temp_v. */
 
@@ -1845,13 +1963,20 @@ EXP_ST void setup_shm(void) {
 
   u8* shm_str;
 
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  virgin_bits  = ck_alloc_nozero(map_size);
+  virgin_tmout = ck_alloc_nozero(map_size);
+  virgin_crash = ck_alloc_nozero(map_size);
+  var_bytes    = ck_alloc(map_size);
+  top_rated    = ck_alloc(map_size * sizeof(struct queue_entry*));
 
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  if (in_bitmap) read_bitmap(in_bitmap);
+  else memset(virgin_bits, 255, map_size);
 
+  memset(virgin_tmout, 255, map_size);
+  memset(virgin_crash, 255, map_size);
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+
+  shm_id = shmget(IPC_PRIVATE, map_size + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -1876,6 +2001,40 @@ EXP_ST void setup_shm(void) {
 }
 
 
+/* Dual-binary mode: set up the SHM region of the sanitized build. Its fork
+   server starts when the first test case is run on it. */
+
+static void setup_san(void) {
+
+  if (dumb_mode || qemu_mode) FATAL("-w needs an instrumented target");
+
+  if (access(san_path, X_OK))
+    PFATAL("Unable to run the sanitized build '%s'", san_path);
+
+  /* Its IDs need not match those of the fast build, but its map size must,
+     since the churn weights are per map byte. */
+
+  if (!getenv("AFL_SKIP_BIN_CHECK") &&
+      get_target_map_size(san_path, 0, exec_tmout) != map_size)
+    FATAL("The sanitized build uses a map of a different size than '%s'",
+          target_path);
+
+  virgin_san_crash = ck_alloc_nozero(map_size);
+  memset(virgin_san_crash, 255, map_size);
+
+  san_shm_id = shmget(IPC_PRIVATE, map_size + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (san_shm_id < 0) PFATAL("shmget() failed");
+
+  san_trace_bits = shmat(san_shm_id, NULL, 0);
+
+  if (san_trace_bits == (void *)-1) PFATAL("shmat() failed");
+
+  OKF("New paths, crashes and the fittest inputs go to '%s' as well.", san_path);
+
+}
+
+
 /* Load postprocessor, if available. */
 
 static void setup_post(void) {
@@ -2625,8 +2784,16 @@ EXP_ST void init_forkserver(char** argv) {
      Otherwise, try to figure out what went wrong. */
 
   if (rlen == 4) {
+
+    if (!dumb_mode && (status & FS_OPT_MAP_SIZE) &&
+        (status & ~FS_OPT_MAP_SIZE) != map_size)
+      FATAL("The fork server reports a map of %u bytes, not %u%s",
+            status & ~FS_OPT_MAP_SIZE, map_size, getenv("AFL_SKIP_BIN_CHECK") ?
+            " (AFL_SKIP_BIN_CHECK skips asking the target)" : "");
+
     OKF("All right - fork server is up.");
     return;
+
   }
 
   if (child_timed_out)
@@ -2765,7 +2932,6 @@ EXP_ST void init_forkserver(char** argv) {
 static u8 run_target(char** argv, u32 timeout) {
 
   static struct itimerval it;
-  static u32 prev_timed_out = 0;
   static u64 exec_ms = 0;
 
   int status = 0;
@@ -2777,7 +2943,7 @@ static u8 run_target(char** argv, u32 timeout) {
      must prevent any earlier operations from venturing into that
      territory. */
 
-  memset(trace_bits, 0, MAP_SIZE + WEIGHT_SHM);
+  memset(trace_bits, 0, map_size + WEIGHT_SHM);
   MEM_BARRIER();
 
   /* If we're running in "dumb" mode, we can't rely on the fork server
@@ -2934,12 +3100,17 @@ static u8 run_target(char** argv, u32 timeout) {
 
   tb4 = *(u32*)trace_bits;
 
+  if (churn_weights) classify_weighed_counts(trace_bits);
+  else {
+
 #ifdef WORD_SIZE_64
-  classify_counts((u64*)trace_bits);
+    classify_counts((u64*)trace_bits);
 #else
-  classify_counts((u32*)trace_bits);
+    classify_counts((u32*)trace_bits);
 #endif /* ^WORD_SIZE_64 */
 
+  }
+
   prev_timed_out = child_timed_out;
 
   /* Report outcome to caller. */
@@ -3046,11 +3217,13 @@ static void show_stats(void);
 static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
                          u32 handicap, u8 from_queue) {
 
-  static u8 first_trace[MAP_SIZE];
+  static u8* first_trace;
 
   u8  fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
       first_run = (q->exec_cksum == 0);
 
+  if (!first_trace) first_trace = ck_alloc(map_size);
+
   u64 start_us, stop_us;
 
   s32 old_sc = stage_cur, old_sm = stage_max;
@@ -3079,7 +3252,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
   if (q->exec_cksum) {
 
-    memcpy(first_trace, trace_bits, MAP_SIZE);
+    memcpy(first_trace, trace_bits, map_size);
     hnb = has_new_bits(virgin_bits);
     if (hnb > new_bits) new_bits = hnb;
 
@@ -3108,7 +3281,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
       goto abort_calibration;
     }
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     if (q->exec_cksum != cksum) {
 
@@ -3119,7 +3292,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
         u32 i;
 
-        for (i = 0; i < MAP_SIZE; i++) {
+        for (i = 0; i < map_size; i++) {
 
           if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
 
@@ -3136,7 +3309,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
         q->exec_cksum = cksum;
         
-        memcpy(first_trace, trace_bits, MAP_SIZE);
+        memcpy(first_trace, trace_bits, map_size);
 
       }
 
@@ -3228,7 +3401,9 @@ static void check_map_coverage(void) {
 
   u32 i;
 
-  if (count_bytes(trace_bits) < 100) return;
+  /* Only maps made up of hashed locations should reach the upper half. */
+
+  if (map_size != MAP_SIZE || count_bytes(trace_bits) < 100) return;
 
   for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
     if (trace_bits[i]) return;
@@ -3699,7 +3874,7 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       queued_with_cov++;
     }
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
        successful. */
@@ -3849,6 +4024,173 @@ keep_as_crash:
 }
 
 
+/* Switch the fork server, SHM region and target path over to the sanitized
+   build, or back. */
+
+static void swap_san_target(void) {
+
+  u8* tmp_ptr;
+  s32 tmp_fd;
+  u32 tmp_u32;
+
+  tmp_ptr = target_path; target_path = san_path; san_path = tmp_ptr;
+  tmp_ptr = trace_bits; trace_bits = san_trace_bits; san_trace_bits = tmp_ptr;
+
+  tmp_fd = forksrv_pid; forksrv_pid = san_forksrv_pid; san_forksrv_pid = tmp_fd;
+  tmp_fd = fsrv_ctl_fd; fsrv_ctl_fd = san_ctl_fd; san_ctl_fd = tmp_fd;
+  tmp_fd = fsrv_st_fd; fsrv_st_fd = san_st_fd; san_st_fd = tmp_fd;
+
+  tmp_u32 = prev_timed_out; prev_timed_out = san_prev_timed_out;
+  san_prev_timed_out = tmp_u32;
+
+}
+
+
+/* Run a test case on the sanitized build. A crash of the fast build that
+   it reproduces is counted as confirmed; a crash that only the sanitizer
+   reports is saved like any other, with "san" and op in its name. The two
+   builds may be instrumented differently, so such crashes are told apart
+   by their traces in the sanitized build alone. The sanitizer gets no
+   memory limit, and SAN_TMOUT_MULT times the time. */
+
+static void run_san_case(char** argv, void* mem, u32 len, u8 crashed, u8* op) {
+
+  double fitness_sum = trace_fitness_sum, fitness_cnt = trace_fitness_cnt;
+  u8  fault;
+  u8* fn;
+  s32 fd;
+
+  write_to_testcase(mem, len);
+
+  swap_san_target();
+
+  if (!forksrv_pid) {
+
+    u8* shm_str = alloc_printf("%d", san_shm_id);
+    u64 old_mem_limit = mem_limit;
+
+    ACTF("Starting the sanitized build...");
+
+    setenv(SHM_ENV_VAR, shm_str, 1);
+    mem_limit = 0;
+
+    init_forkserver(argv);
+
+    mem_limit = old_mem_limit;
+    ck_free(shm_str);
+    shm_str = alloc_printf("%d", shm_id);
+    setenv(SHM_ENV_VAR, shm_str, 1);
+    ck_free(shm_str);
+
+  }
+
+  fault = run_target(argv, exec_tmout * SAN_TMOUT_MULT);
+
+  /* The fitness of the fast build's run is still to be used */
+
+  trace_fitness_sum = fitness_sum;
+  trace_fitness_cnt = fitness_cnt;
+
+  total_execs--;
+  san_execs++;
+
+  if (stop_soon || fault != FAULT_CRASH) {
+    swap_san_target();
+    return;
+  }
+
+  if (crashed) {
+    san_confirmed++;
+    swap_san_target();
+    return;
+  }
+
+#ifdef WORD_SIZE_64
+  simplify_trace((u64*)trace_bits);
+#else
+  simplify_trace((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+  if (unique_crashes >= KEEP_UNIQUE_CRASH || !has_new_bits(virgin_san_crash)) {
+    swap_san_target();
+    return;
+  }
+
+  swap_san_target();
+
+  if (!unique_crashes) write_crash_readme();
+
+#ifndef SIMPLE_FILES
+
+  fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,san,%s", out_dir,
+                    unique_crashes, kill_signal, op);
+
+#else
+
+  fn = alloc_printf("%s/crashes/id_%06llu_%02u_san", out_dir, unique_crashes,
+                    kill_signal);
+
+#endif /* ^!SIMPLE_FILES */
+
+  unique_crashes++;
+  san_crashes++;
+
+  last_crash_time = get_cur_time();
+  last_crash_execs = total_execs;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, mem, len, fn);
+  close(fd);
+
+  ck_free(fn);
+
+}
+
+
+/* Dual-binary mode: run the seeds on the sanitized build, too. Those that
+   the fast build crashed on (AFL_SKIP_CRASHES) are only confirmed there. */
+
+static void san_dry_run(char** argv) {
+
+  struct queue_entry* q = queue;
+  u32 id = 0;
+
+  ACTF("Running the seeds on the sanitized build...");
+
+  while (q && !stop_soon) {
+
+    u8* use_mem;
+    u8* op;
+    s32 fd;
+
+    fd = open(q->fname, O_RDONLY);
+    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+
+    use_mem = ck_alloc_nozero(q->len);
+
+    if (read(fd, use_mem, q->len) != q->len)
+      FATAL("Short read from '%s'", q->fname);
+
+    close(fd);
+
+    op = alloc_printf("src:%06u,op:seed", id);
+    run_san_case(argv, use_mem, q->len, q->cal_failed >= CAL_CHANCES, op);
+    ck_free(op);
+    ck_free(use_mem);
+
+    q = q->next;
+    id++;
+
+  }
+
+  if (san_crashes)
+    WARNF("%llu seed%s crash%s the sanitized build only.", san_crashes,
+          san_crashes > 1 ? "s" : "", san_crashes > 1 ? "" : "es");
+
+}
+
+
 /* When resuming, try to find the queue position to start from. This makes sense
    only when resuming, and when we can find the original fuzzer_stats. */
 
@@ -3982,7 +4324,10 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              "afl_version       : " VERSION "\n"
              "target_mode       : %s%s%s%s%s%s%s\n"
              "command_line      : %s\n"
-             "slowest_exec_ms   : %llu\n",
+             "slowest_exec_ms   : %llu\n"
+             "san_execs         : %llu\n"
+             "san_crashes       : %llu\n"
+             "san_confirmed     : %llu\n",
              start_time / 1000, get_cur_time() / 1000, getpid(),
              queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
              queued_paths, queued_favored, queued_discovered, queued_imported,
@@ -3996,7 +4341,7 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
              (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
               persistent_mode || deferred_mode) ? "" : "default",
-             orig_cmdline, slowest_exec_ms);
+             orig_cmdline, slowest_exec_ms, san_execs, san_crashes, san_confirmed);
              /* ignore errors */
 
   /* Get rss value from the children
@@ -4489,7 +4834,7 @@ static void show_stats(void) {
   /* Do some bitmap stats. */
 
   t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
 
   if (t_bytes) 
     stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
@@ -4529,7 +4874,7 @@ static void show_stats(void) {
 
   /* Compute some mildly useful bitmap stats. */
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
 
   /* Now, for the visuals... */
 
@@ -4667,7 +5012,7 @@ static void show_stats(void) {
   SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
 
   sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / MAP_SIZE, t_byte_ratio);
+          100 / map_size, t_byte_ratio);
 
   SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
        ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
@@ -5034,13 +5379,15 @@ static u32 next_p2(u32 val) {
 static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+  static u8* clean_trace;
 
   u8  needs_write = 0, fault = 0;
   u32 trim_exec = 0;
   u32 remove_len;
   u32 len_p2;
 
+  if (!clean_trace) clean_trace = ck_alloc(map_size);
+
   /* Although the trimmer will be less useful when variable behavior is
      detected, it will still work to some extent, so we don't check for
      this. */
@@ -5082,7 +5429,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
       /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -5105,7 +5452,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
         if (!needs_write) {
 
           needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+          memcpy(clean_trace, trace_bits, map_size);
 
         }
 
@@ -5138,7 +5485,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
     ck_write(fd, in_buf, q->len, q->fname);
     close(fd);
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    memcpy(trace_bits, clean_trace, map_size);
     update_bitmap_score(q);
 
   }
@@ -5157,7 +5504,8 @@ abort_trimming:
 
 EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
-  u8 fault;
+  u8 fault, kept, san_fit = 0;
+  u64 crashes;
 
   if (post_handler) {
 
@@ -5192,9 +5540,21 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
   }
 
+  /* Dual-binary mode: inputs that reach more changed code than any seed
+     go to the sanitized build, too. Decide before the trace is gone. */
+
+  if (san_path && fault == FAULT_NONE &&
+      get_raw_fitness_of_executed_input() > max_raw_fitness) san_fit = 1;
+
+  crashes = unique_crashes;
+
   /* This handles FAULT_ERROR for us: */
 
-  queued_discovered += save_if_interesting(argv, out_buf, len, fault);
+  kept = save_if_interesting(argv, out_buf, len, fault);
+  queued_discovered += kept;
+
+  if (san_path && !stop_soon && (kept || san_fit || unique_crashes > crashes))
+    run_san_case(argv, out_buf, len, unique_crashes > crashes, describe_op(0));
 
   if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
     show_stats();
@@ -5794,7 +6154,7 @@ static u8 fuzz_one(char** argv) {
 
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      u32 cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -5956,7 +6316,7 @@ static u8 fuzz_one(char** argv) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+        cksum = hash32(trace_bits, map_size, HASH_CONST);
       else
         cksum = ~queue_cur->exec_cksum;
 
@@ -7478,6 +7838,7 @@ static void handle_stop_sig(int sig) {
 
   if (child_pid > 0) kill(child_pid, SIGKILL);
   if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+  if (san_forksrv_pid > 0) kill(san_forksrv_pid, SIGKILL);
 
 }
 
@@ -7509,6 +7870,193 @@ static void handle_timeout(int sig) {
 }
 
 
+/* Find a section of an ELF file in memory. Returns NULL if there is no such
+   section or the file looks broken. */
+
+#ifndef __APPLE__
+
+static u8* find_elf_section(u8* data, u32 len, u8* name, u32* sec_len) {
+
+  u8  is64 = data[EI_CLASS] == ELFCLASS64;
+  u64 shoff, str_off, str_size, off, size;
+  u32 shnum, shentsize, shstrndx, name_off, name_len = strlen(name), i;
+
+  if (len < (is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr))) return NULL;
+
+  if (is64) {
+
+    Elf64_Ehdr* eh = (Elf64_Ehdr*)data;
+    shoff = eh->e_shoff; shnum = eh->e_shnum;
+    shentsize = eh->e_shentsize; shstrndx = eh->e_shstrndx;
+
+  } else {
+
+    Elf32_Ehdr* eh = (Elf32_Ehdr*)data;
+    shoff = eh->e_shoff; shnum = eh->e_shnum;
+    shentsize = eh->e_shentsize; shstrndx = eh->e_shstrndx;
+
+  }
+
+  if (!shoff || shstrndx >= shnum || shoff > len ||
+      shentsize < (is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr)) ||
+      (u64)shnum * shentsize > len - shoff) return NULL;
+
+#define SHDR(_i, _f) (is64 ? ((Elf64_Shdr*)(data + shoff + (_i) * shentsize))->_f : \
+                             ((Elf32_Shdr*)(data + shoff + (_i) * shentsize))->_f)
+
+  str_off  = SHDR(shstrndx, sh_offset);
+  str_size = SHDR(shstrndx, sh_size);
+
+  if (str_off > len || str_size > len - str_off) return NULL;
+
+  for (i = 0; i < shnum; i++) {
+
+    name_off = SHDR(i, sh_name);
+
+    if (name_off >= str_size || str_size - name_off <= name_len ||
+        memcmp(data + str_off + name_off, name, name_len + 1)) continue;
+
+    off  = SHDR(i, sh_offset);
+    size = SHDR(i, sh_size);
+
+    if (SHDR(i, sh_type) == SHT_NOBITS || off > len || size > len - off)
+      return NULL;
+
+    *sec_len = size;
+    return data + off;
+
+  }
+
+#undef SHDR
+
+  return NULL;
+
+}
+
+#endif /* !__APPLE__ */
+
+
+/* Set up churn_weights from weight records (see CHURN_WEIGHTS_SECTION). */
+
+static void set_churn_weights(u8* recs, u32 len, u8* source) {
+
+  u32 cnt = len / 8, i;
+
+  if (!cnt) return;
+
+  churn_weights  = ck_alloc(map_size * sizeof(float));
+  churn_weighted = ck_alloc(map_size);
+
+  for (i = 0; i < cnt; i++) {
+
+    u32 id;
+    float weight;
+
+    memcpy(&id, recs + i * 8, 4);
+    memcpy(&weight, recs + i * 8 + 4, 4);
+
+    /* Edge IDs beyond the map share entries; keep the larger weight. */
+
+    id %= map_size;
+
+    if (!(weight > 0)) continue;
+    if (weight > churn_weights[id]) churn_weights[id] = weight;
+    churn_weighted[id] = 1;
+
+  }
+
+  fitness_once = !!getenv("AFLCHURN_FITNESS_ONCE");
+
+  OKF("Loaded the churn weights of %u edges from %s.", cnt, source);
+
+}
+
+
+/* Parse AFLCHURN_FORMULA: age, rank or churn, or two of them joined by +
+   or *. */
+
+static void parse_churn_formula(void) {
+
+  static const char* names[CHURN_CHANNELS] = { "age", "rank", "churn" };
+  u8* formula = getenv("AFLCHURN_FORMULA");
+  u8* op;
+  u32 i;
+
+  if (!formula) return;
+
+  op = strpbrk(formula, "+*");
+
+  for (i = 0; i < CHURN_CHANNELS; i++) {
+
+    u32 len = op ? op - formula : strlen(formula);
+
+    if (len == strlen(names[i]) && !strncmp(formula, names[i], len)) formula_a = i;
+    if (op && !strcmp(op + 1, names[i])) formula_b = i;
+
+  }
+
+  if (formula_a < 0 || (op && formula_b < 0))
+    FATAL("Bad value of AFLCHURN_FORMULA (age, rank or churn, or two of them "
+          "joined by + or *)");
+
+  if (op) formula_op = *op;
+
+  OKF("Fitness is %s, from the channels of the binary.", formula);
+
+}
+
+
+/* Load the weight table from AFLCHURN_WEIGHTS or from the binary. */
+
+static void load_churn_weights(u8* f_data, u32 f_len) {
+
+  u8* fname = getenv("AFLCHURN_WEIGHTS");
+
+  if (fname) {
+
+    struct stat st;
+    u8* recs;
+    s32 fd = open(fname, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st)) PFATAL("Unable to open '%s'", fname);
+
+    recs = ck_alloc_nozero(st.st_size + 1);
+    ck_read(fd, recs, st.st_size, fname);
+    close(fd);
+
+    set_churn_weights(recs, st.st_size, fname);
+    ck_free(recs);
+    return;
+
+  }
+
+#ifndef __APPLE__
+
+  {
+
+    u32 len;
+    u8* recs = find_elf_section(f_data, f_len, CHURN_WEIGHTS_SECTION, &len);
+
+    if (recs) set_churn_weights(recs, len, "the binary");
+
+  }
+
+#endif /* !__APPLE__ */
+
+}
+
+
+/* Ask the target how large a map it needs (see map-size.h). */
+
+static void get_map_size(void) {
+
+  map_size = get_target_map_size(target_path, mem_limit, exec_tmout);
+
+  if (map_size != MAP_SIZE) OKF("The target uses a map of %u bytes.", map_size);
+
+}
+
+
 /* Do a PATH search and find target binary to see that it exists and
    isn't a shell script - a common and painful mistake. We also check for
    a valid ELF header and for evidence of AFL instrumentation. */
@@ -7673,6 +8221,14 @@ EXP_ST void check_binary(u8* fname) {
 
   }
 
+  if (!qemu_mode && !dumb_mode) {
+    get_map_size();
+    load_churn_weights(f_data, f_len);
+  }
+
+  if (formula_a >= 0 && !memmem(f_data, f_len, CHANNELS_SIG, strlen(CHANNELS_SIG) + 1))
+    WARNF("AFLCHURN_FORMULA needs a binary built with AFLCHURN_CHANNELS.");
+
   if (munmap(f_data, f_len)) PFATAL("unmap() failed");
 
 }
@@ -7772,7 +8328,8 @@ static void usage(u8* argv0) {
 
        "  -d            - quick & dirty mode (skips deterministic steps)\n"
        "  -n            - fuzz without instrumentation (dumb mode)\n"
-       "  -x dir        - optional fuzzer dictionary (see README)\n\n"
+       "  -x dir        - optional fuzzer dictionary (see README)\n"
+       "  -w file       - sanitized build of the target, for new paths and crashes\n\n"
 
        "Other stuff:\n\n"
 
@@ -8479,7 +9036,7 @@ int main(int argc, char** argv) {
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:QVp:eZs:H:A")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:w:QVp:eZs:H:A")) > 0)
 
     switch (opt) {
 
@@ -8539,6 +9096,12 @@ int main(int argc, char** argv) {
         extras_dir = optarg;
         break;
 
+      case 'w': /* sanitized build */
+
+        if (san_path) FATAL("Multiple -w options not supported");
+        san_path = optarg;
+        break;
+
       case 't': { /* timeout */
 
           u8 suffix = 0;
@@ -8628,7 +9191,6 @@ int main(int argc, char** argv) {
         if (in_bitmap) FATAL("Multiple -B options not supported");
 
         in_bitmap = optarg;
-        read_bitmap(in_bitmap);
         break;
 
       case 'C': /* crash mode */
@@ -8752,6 +9314,8 @@ int main(int argc, char** argv) {
     OKF("ACO score - increase only");
   }
 
+  parse_churn_formula();
+
   if (getenv("AFL_PRELOAD")) {
     setenv("LD_PRELOAD", getenv("AFL_PRELOAD"), 1);
     setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
@@ -8776,7 +9340,6 @@ int main(int argc, char** argv) {
   check_cpu_governor();
 
   setup_post();
-  setup_shm();
   init_count_class16();
 
   setup_dirs_fds();
@@ -8795,6 +9358,10 @@ int main(int argc, char** argv) {
 
   check_binary(argv[optind]);
 
+  setup_shm();
+
+  if (san_path) setup_san();
+
   start_time = get_cur_time();
 
   if (qemu_mode)
@@ -8804,6 +9371,8 @@ int main(int argc, char** argv) {
 
   perform_dry_run(use_argv);
 
+  if (san_path) san_dry_run(use_argv);
+
   cull_queue();
 
   show_init_stats();
@@ -8912,11 +9481,13 @@ int main(int argc, char** argv) {
   if (stop_soon == 2) {
       if (child_pid > 0) kill(child_pid, SIGKILL);
       if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+      if (san_forksrv_pid > 0) kill(san_forksrv_pid, SIGKILL);
   }
   /* Now that we've killed the forkserver, we wait for it to be able to get rusage stats. */
   if (waitpid(forksrv_pid, NULL, 0) <= 0) {
     WARNF("error waitpid\n");
   }
+  if (san_forksrv_pid > 0) waitpid(san_forksrv_pid, NULL, 0);
 
   write_bitmap();
   write_stats_file(0, 0, 0);
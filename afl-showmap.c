@@ -36,6 +36,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "map-size.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -58,6 +59,8 @@ static s32 child_pid;                 /* PID of the tested program         */
 
 static u8* trace_bits;                /* SHM with instrumentation bitmap   */
 
+static u32 map_size = MAP_SIZE;       /* Bytes in the map of the target    */
+
 static u8 *out_file,                  /* Trace output file                 */
           *doc_path,                  /* Path to docs                      */
           *target_path,               /* Path to target binary             */
@@ -113,7 +116,7 @@ static const u8 count_class_binary[256] = {
 
 static void classify_counts(u8* mem, const u8* map) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -149,7 +152,7 @@ static void setup_shm(void) {
 
   u8* shm_str;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, map_size + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -198,10 +201,10 @@ static u32 write_results(void) {
 
   if (binary_mode) {
 
-    for (i = 0; i < MAP_SIZE; i++)
+    for (i = 0; i < map_size; i++)
       if (trace_bits[i]) ret++;
     
-    ck_write(fd, trace_bits, MAP_SIZE, out_file);
+    ck_write(fd, trace_bits, map_size, out_file);
     close(fd);
 
   } else {
@@ -210,7 +213,7 @@ static u32 write_results(void) {
 
     if (!f) PFATAL("fdopen() failed");
 
-    for (i = 0; i < MAP_SIZE; i++) {
+    for (i = 0; i < map_size; i++) {
 
       if (!trace_bits[i]) continue;
       ret++;
@@ -759,13 +762,16 @@ int main(int argc, char** argv) {
 
   if (optind == argc || !out_file) usage(argv[0]);
 
-  setup_shm();
   setup_signal_handlers();
 
   set_up_environment();
 
   find_binary(argv[optind]);
 
+  if (!qemu_mode) map_size = get_target_map_size(target_path, mem_limit, exec_tmout);
+
+  setup_shm();
+
   if (!quiet_mode) {
     show_banner();
     ACTF("Executing '%s'...\n", target_path);
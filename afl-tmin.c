@@ -34,6 +34,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "map-size.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -57,7 +58,10 @@ static s32 child_pid;                 /* PID of the tested program         */
 static u8 *trace_bits,                /* SHM with instrumentation bitmap   */
           *mask_bitmap;               /* Mask for trace bits (-B)          */
 
+static u32 map_size = MAP_SIZE;       /* Bytes in the map of the target    */
+
 static u8 *in_file,                   /* Minimizer input test case         */
+          *mask_file,                 /* Mask bitmap file (-B)             */
           *out_file,                  /* Minimizer output file             */
           *prog_in,                   /* Targeted program input file       */
           *target_path,               /* Path to target binary             */
@@ -107,7 +111,7 @@ static const u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
@@ -132,7 +136,7 @@ static void classify_counts(u8* mem) {
 
 static void apply_mask(u32* mem, u32* mask) {
 
-  u32 i = (MAP_SIZE >> 2);
+  u32 i = (map_size >> 2);
 
   if (!mask) return;
 
@@ -152,7 +156,7 @@ static void apply_mask(u32* mem, u32* mask) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
 
   while (i--) if (*(ptr++)) return 1;
 
@@ -178,7 +182,7 @@ static void setup_shm(void) {
 
   u8* shm_str;
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, map_size + WEIGHT_SHM, IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
@@ -266,7 +270,7 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
   s32 prog_in_fd;
   u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   prog_in_fd = write_to_file(prog_in, mem, len);
@@ -395,7 +399,7 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace_bits, map_size, HASH_CONST);
 
   if (first_run) orig_cksum = cksum;
 
@@ -970,7 +974,7 @@ static void read_bitmap(u8* fname) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_read(fd, mask_bitmap, MAP_SIZE, fname);
+  ck_read(fd, mask_bitmap, map_size, fname);
 
   close(fd);
 
@@ -1097,9 +1101,8 @@ int main(int argc, char** argv) {
            The option may be extended and made more official if it proves
            to be useful. */
 
-        if (mask_bitmap) FATAL("Multiple -B options not supported");
-        mask_bitmap = ck_alloc(MAP_SIZE);
-        read_bitmap(optarg);
+        if (mask_file) FATAL("Multiple -B options not supported");
+        mask_file = optarg;
         break;
 
       case 'V': /* Show version number */
@@ -1115,12 +1118,20 @@ int main(int argc, char** argv) {
 
   if (optind == argc || !in_file || !out_file) usage(argv[0]);
 
-  setup_shm();
   setup_signal_handlers();
 
   set_up_environment();
 
   find_binary(argv[optind]);
+
+  if (!qemu_mode) map_size = get_target_map_size(target_path, mem_limit, exec_tmout);
+
+  setup_shm();
+
+  if (mask_file) {
+    mask_bitmap = ck_alloc(map_size);
+    read_bitmap(mask_file);
+  }
   detect_file_args(argv + optind);
 
   if (qemu_mode)
@@ -59,6 +59,10 @@
 #define WORD_SIZE_64 1
 #endif
 
+/* Timeout multiplier for the sanitized build of dual-binary mode (-w): */
+
+#define SAN_TMOUT_MULT      3
+
 /* Default memory limit for child process (MB): */
 
 #ifndef WORD_SIZE_64
@@ -284,12 +288,17 @@
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
+#define MAP_SIZE_ENV_VAR    "__AFL_MAP_SIZE_QUERY"
 
 /* In-code signatures for deferred and persistent mode. */
 
 #define PERSIST_SIG         "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG           "##SIG_AFL_DEFER_FORKSRV##"
 
+/* ... and for binaries with the age, rank and churn channels. */
+
+#define CHANNELS_SIG        "##SIG_AFLCHURN_CHANNELS##"
+
 /* Distinctive bitmap signature used to indicate failed execution: */
 
 #define EXEC_FAIL_SIG       0xfee1dead
@@ -328,6 +337,16 @@
 #define MAP_SIZE_POW2       16
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* Binaries built in LTO mode number their edges and need a map of only as
+   many bytes, rounded up to MAP_SIZE_ALIGN. They report the size in the fork
+   server hello, flagged with FS_OPT_MAP_SIZE; everything else runs with
+   MAP_SIZE. An LTO map never grows past MAP_SIZE_MAX (2^MAP_SIZE_MAX_POW2). */
+
+#define MAP_SIZE_ALIGN      64
+#define MAP_SIZE_MAX_POW2   21
+#define MAP_SIZE_MAX        (1 << MAP_SIZE_MAX_POW2)
+#define FS_OPT_MAP_SIZE     0x80000000
+
 /* ACO: update frequency and coefficient */
 
 #define ACO_FREQENCY       30
@@ -356,10 +375,56 @@ enum{
 };
 
 
-/* Shared memory for Path weight. 
-8 bytes for weight (double); 8 for count (integer).
+/* Shared memory for Path weight, right after the map (MAP_SIZE or the size
+the binary reports).
+8 bytes for weight (double); 8 for count (integer); 8 for weight in fixed
+point (u64, written instead of the double with AFLCHURN_FIXED_POINT).
+Then, with AFLCHURN_CHANNELS, the age, rank and churn of the blocks on their
+own: for each, 8 bytes for the sum (u64, fixed point) and 8 for the count.
  */
-#define WEIGHT_SHM         16
+#define WEIGHT_SHM         72
+
+#define CHURN_CHANNEL_SHM  24
+#define CHURN_CHANNELS     3
+
+enum {
+  /* 00 */ CHURN_CH_AGE,
+  /* 01 */ CHURN_CH_RANK,
+  /* 02 */ CHURN_CH_CHURN
+};
+
+/* Fractional bits of the fixed-point weight */
+#define CHURN_FIXED_SHIFT  20
+
+/* AFLCHURN_THREAD_FITNESS: threads with a fitness slot of their own; the
+   ones after them share the last slot */
+#define CHURN_FITNESS_SLOTS  256
+
+/* ELF section with the weight of each edge, written by the LTO pass with
+   AFLCHURN_WEIGHT_TABLE. Records are a u32 edge ID and a float weight, in
+   the byte order of the target. */
+#define CHURN_WEIGHTS_SECTION  "aflchurn_weights"
+
+/* ELF section with what the pass knew about each block, written with
+   AFLCHURN_METADATA; the linker concatenates one chunk per module. A chunk
+   starts with five u32: CHURN_META_MAGIC, its size in bytes, flags
+   (CHURN_META_LTO: IDs are map indices; otherwise map indices are
+   (prev >> 1) ^ cur of two IDs), the number of blocks and of files. Then
+   come per block a u32 ID, file and line, and float age, churn and fitness
+   scores; then the file paths, NUL-terminated and padded to 4 bytes. All in
+   the byte order of the target. */
+#define CHURN_META_SECTION     "aflchurn_meta"
+#define CHURN_META_MAGIC       0x4d484341
+#define CHURN_META_LTO         1
+
+/* ELF section with the dictionary tokens of weighted blocks, written with
+   AFLCHURN_DICT; one chunk per module again. A chunk starts with three u32:
+   CHURN_DICT_MAGIC, its size in bytes and the number of tokens. Then come
+   per token a float weight (the best fitness of a block that uses it) and a
+   u32 length, and the bytes of the token padded to 4. In the byte order of
+   the target. */
+#define CHURN_DICT_SECTION     "aflchurn_dict"
+#define CHURN_DICT_MAGIC       0x44484341
 
 /* Threshold of ages and changes */
 // Always instrument a BB if its age is less than days
@@ -374,6 +439,23 @@ enum{
 
 #define WRONG_VALUE     0
 
+/* Default upper bound on the threads that compute line scores in the pass
+   (AFLCHURN_THREADS overrides it) */
+
+#define CHURN_MAX_THREADS   8
+
+/* Default name of the line-score index written by aflchurn-index */
+
+#define CHURN_INDEX_FILE  "aflchurn.idx"
+
+/* aflchurn-histd (AFLCHURN_HISTD): name of its socket in the .git directory
+   of the repository, how long the pass waits for a daemon that is still
+   starting (ms), and how long the daemon stays up without requests (s) */
+
+#define CHURN_HISTD_SOCKET  "aflchurn-histd.sock"
+#define CHURN_HISTD_WAIT    2000
+#define CHURN_HISTD_IDLE    900
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
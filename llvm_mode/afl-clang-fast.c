@@ -34,16 +34,34 @@
 #include "../types.h"
 #include "../debug.h"
 #include "../alloc-inl.h"
+#include "../hash.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifndef LLVM_MAJOR
+#  define LLVM_MAJOR 0
+#endif /* !LLVM_MAJOR */
 
 static u8*  obj_path;               /* Path to runtime libraries         */
 static u8** cc_params;              /* Parameters passed to the real CC  */
 static u32  cc_par_cnt = 1;         /* Param count, including argv0      */
 
+extern char** environ;
+
+static const char *src_exts[] = { ".c", ".cc", ".cpp", ".cxx", ".c++", ".C", NULL };
+
 
 /* Try to find the runtime libraries. If that fails, abort. */
 
@@ -99,15 +117,157 @@ static void find_obj(u8* argv0) {
 }
 
 
+/* Is this argument a source file? */
+
+static u8 is_source(u8* arg) {
+
+  u8 *ext = strrchr(arg, '.');
+  u32 e;
+
+  if (arg[0] == '-' || !ext) return 0;
+
+  for (e = 0; src_exts[e]; e++)
+    if (!strcmp(ext, src_exts[e])) return 1;
+
+  return 0;
+
+}
+
+
+/* The repository around path (or the current directory): the closest
+   directory with a .git directory in it, from malloc(), or NULL. */
+
+static u8* find_repo(u8* path) {
+
+  u8 *dir = path ? realpath(path, NULL) : getcwd(NULL, 0), *tmp;
+  struct stat st;
+  s32 e;
+
+  if (!dir) return NULL;
+
+  /* Walk up to the directory with .git in it. */
+
+  while (1) {
+
+    u8 *slash = strrchr(dir, '/');
+
+    tmp = alloc_printf("%s/.git", dir);
+    e = stat(tmp, &st);
+    ck_free(tmp);
+
+    if (!e || !slash || slash == dir) break;
+    *slash = 0;
+
+  }
+
+  if (e || !S_ISDIR(st.st_mode)) {
+    free(dir);
+    return NULL;
+  }
+
+  return dir;
+
+}
+
+
+/* AFLCHURN_HISTD: make sure that the repository of the sources being
+   compiled has an aflchurn-histd for the pass to talk to. The repository is
+   the one around the first source file on the command line (or the current
+   directory). The daemon is started detached and quits by itself if another
+   one got there first. If it cannot be started, the pass is told not to
+   wait for it. */
+
+static void start_histd(u32 argc, char** argv) {
+
+  u8 *dir, *src = NULL, *tmp, *histd;
+  struct sockaddr_un addr;
+  s32 fd, i, e;
+  pid_t pid;
+
+  for (i = 1; i < argc && !src; i++)
+    if (is_source(argv[i])) src = argv[i];
+
+  dir = find_repo(src);
+  if (!dir) goto no_histd;
+
+  tmp = alloc_printf("%s/.git/" CHURN_HISTD_SOCKET, dir);
+
+  if (strlen(tmp) >= sizeof(addr.sun_path)) {
+    ck_free(tmp);
+    goto no_histd;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, tmp);
+  ck_free(tmp);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) goto no_histd;
+
+  e = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+  close(fd);
+
+  if (!e) {
+    free(dir);
+    return;
+  }
+
+  histd = alloc_printf("%s/aflchurn-histd", obj_path);
+
+  if (access(histd, X_OK)) {
+    WARNF("Unable to find '%s', not using AFLCHURN_HISTD.", histd);
+    ck_free(histd);
+    goto no_histd;
+  }
+
+  pid = fork();
+
+  if (pid < 0) PFATAL("fork() failed");
+
+  if (!pid) {
+
+    s32 null_fd = open("/dev/null", O_RDWR);
+
+    setsid();
+    if (fork()) _exit(0);
+
+    dup2(null_fd, 0);
+    dup2(null_fd, 1);
+    dup2(null_fd, 2);
+    close(null_fd);
+
+    execl(histd, "aflchurn-histd", "-C", dir, (char*)NULL);
+    _exit(1);
+
+  }
+
+  waitpid(pid, NULL, 0);
+  ck_free(histd);
+  free(dir);
+  return;
+
+no_histd:
+
+  free(dir);
+  unsetenv("AFLCHURN_HISTD");
+
+}
+
+
 /* Copy argv to cc_params, making the necessary edits. */
 
 static void edit_params(u32 argc, char** argv) {
 
-  u8 fortify_set = 0, asan_set = 0, x_set = 0, bit_mode = 0;
+  u8 fortify_set = 0, asan_set = 0, x_set = 0, bit_mode = 0, lto_mode = 0;
   u8 *name;
+  u32 i;
 
   cc_params = ck_alloc((argc + 128) * sizeof(u8*));
 
+  for (i = 1; i < argc; i++)
+    if (!strncmp(argv[i], "-flto", 5)) lto_mode = 1;
+
   name = strrchr(argv[0], '/');
   if (!name) name = argv[0]; else name++;
 
@@ -133,10 +293,45 @@ static void edit_params(u32 argc, char** argv) {
   cc_params[cc_par_cnt++] = "-sanitizer-coverage-block-threshold=0";
 #endif
 #else
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = "-load";
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = alloc_printf("%s/afl-llvm-pass.so", obj_path);
+
+  /* With -flto, the pass runs once, when lld links the program, and sees all
+     of it: edges get sequential IDs instead of random ones, and the churn of
+     every source file is computed in one place. Compiling to bitcode needs
+     no pass at all. The linker flags are unused for -c and friends, which
+     -Qunused-arguments keeps quiet about. */
+
+  if (lto_mode) {
+
+#if LLVM_MAJOR >= 15
+    cc_params[cc_par_cnt++] = "-fuse-ld=lld";
+    cc_params[cc_par_cnt++] =
+      alloc_printf("-Wl,--load-pass-plugin=%s/afl-llvm-pass.so", obj_path);
+#elif LLVM_MAJOR >= 11
+    cc_params[cc_par_cnt++] = "-fuse-ld=lld";
+#  if LLVM_MAJOR >= 13
+    cc_params[cc_par_cnt++] = "-Wl,--lto-legacy-pass-manager";
+#  endif /* LLVM_MAJOR >= 13 */
+    cc_params[cc_par_cnt++] =
+      alloc_printf("-Wl,-mllvm=-load=%s/afl-llvm-pass.so", obj_path);
+#else
+    FATAL("LTO mode (-flto) needs LLVM 11 or newer");
+#endif /* ^LLVM_MAJOR >= 15 */
+
+  } else {
+
+#if LLVM_MAJOR >= 13
+    /* The new pass manager is the default; it only runs plugins. */
+    cc_params[cc_par_cnt++] =
+      alloc_printf("-fpass-plugin=%s/afl-llvm-pass.so", obj_path);
+#else
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/afl-llvm-pass.so", obj_path);
+#endif /* ^LLVM_MAJOR >= 13 */
+
+  }
+
 #endif /* ^USE_TRACE_PC */
 
   cc_params[cc_par_cnt++] = "-Qunused-arguments";
@@ -150,6 +345,10 @@ static void edit_params(u32 argc, char** argv) {
 
     if (!strcmp(cur, "-x")) x_set = 1;
 
+    /* ThinLTO never has the whole program in one module. */
+
+    if (!strcmp(cur, "-flto=thin")) cur = "-flto=full";
+
     if (!strcmp(cur, "-fsanitize=address") ||
         !strcmp(cur, "-fsanitize=memory")) asan_set = 1;
 
@@ -308,6 +507,915 @@ static void edit_params(u32 argc, char** argv) {
 }
 
 
+/* Run args (in dir, if given) with stdout going to a buffer, which is
+   returned with its length. stderr goes to /dev/null. The buffer is padded
+   with at least eight zero bytes, for hash32(). status is -1 if the command
+   could not be run. */
+
+static u8* run_capture(u8* dir, u8** args, u32* len, s32* status) {
+
+  u8 *buf = ck_alloc(4096);
+  u32 size = 4096, pos = 0;
+  s32 fds[2], n;
+  pid_t pid;
+
+  *status = -1;
+
+  if (pipe(fds)) PFATAL("pipe() failed");
+
+  pid = fork();
+
+  if (pid < 0) PFATAL("fork() failed");
+
+  if (!pid) {
+
+    s32 null_fd = open("/dev/null", O_RDWR);
+
+    if (dir && chdir(dir)) _exit(1);
+
+    dup2(fds[1], 1);
+    dup2(null_fd, 2);
+    close(fds[0]);
+    close(fds[1]);
+    close(null_fd);
+
+    execvp(args[0], (char**)args);
+    _exit(1);
+
+  }
+
+  close(fds[1]);
+
+  while ((n = read(fds[0], buf + pos, size - pos - 8)) > 0) {
+
+    pos += n;
+
+    if (size - pos <= 8) {
+      size *= 2;
+      buf = ck_realloc(buf, size);
+    }
+
+  }
+
+  close(fds[0]);
+
+  memset(buf + pos, 0, size - pos);
+  *len = pos;
+
+  if (waitpid(pid, status, 0) <= 0) *status = -1;
+
+  return buf;
+
+}
+
+
+/* The first word of what a command prints, or "-". */
+
+static u8* first_word(u8* dir, u8** args) {
+
+  u32 len;
+  s32 status;
+  u8 *out = run_capture(dir, args, &len, &status), *ret;
+
+  out[strcspn(out, " \t\n")] = 0;
+  ret = alloc_printf("%s", (status || !out[0]) ? (u8*)"-" : out);
+  ck_free(out);
+
+  return ret;
+
+}
+
+
+/* Copy a file through a temporary one, so that readers never see half of it. */
+
+static u8 copy_file(u8* from, u8* to) {
+
+  u8 buf[65536], *tmp = alloc_printf("%s.%u.tmp", to, getpid());
+  s32 in_fd, out_fd, n;
+  u8 ok = 1;
+
+  in_fd = open(from, O_RDONLY);
+
+  if (in_fd < 0) {
+    ck_free(tmp);
+    return 0;
+  }
+
+  out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  if (out_fd < 0) {
+    close(in_fd);
+    ck_free(tmp);
+    return 0;
+  }
+
+  while ((n = read(in_fd, buf, sizeof(buf))) > 0)
+    if (write(out_fd, buf, n) != n) ok = 0;
+
+  if (n < 0) ok = 0;
+
+  close(in_fd);
+  if (close(out_fd)) ok = 0;
+
+  if (!ok || rename(tmp, to)) {
+    unlink(tmp);
+    ok = 0;
+  }
+
+  ck_free(tmp);
+  return ok;
+
+}
+
+
+/* Append a line to a cache key. */
+
+static void add_key(u8** key, u8* line) {
+
+  u8* tmp = alloc_printf("%s%s\n", *key, line);
+
+  ck_free(*key);
+  ck_free(line);
+  *key = tmp;
+
+}
+
+
+static int cmp_str(const void* a, const void* b) {
+
+  return strcmp(*(u8**)a, *(u8**)b);
+
+}
+
+
+/* Name of a cache file for key: two hashes of it, padded for hash32(). */
+
+static u8* key_name(u8* key) {
+
+  u32 len = strlen(key);
+  u8 *buf = ck_alloc((len + 7) & ~7), *ret;
+
+  memcpy(buf, key, len);
+  ret = alloc_printf("%08x%08x", hash32(buf, (len + 7) & ~7, HASH_CONST),
+                     hash32(buf, (len + 7) & ~7, ~HASH_CONST));
+  ck_free(buf);
+
+  return ret;
+
+}
+
+
+/* A whole (small) file as a string, without its trailing newline, or NULL. */
+
+static u8* read_text(u8* fn) {
+
+  u8 buf[4096], *ret = NULL;
+  s32 fd = open(fn, O_RDONLY), n;
+  u32 len = 0;
+
+  if (fd < 0) return NULL;
+
+  ret = ck_alloc(1);
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    ret = ck_realloc(ret, len + n + 1);
+    memcpy(ret + len, buf, n);
+    len += n;
+  }
+
+  close(fd);
+
+  if (n < 0) {
+    ck_free(ret);
+    return NULL;
+  }
+
+  ret[len] = 0;
+  while (len && ret[len - 1] == '\n') ret[--len] = 0;
+
+  return ret;
+
+}
+
+
+/* Write a file unless it exists: the first writer wins, and readers never
+   see half of it. */
+
+static void write_once(u8* fn, u8* data) {
+
+  u8* tmp = alloc_printf("%s.%u.tmp", fn, getpid());
+  FILE* f = fopen(tmp, "w");
+
+  if (f) {
+
+    fprintf(f, "%s\n", data);
+    if (fclose(f) || link(tmp, fn)) { /* Ignore errors */ }
+    unlink(tmp);
+
+  }
+
+  ck_free(tmp);
+
+}
+
+
+/* The real compiler as "<path> <size> <mtime>", looked up in PATH like
+   execvp() does, so that upgrading it invalidates the cache. */
+
+static u8* get_cc_id(u8* name) {
+
+  u8 *path = getenv("PATH"), *real = NULL, *ret;
+  struct stat st;
+
+  if (strchr(name, '/')) real = realpath(name, NULL);
+
+  while (!real && path && *path) {
+
+    u32 dir_len = strcspn(path, ":");
+    u8* tmp = alloc_printf("%.*s/%s", dir_len, path, name);
+
+    if (!access(tmp, X_OK)) real = realpath(tmp, NULL);
+
+    ck_free(tmp);
+    path += dir_len + (path[dir_len] == ':');
+
+  }
+
+  if (!real || stat(real, &st)) {
+    free(real);
+    return alloc_printf("%s - -", name);
+  }
+
+  ret = alloc_printf("%s %llu %llu", real, (u64)st.st_size, (u64)st.st_mtime);
+  free(real);
+
+  return ret;
+
+}
+
+
+/* Start of the AFLCHURN_SINCE_MONTHS window, rounded down to the day, as
+   the pass resolves it (get_churn_since_time()); 0 if unset. */
+
+static u64 get_since_time(void) {
+
+  u8* ch_month = getenv("AFLCHURN_SINCE_MONTHS");
+  time_t now = time(NULL);
+  struct tm since;
+
+  if (!ch_month || !*ch_month || ch_month[strspn(ch_month, "0123456789")])
+    return 0;
+
+  localtime_r(&now, &since);
+  since.tm_mon -= atoi(ch_month);
+
+  return (u64)mktime(&since) / 86400 * 86400;
+
+}
+
+
+/* The last commit that touched each of the repository-relative paths, or
+   "-". Kept in the cache per HEAD, one "<commit> <path>" line per file, so
+   that a build asks git once for every file it has not seen at this HEAD:
+   a single git log over those paths, newest first. */
+
+static void get_last_commits(u8* cache_dir, u8* repo, u8* head, u8** rels,
+                             u32 cnt, u8** last) {
+
+  u8 *fn = alloc_printf("%s/%s.last", cache_dir, head), *known = read_text(fn);
+  u8 **git_args, *out, *line, *sha = NULL;
+  u32 i, missing = 0, len;
+  s32 status, fd;
+
+  for (i = 0; i < cnt; i++) {
+
+    u8* pos = known;
+    u32 rel_len = strlen(rels[i]);
+
+    last[i] = NULL;
+
+    /* "<40 hex> <path>\n" */
+
+    while (pos && (pos = strstr(pos, rels[i]))) {
+
+      if (pos - known >= 41 && pos[-1] == ' ' && (pos == known + 41 || pos[-42] == '\n') &&
+          (!pos[rel_len] || pos[rel_len] == '\n')) {
+        last[i] = alloc_printf("%.40s", pos - 41);
+        break;
+      }
+
+      pos++;
+
+    }
+
+    if (!last[i]) missing++;
+
+  }
+
+  if (known) ck_free(known);
+
+  if (!missing) {
+    ck_free(fn);
+    return;
+  }
+
+  git_args = ck_alloc((missing + 8) * sizeof(u8*));
+  git_args[0] = "git";
+  git_args[1] = "log";
+  git_args[2] = "--format=%x01%H";
+  git_args[3] = "--name-only";
+  git_args[4] = "HEAD";
+  git_args[5] = "--";
+  missing = 6;
+
+  for (i = 0; i < cnt; i++)
+    if (!last[i]) git_args[missing++] = rels[i];
+
+  out = run_capture(repo, git_args, &len, &status);
+  if (status) out[0] = 0;
+
+  for (line = out; *line; ) {
+
+    u8* nl = strchr(line, '\n');
+
+    if (nl) *nl = 0;
+
+    if (line[0] == 1) sha = line + 1;
+    else if (sha && line[0]) {
+
+      for (i = 0; i < cnt; i++)
+        if (!last[i] && !strcmp(line, rels[i])) last[i] = ck_strdup(sha);
+
+    }
+
+    if (!nl) break;
+    line = nl + 1;
+
+  }
+
+  ck_free(out);
+  ck_free(git_args);
+
+  /* Appends of whole lines, so concurrent compiler processes can share it */
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+  for (i = 0; i < cnt; i++) {
+
+    if (!last[i]) {
+      last[i] = ck_strdup("-");
+      continue;
+    }
+
+    if (fd >= 0 && strlen(last[i]) == 40) {
+      u8* rec = alloc_printf("%s %s\n", last[i], rels[i]);
+      if (write(fd, rec, strlen(rec)) < 0) { /* Ignore errors */ }
+      ck_free(rec);
+    }
+
+  }
+
+  if (fd >= 0) close(fd);
+  ck_free(fn);
+
+}
+
+
+/* What the scores of a repository depend on at HEAD, beyond the history of
+   each file: the days of HEAD and of the first commit (ages), and the number
+   of commits (ranks). Computed once per HEAD and kept in the cache. */
+
+static void get_head_info(u8* cache_dir, u8* repo, u8* head,
+                          u64* head_days, u64* init_days, u64* commits) {
+
+  static u8* time_args[] = { "git", "show", "-s", "--format=%ct", "HEAD", NULL };
+  static u8* init_args[] = { "sh", "-c",
+    "git log --reverse --date=unix --oneline --format=%cd | head -n1", NULL };
+  static u8* count_args[] = { "git", "rev-list", "--count", "HEAD", NULL };
+
+  u8 *fn = alloc_printf("%s/%s.head", cache_dir, head), *tmp, *out;
+  FILE* f = fopen(fn, "r");
+
+  if (f) {
+
+    s32 got = fscanf(f, "%llu %llu %llu", head_days, init_days, commits);
+
+    fclose(f);
+
+    if (got == 3) {
+      ck_free(fn);
+      return;
+    }
+
+  }
+
+  out = first_word(repo, time_args);
+  *head_days = strtoull(out, NULL, 10) / 86400;
+  ck_free(out);
+
+  out = first_word(repo, init_args);
+  *init_days = strtoull(out, NULL, 10) / 86400;
+  ck_free(out);
+
+  out = first_word(repo, count_args);
+  *commits = strtoull(out, NULL, 10);
+  ck_free(out);
+
+  tmp = alloc_printf("%s.%u.tmp", fn, getpid());
+  f = fopen(tmp, "w");
+
+  if (f) {
+
+    fprintf(f, "%llu %llu %llu\n", *head_days, *init_days, *commits);
+
+    if (fclose(f) || rename(tmp, fn)) unlink(tmp);
+
+  }
+
+  ck_free(tmp);
+  ck_free(fn);
+
+}
+
+
+/* AFLCHURN_OBJ_CACHE: reuse instrumented objects. The output of the pass
+   depends on more than the source and the flags, so the key of an object is
+   made of:
+
+   - the preprocessed source (with line markers, which carry the paths),
+     the real compiler and its parameters, and the working directory,
+
+   - the pass itself and the AFLChurn settings from the environment, with
+     the day the AFLCHURN_SINCE_MONTHS window starts instead of the option,
+
+   - for every file of the repository that the preprocessed source comes
+     from: its blob, and a digest of its line scores at HEAD as the pass
+     reported them (AFLCHURN_SCORE_DIGEST),
+
+   - and the span of the history in days, if ages are scored, since the
+     thresholds of the pass depend on it.
+
+   A score digest is kept per file, under what the scores are made of: the
+   settings, the blob, the last commit that touched the file, and what HEAD
+   adds to them (the days of HEAD and of the first commit for ages, the
+   number of commits for ranks). Files whose digest is not known yet make
+   a miss; the compile then records them. A file the pass has no code of
+   gets "-" for its digest.
+
+   Random edge IDs do not matter: any of them is as good as a new one.
+   Compiles with an AFLCHURN_HISTORY_MS budget are not cached, since the
+   scores depend on how far the history got in time.
+   Only plain compiles of one source file (-c) are cached; with -flto, the
+   pass runs when the program is linked. Returns if there is nothing to do,
+   exits with the status of the compiler otherwise. */
+
+static void run_obj_cache(u32 argc, char** argv) {
+
+  static const char *skip_env[] = { "AFLCHURN_OBJ_CACHE=", "AFLCHURN_CACHE_DIR=",
+    "AFLCHURN_DISABLE_CACHE=", "AFLCHURN_HISTD=", "AFLCHURN_PROFILE=",
+    "AFLCHURN_THREADS=", "AFLCHURN_SCORE_DIGEST=", "AFLCHURN_SINCE_MONTHS=", NULL };
+
+  u8 *cache_dir = getenv("AFLCHURN_OBJ_CACHE"), *src = NULL, *obj = NULL;
+  u8 *key, *settings, *entry, *entry_key, *pp, *line, *repo, *cwd, *tmp;
+  u8 *head = NULL, *head_key = NULL, *digest_fn = NULL;
+  u8 compile = 0, deps = 0, dep_file = 0, dep_target = 0;
+  u8 **pp_params, **files = NULL, **envs = NULL, **rels = NULL, **blob_ids = NULL;
+  u8 **recs = NULL, **digests = NULL;
+  u32 pp_cnt = 0, file_cnt = 0, env_cnt = 0, len, i, e;
+  u64 head_days = 0, init_days = 0, commits = 0;
+  s32 status;
+  struct stat st;
+  pid_t pid;
+  FILE* f;
+
+  for (i = 1; i < argc; i++) {
+
+    u8* cur = argv[i];
+
+    if (!strcmp(cur, "-c")) compile = 1;
+    else if (!strcmp(cur, "-E") || !strcmp(cur, "-S") || !strcmp(cur, "-M") ||
+             !strcmp(cur, "-MM") || !strcmp(cur, "-emit-llvm") ||
+             !strncmp(cur, "-flto", 5) || !strcmp(cur, "-")) return;
+    else if (!strcmp(cur, "-o")) { if (++i < argc) obj = argv[i]; }
+    else if (!strncmp(cur, "-o", 2)) obj = cur + 2;
+    else if (!strcmp(cur, "-MD") || !strcmp(cur, "-MMD")) deps = 1;
+    else if (!strncmp(cur, "-MF", 3)) dep_file = 1;
+    else if (!strncmp(cur, "-MT", 3) || !strncmp(cur, "-MQ", 3)) dep_target = 1;
+    else if (is_source(cur)) {
+      if (src) return;
+      src = cur;
+    }
+
+  }
+
+  if (!compile || !src) return;
+
+  /* A time budget cuts the history wherever the clock says: no two
+     compiles are known to score alike. */
+
+  tmp = getenv("AFLCHURN_HISTORY_MS");
+
+  if (tmp && *tmp && !tmp[strspn(tmp, "0123456789")] && strtoull(tmp, NULL, 10))
+    return;
+
+  if (mkdir(cache_dir, 0700) && errno != EEXIST) {
+    WARNF("Unable to create object cache '%s', not caching.", cache_dir);
+    return;
+  }
+
+  if (!obj) {
+
+    u8 *base = strrchr(src, '/');
+
+    base = ck_strdup(base ? base + 1 : src);
+    *strrchr(base, '.') = 0;
+    obj = alloc_printf("%s.o", base);
+    ck_free(base);
+
+  }
+
+  /* Preprocess with the parameters of the compile: -E instead of -c, to
+     stdout. Dependency files are written here, named after the object as
+     they would be by the compile, so that a hit leaves them up to date. */
+
+  pp_params = ck_alloc((cc_par_cnt + 8) * sizeof(u8*));
+
+  for (i = 0; i < cc_par_cnt; i++) {
+
+    if (!strcmp(cc_params[i], "-c")) continue;
+    if (!strcmp(cc_params[i], "-o")) { i++; continue; }
+    if (i && !strncmp(cc_params[i], "-o", 2)) continue;
+
+    pp_params[pp_cnt++] = cc_params[i];
+
+  }
+
+  pp_params[pp_cnt++] = "-E";
+
+  if (deps && !dep_file) {
+
+    tmp = ck_strdup(obj);
+    if (strrchr(tmp, '.') > strrchr(tmp, '/')) *strrchr(tmp, '.') = 0;
+
+    pp_params[pp_cnt++] = "-MF";
+    pp_params[pp_cnt++] = alloc_printf("%s.d", tmp);
+    ck_free(tmp);
+
+  }
+
+  if (deps && !dep_target) {
+    pp_params[pp_cnt++] = "-MT";
+    pp_params[pp_cnt++] = obj;
+  }
+
+  pp = run_capture(NULL, pp_params, &len, &status);
+
+  /* Let the compiler report whatever went wrong. */
+
+  if (status) {
+    ck_free(pp);
+    return;
+  }
+
+  cwd = getcwd(NULL, 0);
+  if (!cwd) FATAL("Unable to get the current directory");
+
+  key = alloc_printf("aflchurn-obj " VERSION "\n");
+
+  tmp = alloc_printf("%s/afl-llvm-pass.so", obj_path);
+  if (stat(tmp, &st)) memset(&st, 0, sizeof(st));
+  ck_free(tmp);
+
+  add_key(&key, alloc_printf("pass %llu %llu", (u64)st.st_size, (u64)st.st_mtime));
+  add_key(&key, alloc_printf("cc %s", tmp = get_cc_id(cc_params[0])));
+  ck_free(tmp);
+  add_key(&key, alloc_printf("cwd %s", cwd));
+
+  for (i = 0; i < cc_par_cnt; i++)
+    add_key(&key, alloc_printf("arg %s", cc_params[i]));
+
+  for (i = 0; environ[i]; i++) {
+
+    if (strncmp(environ[i], "AFLCHURN_", 9) &&
+        strncmp(environ[i], "AFL_INST_RATIO=", 15)) continue;
+
+    for (e = 0; skip_env[e]; e++)
+      if (!strncmp(environ[i], skip_env[e], strlen(skip_env[e]))) break;
+
+    if (skip_env[e]) continue;
+
+    envs = ck_realloc(envs, (env_cnt + 1) * sizeof(u8*));
+    envs[env_cnt++] = environ[i];
+
+  }
+
+  /* The order of the environment is not part of the key. The settings also
+     go into the key of each score digest. */
+
+  if (env_cnt) qsort(envs, env_cnt, sizeof(u8*), cmp_str);
+
+  settings = ck_alloc(1);
+
+  for (i = 0; i < env_cnt; i++)
+    add_key(&settings, alloc_printf("env %s", envs[i]));
+
+  /* The window of AFLCHURN_SINCE_MONTHS moves with the clock: the day it
+     starts on, not the option, is what the scores depend on. */
+
+  if (get_since_time())
+    add_key(&settings, alloc_printf("since %llu", get_since_time()));
+
+  if (getenv("AFLCHURN_INDEX") && !stat(getenv("AFLCHURN_INDEX"), &st))
+    add_key(&settings, alloc_printf("index %llu %llu", (u64)st.st_size, (u64)st.st_mtime));
+
+  tmp = alloc_printf("%s%s", key, settings);
+  ck_free(key);
+  key = tmp;
+
+  add_key(&key, alloc_printf("src %u %08x%08x", len, hash32(pp, (len + 7) & ~7, HASH_CONST),
+                             hash32(pp, (len + 7) & ~7, ~HASH_CONST)));
+
+  repo = find_repo(src);
+
+  /* The files of the repository, from the line markers: # <line> "<path>" */
+
+  line = pp;
+
+  while (repo && line < pp + len) {
+
+    u8 *nl = memchr(line, '\n', pp + len - line), *path, *out, *real;
+
+    if (!nl) nl = pp + len;
+    *nl = 0;
+
+    if (line[0] == '#' && line[1] == ' ' && isdigit(line[2]) &&
+        (path = strchr(line, '"')) && path[1] != '<') {
+
+      u8* start = out = ++path;
+
+      while (*path && *path != '"') {
+        if (*path == '\\' && path[1]) path++;
+        *out++ = *path++;
+      }
+
+      *out = 0;
+
+      real = realpath(start, NULL);
+
+      if (real && !strncmp(real, repo, strlen(repo)) && real[strlen(repo)] == '/') {
+
+        for (e = 0; e < file_cnt; e++)
+          if (!strcmp(files[e], real)) break;
+
+        if (e == file_cnt) {
+          files = ck_realloc(files, (file_cnt + 1) * sizeof(u8*));
+          files[file_cnt++] = ck_strdup(real);
+        }
+
+      }
+
+      free(real);
+
+    }
+
+    line = nl + 1;
+
+  }
+
+  ck_free(pp);
+
+  if (repo) {
+
+    static u8* head_args[] = { "git", "rev-parse", "HEAD", NULL };
+    u8 *rank_env = getenv("AFLCHURN_ENABLE_RANK"),
+       *channels = getenv("AFLCHURN_CHANNELS");
+    u8 **git_args, **lasts, *blobs, *blob;
+
+    head = first_word(repo, head_args);
+
+    /* Without a HEAD, leave it all to the compiler. */
+
+    if (!strcmp(head, "-")) return;
+
+    get_head_info(cache_dir, repo, head, &head_days, &init_days, &commits);
+
+    head_key = ck_alloc(1);
+
+    if (channels || (!getenv("AFLCHURN_DISABLE_AGE") && !rank_env)) {
+      add_key(&head_key, alloc_printf("age %llu %llu", head_days, init_days));
+      add_key(&key, alloc_printf("span %llu", head_days - init_days));
+    }
+
+    if (channels || rank_env)
+      add_key(&head_key, alloc_printf("rank %llu", commits));
+
+    /* One git hash-object for all blobs, one git log for the last commits
+       that are not known at this HEAD yet. */
+
+    rels     = ck_alloc((file_cnt + 1) * sizeof(u8*));
+    blob_ids = ck_alloc((file_cnt + 1) * sizeof(u8*));
+    lasts    = ck_alloc((file_cnt + 1) * sizeof(u8*));
+    recs     = ck_alloc((file_cnt + 1) * sizeof(u8*));
+    digests  = ck_alloc((file_cnt + 1) * sizeof(u8*));
+
+    for (i = 0; i < file_cnt; i++) rels[i] = files[i] + strlen(repo) + 1;
+
+    git_args = ck_alloc((file_cnt + 8) * sizeof(u8*));
+    git_args[0] = "git";
+    git_args[1] = "hash-object";
+    git_args[2] = "--";
+
+    for (i = 0; i < file_cnt; i++) git_args[i + 3] = files[i];
+
+    blobs = file_cnt ? run_capture(repo, git_args, &len, &status) : NULL;
+    if (blobs && status) blobs[0] = 0;
+
+    ck_free(git_args);
+
+    get_last_commits(cache_dir, repo, head, rels, file_cnt, lasts);
+
+    blob = blobs;
+
+    for (i = 0; i < file_cnt; i++) {
+
+      u8 *nl = blob ? strchr(blob, '\n') : NULL, *name;
+
+      if (nl) *nl = 0;
+
+      blob_ids[i] = ck_strdup((nl && *blob) ? blob : (u8*)"-");
+
+      /* What the scores of the file are made of */
+
+      tmp = alloc_printf("aflchurn-score " VERSION "\n%sfile %s %s %s\n%s", settings,
+                         rels[i], blob_ids[i], lasts[i], head_key);
+      name = key_name(tmp);
+      recs[i] = alloc_printf("%s/%s.score", cache_dir, name);
+      ck_free(name);
+      ck_free(tmp);
+
+      digests[i] = read_text(recs[i]);
+      ck_free(lasts[i]);
+      blob = nl ? nl + 1 : NULL;
+
+    }
+
+    if (blobs) ck_free(blobs);
+    ck_free(lasts);
+
+  }
+
+  /* Every digest known: the key is complete, look the object up. */
+
+  for (i = 0; i < file_cnt; i++)
+    if (!digests[i]) break;
+
+  entry = NULL;
+
+  if (i == file_cnt) {
+
+    u8* name;
+
+    for (i = 0; i < file_cnt; i++)
+      add_key(&key, alloc_printf("file %s %s %s", rels[i], blob_ids[i], digests[i]));
+
+    name = key_name(key);
+    entry = alloc_printf("%s/%s", cache_dir, name);
+    ck_free(name);
+
+    /* The whole key is kept next to the object to rule out collisions. */
+
+    tmp = alloc_printf("%s.key", entry);
+    f = fopen(tmp, "r");
+    ck_free(tmp);
+
+    if (f) {
+
+      u32 key_len = strlen(key);
+
+      entry_key = ck_alloc(key_len + 2);
+      len = fread(entry_key, 1, key_len + 1, f);
+      fclose(f);
+
+      tmp = alloc_printf("%s.o", entry);
+
+      if (len == key_len && !memcmp(entry_key, key, key_len) && copy_file(tmp, obj)) {
+
+        if (isatty(2) && !getenv("AFL_QUIET"))
+          OKF("Reused '%s' from the object cache.", obj);
+
+        exit(0);
+
+      }
+
+      ck_free(tmp);
+      ck_free(entry_key);
+
+    }
+
+  } else {
+
+    /* The pass tells what the scores came out as. */
+
+    digest_fn = alloc_printf("%s/%s.%u.digest", cache_dir, head, getpid());
+    unlink(digest_fn);
+    setenv("AFLCHURN_SCORE_DIGEST", digest_fn, 1);
+
+  }
+
+  /* A miss: compile, then store the object, and its key once the object is
+     there. Concurrent misses publish the same thing. */
+
+  pid = fork();
+
+  if (pid < 0) PFATAL("fork() failed");
+
+  if (!pid) {
+
+    execvp(cc_params[0], (char**)cc_params);
+    FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
+
+  }
+
+  if (waitpid(pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+  if (!WIFEXITED(status)) exit(1);
+  if (WEXITSTATUS(status)) exit(WEXITSTATUS(status));
+
+  if (digest_fn) {
+
+    /* "<path> <digest>" per file the pass has code of. Record the digest of
+       every file whose record is missing, then key on what the records say:
+       another process may have been first. */
+
+    u8 *reported = read_text(digest_fn), *name;
+
+    unlink(digest_fn);
+
+    if (!reported) exit(0);
+
+    for (i = 0; i < file_cnt; i++) {
+
+      u8 *pos = reported, *digest = "-";
+      u32 rel_len = strlen(rels[i]);
+
+      while ((pos = strstr(pos, rels[i]))) {
+
+        if ((pos == reported || pos[-1] == '\n') && pos[rel_len] == ' ') {
+          digest = alloc_printf("%.*s", (u32)strcspn(pos + rel_len + 1, "\n"),
+                                pos + rel_len + 1);
+          break;
+        }
+
+        pos++;
+
+      }
+
+      if (!digests[i]) {
+        write_once(recs[i], digest);
+        digests[i] = read_text(recs[i]);
+        if (!digests[i]) exit(0);
+      }
+
+      if (strcmp(digest, "-")) ck_free(digest);
+
+      add_key(&key, alloc_printf("file %s %s %s", rels[i], blob_ids[i], digests[i]));
+
+    }
+
+    ck_free(reported);
+
+    name = key_name(key);
+    entry = alloc_printf("%s/%s", cache_dir, name);
+    ck_free(name);
+
+  }
+
+  tmp = alloc_printf("%s.o", entry);
+
+  if (copy_file(obj, tmp)) {
+
+    u8 *key_fn = alloc_printf("%s.key", entry),
+       *key_tmp = alloc_printf("%s.%u.tmp", key_fn, getpid());
+
+    f = fopen(key_tmp, "w");
+
+    if (f) {
+
+      fputs(key, f);
+      if (fclose(f) || rename(key_tmp, key_fn)) unlink(key_tmp);
+
+    }
+
+    ck_free(key_tmp);
+    ck_free(key_fn);
+
+  }
+
+  exit(0);
+
+}
+
+
 /* Main entry point */
 
 int main(int argc, char** argv) {
@@ -336,7 +1444,10 @@ int main(int argc, char** argv) {
          "an LLVM pass and tends to offer improved performance with slow programs.\n\n"
 
          "You can specify custom next-stage toolchain via AFL_CC and AFL_CXX. Setting\n"
-         "AFL_HARDEN enables hardening optimizations in the compiled code.\n\n",
+         "AFL_HARDEN enables hardening optimizations in the compiled code.\n\n"
+
+         "With -flto (and lld), the program is instrumented as a whole when it is\n"
+         "linked, which gives every edge an ID of its own.\n\n",
          BIN_PATH, BIN_PATH);
 
     exit(1);
@@ -348,8 +1459,14 @@ int main(int argc, char** argv) {
   find_obj(argv[0]);
 #endif
 
+  if (getenv("AFLCHURN_HISTD")) start_histd(argc, argv);
+
   edit_params(argc, argv);
 
+#ifndef USE_TRACE_PC
+  if (getenv("AFLCHURN_OBJ_CACHE")) run_obj_cache(argc, argv);
+#endif /* !USE_TRACE_PC */
+
   execvp(cc_params[0], (char**)cc_params);
 
   FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
@@ -33,6 +33,10 @@
 
 #include "../config.h"
 #include "../debug.h"
+#include "../hash.h"
+
+#include "churn-history.h"
+#include "churn-index.h"
 
 //#include <string.h>
 #include <set>
@@ -49,16 +53,47 @@
 #include <string>
 #include <sstream>
 #include <list>
+#include <tuple>
+#include <functional>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+#if LLVM_VERSION_MAJOR >= 11
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#endif
 
 #include "llvm/Support/CommandLine.h"
 #include "llvm/IR/DebugLoc.h"
@@ -70,6 +105,11 @@
 using namespace llvm;
 
 
+/* The instrumentation itself; lto is set when M is the whole program, merged
+   at link time, rather than a single translation unit. */
+
+bool instrument_churn_module(Module &M, bool lto);
+
 namespace {
 
   class AFLCoverage : public ModulePass {
@@ -78,9 +118,15 @@ namespace {
 
       static char ID;
 
-      AFLCoverage() : ModulePass(ID) { }
+      AFLCoverage(bool lto = false) : ModulePass(ID), lto(lto) { }
 
-      bool runOnModule(Module &M) override;
+      bool runOnModule(Module &M) override {
+        return instrument_churn_module(M, lto);
+      }
+
+    private:
+
+      bool lto;
 
       // StringRef getPassName() const override {
       //  return "American Fuzzy Lop Instrumentation";
@@ -161,6 +207,9 @@ double inst_norm_change(unsigned int num_changes, unsigned short change_select){
 }
 
 
+/* git processes started by the pass itself, for AFLCHURN_PROFILE */
+static unsigned long long pass_subprocess_count = 0;
+
 /* use popen() to execute git command */
 std::string execute_git_cmd (std::string directory, std::string str_cmd){
   FILE *fp;
@@ -172,6 +221,7 @@ std::string execute_git_cmd (std::string directory, std::string str_cmd){
           << directory
           << " && "
           << str_cmd;
+  pass_subprocess_count++;
   fp = popen(git_cmd.str().c_str(), "r");
 	if(NULL == fp) return str_res;
 	// when cmd fail, output "fatal: ...";
@@ -220,329 +270,98 @@ int get_threshold_changes(std::string directory){
   return change_threshold;
 }
 
-/* if return value is 0, something wrong happens */
-unsigned long get_commit_time_days(std::string directory, std::string git_cmd){
-  unsigned long unix_time = 0;
-  FILE *dfp;
-  std::ostringstream datecmd;
-
-  datecmd << "cd " << directory
-          << " && "
-          << git_cmd;
-  dfp = popen(datecmd.str().c_str(), "r");
-
-  if (NULL == dfp) return WRONG_VALUE;
-  if (fscanf(dfp, "%lu", &unix_time) != 1) return WRONG_VALUE;
-  pclose(dfp);
-
-  return unix_time / 86400;
-
-}
-
-/* Get the number of commits before HEAD;
-  if return value is 0, something wrong happens */
-unsigned int get_max_ranks(std::string git_directory){
+/* Query statistics of all the histories of the process; NULL unless
+  AFLCHURN_PROFILE is set. */
+ChurnStats *get_churn_stats(void){
 
-  FILE *dfp;
-  unsigned int head_num_parents;
-  std::ostringstream headcmd;
-  headcmd << "cd " << git_directory
-          << " && git rev-list --count HEAD";
-  dfp = popen(headcmd.str().c_str(), "r");
-  if (NULL == dfp) return WRONG_VALUE;
-  if (fscanf(dfp, "%u", &head_num_parents) != 1) return WRONG_VALUE;
-  pclose(dfp);
+  static ChurnStats stats;
 
-  return head_num_parents;
+  return getenv("AFLCHURN_PROFILE") ? &stats : NULL;
 
 }
 
-/* 
- git diff current_commit HEAD -- file_path. 
- Help get the related lines in HEAD commits, which are related to the lines from git show.
- */
-void git_diff_current_head(std::string cur_commit_sha, std::string git_directory, 
-            std::string relative_file_path, std::set<unsigned int> &changed_lines_from_show,
-                std::map <unsigned int, unsigned int> &lines2changes){
-
-    std::ostringstream cmd;
-    char array_head_changes[32], array_current_changes[32], fatat[12], tatat[12];
-    std::string current_line_range, head_line_result;
-    size_t cur_comma_pos, head_comma_pos;
-    int rc = 0;
-    FILE *fp;
-    int cur_line_num, cur_num_start, cur_num_count, head_line_num, head_num_start, head_num_count;
-    std::set<unsigned int> cur_changed_lines, head_changed_lines;
-    bool is_head_changed = false, cur_head_has_diff = false;
-
-    /* git diff -U0 cur_commit HEAD -- filename | grep ...
-      get the changed line range between current commit and HEAD commit;
-      help get the changed lines in HEAD commits;
-      result: "@@ -8,0 +9,2 @@"
-            (-): current commit; (+): HEAD commit
-    */
-    cmd << "cd " << git_directory << " && git diff -U0 " << cur_commit_sha << " HEAD -- " << relative_file_path
-        << " | grep -o -P \"^@@ -[0-9]+(,[0-9])? \\+[0-9]+(,[0-9])? @@\"";
-
-    fp = popen(cmd.str().c_str(), "r");
-    if(NULL == fp) return;
-    /* -: current_commit;
-       +: HEAD */
-    // result: "@@ -8,0 +9,2 @@" or "@@ -10 +11,0 @@" or "@@ -466,8 +475 @@" or "@@ -8 +9 @@"
-    while(fscanf(fp, "%s %s %s %s", fatat, array_current_changes, array_head_changes, tatat) == 4){
-
-        cur_head_has_diff = true;
-        
-        current_line_range.clear(); /* The current commit side, (-) */
-        current_line_range.assign(array_current_changes); // "-"
-        current_line_range.erase(0,1); //remove "-"
-        cur_comma_pos = current_line_range.find(",");
-        /* If the changed lines in current commit can be found in changed_lines_from_show, 
-            the related lines in HEAD commit should count for changes. */
-        if (cur_comma_pos == std::string::npos){
-            cur_line_num = std::stoi(current_line_range);
-            if (changed_lines_from_show.count(cur_line_num)) is_head_changed = true;
-        }else{
-            cur_num_start = std::stoi(current_line_range.substr(0, cur_comma_pos));
-            cur_num_count = std::stoi(current_line_range.substr(cur_comma_pos + 1, 
-                                                                current_line_range.length() - cur_comma_pos - 1));
-            for(int i=0; i< cur_num_count; i++){
-                if (changed_lines_from_show.count(cur_num_start + i)){
-                    is_head_changed = true;
-                    break;
-                }
-            }
-        }
-
-        /* Trace changes for head commit, increment lines2changes.
-          Some lines are changed in current commit, so trace these lines back to HEAD commit,
-          and increment the count of these lines in HEAD commit. 
-          */
-        if (is_head_changed){
-            head_line_result.clear(); /* The head commit side, (+) */
-            head_line_result.assign(array_head_changes); // "+"
-            head_line_result.erase(0,1); //remove "+"
-            head_comma_pos = head_line_result.find(",");
-
-            if (head_comma_pos == std::string::npos){
-                head_line_num = std::stoi(head_line_result);
-                if (lines2changes.count(head_line_num)) lines2changes[head_line_num]++;
-                else lines2changes[head_line_num] = 1;
-            }else{
-                head_num_start = std::stoi(head_line_result.substr(0, head_comma_pos));
-                head_num_count = std::stoi(head_line_result.substr(head_comma_pos + 1, 
-                                                                  head_line_result.length() - head_comma_pos - 1));
-                for(int i=0; i< head_num_count; i++){ 
-                    if (lines2changes.count(head_num_start + i)) lines2changes[head_num_start + i]++;
-                    else lines2changes[head_num_start + i] = 1; 
-                }
-            }
-
-        }
+/* The history of each repository stays open for the lifetime of the pass. */
+ChurnHistory *get_churn_history(std::string git_directory){
 
-        memset(array_current_changes, 0, sizeof(array_current_changes));
-        memset(array_head_changes, 0, sizeof(array_head_changes));
-    }
+  static std::map<std::string, ChurnHistory *> histories;
 
-    /* if there's no diff in current commit and HEAD commit;
-     there's no change of the file between two commits;
-     so any change in current commit (compared to its parents) counts for the HEAD commit*/
+  if (!histories.count(git_directory))
+    histories[git_directory] = open_churn_history(git_directory, get_churn_stats());
 
-    if (!cur_head_has_diff){
-        for (auto mit = changed_lines_from_show.begin(); mit != changed_lines_from_show.end(); ++mit){
-            if (lines2changes.count(*mit)) lines2changes[*mit]++;
-            else lines2changes[*mit] = 1;
-        }
-    }
+  return histories[git_directory];
 
-    rc = pclose(fp);
-    if(-1 == rc){
-        printf("git diff pclose() fails\n");
-    }
 }
 
-/* git show, get changed lines in current commit.
-    It'll show you the log message for the commit, and the diff of that particular commit.
-    Find the changed line numbers in file relative_file_path as it was changed in commit cur_commit_sha, 
-    and add them to the list changed_lines_cur_commit     
+/* get line changes of all the files from one walk over the history.
+  Each line of HEAD is traced back through the diffs of the commits that touched it,
+  so a change counts for the HEAD lines it ended up as.
+  With AFLCHURN_HISTORY_COMMITS or AFLCHURN_HISTORY_MS, files whose history
+  runs over the budget get extrapolated counts, and end up in file2cut.
  */
-void git_show_current_changes(std::string cur_commit_sha, std::string git_directory, 
-            std::string relative_file_path, std::set<unsigned int> &changed_lines_cur_commit){
-
-    std::ostringstream cmd;
-    
-    char array_parent_changes[32], array_current_changes[32], fatat[12], tatat[12];
-    std::string current_line_range;
-    size_t comma_pos;
-    int rc = 0;
-    FILE *fp;
-    int line_num, num_start, num_count; 
-
-    // git show: parent_commit(-) current_commit(+)
-    // result: "@@ -8,0 +9,2 @@" or "@@ -10 +11,0 @@" or "@@ -466,8 +475 @@" or "@@ -8 +9 @@"
-    cmd << "cd " << git_directory << " && git show --oneline -U0 " << cur_commit_sha << " -- " << relative_file_path
-          << " | grep -o -P \"^@@ -[0-9]+(,[0-9])? \\+[0-9]+(,[0-9])? @@\"";
-
-    fp = popen(cmd.str().c_str(), "r");
-    if(NULL == fp) return;
-    // get numbers in (+): current commit
-    
-    while(fscanf(fp, "%s %s %s %s", fatat, array_parent_changes, array_current_changes, tatat) == 4){
-
-      current_line_range.clear(); /* The current commit side, (+) */
-      current_line_range.assign(array_current_changes); // "+"
-      current_line_range.erase(0,1); //remove "+"
-      comma_pos = current_line_range.find(",");
-
-      if (comma_pos == std::string::npos){
-          line_num = std::stoi(current_line_range);
-          if (line_num >= 0) changed_lines_cur_commit.insert(line_num);
-      }else{
-          num_start = std::stoi(current_line_range.substr(0, comma_pos));
-          num_count = std::stoi(current_line_range.substr(comma_pos+1, 
-                                                          current_line_range.length() - comma_pos - 1));
-          for(int i = 0; i< num_count; i++){
-              if (num_start >= 0) changed_lines_cur_commit.insert(num_start + i);
-          }
-      }
-      memset(array_current_changes, 0, sizeof(array_current_changes));
-    }
-
-    rc = pclose(fp);
-    if(-1 == rc){
-        printf("git show pclose() fails\n");
-    }
-}
-
-/* use git command to get line changes */
-void calculate_line_change_git_cmd(std::string relative_file_path, std::string git_directory,
+void calculate_line_change(std::vector<std::string> &relative_file_paths, ChurnHistory *history,
                     std::map<std::string, std::map<unsigned int, double>> &file2line2change_map,
-                    unsigned short change_sig){
+                    unsigned short change_sig, std::map<std::string, ChurnCut> &file2cut){
     
-  std::ostringstream cmd;
-  std::string str_cur_commit_sha;
-  char ch_cur_commit_sha[128];
-  int rc = 0;
-  FILE *fp;
-  std::set<unsigned int> changed_lines_cur_commit;
-  std::map <unsigned int, unsigned int> lines2changes;
-  std::map <unsigned int, double> tmp_line2changes;
+  std::map<std::string, std::map<unsigned int, unsigned int>> file2line2changes;
+  ChurnBudget budget;
+  bool budgeted = get_churn_budget(budget);
   
-  // get the commits that change the file of relative_file_path
-  // result: commit short SHAs
-  // TODO: If the file name changed, it cannot get the changed lines.
   //  --since=10.years 
-  char* ch_month = getenv("AFLCHURN_SINCE_MONTHS");
-  if (ch_month){
-    std::string since_month(ch_month);
-    if (since_month.find_first_not_of("0123456789") == std::string::npos){ // all digits
-      
-      cmd << "cd " << git_directory 
-          << " && git log --since=" << ch_month << ".months"
-          << " --follow --oneline --format=\"%h\" -- " 
-          << relative_file_path << " | grep -Po \"^[0-9a-f]*$\"";
-          
-    } else {
-      ch_month = NULL; // if env variable is not digits, use all commits
-    }
-  }
-  
-  if (!ch_month){
+  if (!history->churn(relative_file_paths, get_churn_since_time(), file2line2changes,
+                      budgeted ? &budget : NULL)) return;
 
-    cmd << "cd " << git_directory 
-        << " && git log" 
-        <<" --follow --oneline --format=\"%h\" -- " 
-        << relative_file_path
-        << " | grep -Po \"^[0-9a-f]*$\""; 
-  }
-  
-  fp = popen(cmd.str().c_str(), "r");
-  if(NULL == fp) return;
-  /* get lines2changes: git log -> git show -> git diff
-    "git log -- filename": get commits SHAs changing the file
-    "git show $commit_sha -- filename": get changed lines in current commit
-    "git diff $commit_sha HEAD -- filename": get the related lines in HEAD commit
-    */
-  while(fscanf(fp, "%s", ch_cur_commit_sha) == 1){
-      str_cur_commit_sha.clear();
-      str_cur_commit_sha.assign(ch_cur_commit_sha);
-      // get changed_lines_cur_commit: the change lines in current commit
-      changed_lines_cur_commit.clear();
-      git_show_current_changes(str_cur_commit_sha, git_directory, 
-                                  relative_file_path, changed_lines_cur_commit);
-      // get lines2changes: related change lines in HEAD commit
-      git_diff_current_head(str_cur_commit_sha, git_directory, relative_file_path, 
-                              changed_lines_cur_commit, lines2changes);
-      
-  }
+  file2cut.insert(budget.cut.begin(), budget.cut.end());
 
   /* Get changes */
-  if (!lines2changes.empty()){
+  for (auto &f2l : file2line2changes){
+    std::map <unsigned int, double> tmp_line2changes;
     // logchanges
-    for (auto l2c : lines2changes){
+    for (auto l2c : f2l.second){
       tmp_line2changes[l2c.first] = inst_norm_change(l2c.second, change_sig);
     }
 
-    file2line2change_map[relative_file_path] = tmp_line2changes;
+    file2line2change_map[f2l.first] = tmp_line2changes;
     
   }
-  
-  rc = pclose(fp);
-  if(-1 == rc){
-      printf("git log pclose() fails\n");
-  }
 
 }
 
 
-/* get age of lines using git command line. 
-  git_directory: /home/usrname/repo/
-*/
-bool calculate_line_age_git_cmd(std::string relative_file_path, std::string git_directory,
+/* get age of lines from git blame.
+  The blame takes the same budget as the churn walk; files it runs out on
+  end up in file2blame_cut, their older lines all as old as the boundary.
+ */
+bool calculate_line_age(std::string relative_file_path, ChurnHistory *history,
                     std::map<std::string, std::map<unsigned int, double>> &file2line2age_map,
-                    unsigned long head_commit_days, unsigned long init_commit_days){
+                    unsigned long head_commit_days, unsigned long init_commit_days,
+                    std::map<std::string, ChurnBlameCut> &file2blame_cut){
 
   std::map<unsigned int, double> line_age_days;
-
-  /*
-  getting pairs [unix_time line_number]
-  // cd ${git_directory} &&
-  // git blame --date=unix ${relative_file_path} \
-  // | grep -o -P "[0-9]{9}[0-9]? [0-9]+"
-  */
-
-  std::ostringstream cmd;
-  int rc = 0;
-  FILE *fp;
-  unsigned long unix_time;
-  unsigned int line;
+  std::map<unsigned int, ChurnBlame> blamed_lines;
   int days_since_last_change;
+  ChurnBudget budget;
+  bool budgeted = get_churn_budget(budget);
 
   if (head_commit_days==WRONG_VALUE || init_commit_days==WRONG_VALUE) return false;
 
   int max_days = head_commit_days - init_commit_days;
 
-  cmd << "cd " << git_directory << " && git blame --date=unix " << relative_file_path
-        << " | grep -o -P \"[0-9]{9}[0-9]? +[0-9]+\"";
+  if (!history->blame(relative_file_path, blamed_lines,
+                      budgeted ? &budget : NULL)) return false;
+
+  file2blame_cut.insert(budget.blame_cut.begin(), budget.blame_cut.end());
 
-  fp = popen(cmd.str().c_str(), "r");
-  if(NULL == fp) return false;
   // get line by line
-  while(fscanf(fp, "%lu %u", &unix_time, &line) == 2){
-    days_since_last_change = head_commit_days - unix_time / 86400; //days
+  for (auto &bl : blamed_lines){
+    days_since_last_change = head_commit_days - bl.second.time / 86400; //days
 
-    line_age_days[line] = inst_norm_age(max_days, days_since_last_change);
+    line_age_days[bl.first] = inst_norm_age(max_days, days_since_last_change);
     
   }
 
   if (!line_age_days.empty())
       file2line2age_map[relative_file_path] = line_age_days;
 
-  rc = pclose(fp);
-  if(-1 == rc){
-    printf("git blame pclose() fails\n");
-  }
-
   return true;
 
 }
@@ -550,54 +369,41 @@ bool calculate_line_age_git_cmd(std::string relative_file_path, std::string git_
 /* get rank of line ages.
   rank = (the number of commits until HEAD) - (the number of commits until commit A);
  */
-bool cal_line_age_rank(std::string relative_file_path, std::string git_directory,
+bool cal_line_age_rank(std::string relative_file_path, ChurnHistory *history,
                 std::map<std::string, std::map<unsigned int, double>> &file2line2rank_map,
                 std::map<std::string, double> &commit2rank,
-                unsigned int head_num_parents){
+                unsigned int head_num_parents,
+                std::map<std::string, ChurnBlameCut> &file2blame_cut){
 
-  char line_commit_sha[256];
-  FILE *dfp, *curdfp;
-  unsigned int nothing_line, line_num;
   std::map<unsigned int, double> line_rank;
+  std::map<unsigned int, ChurnBlame> blamed_lines;
   unsigned int cur_num_parents;
   int rank4line;
+  ChurnBudget budget;
+  bool budgeted = get_churn_budget(budget);
 
   if (head_num_parents == WRONG_VALUE) return false;
 
-  /* output: commit_hash old_line_num current_line_num
-        e.g., 9f1a353f68d6586b898c47c71a7631cdc816215f 167 346
-   */
-  std::ostringstream blamecmd;
-  blamecmd << "cd " << git_directory
-        << " && git blame -p -- " << relative_file_path
-        << " | grep -o \"^[0-9a-f]* [0-9]* [0-9]*\"";
+  if (!history->blame(relative_file_path, blamed_lines,
+                      budgeted ? &budget : NULL)) return false;
 
-  dfp = popen(blamecmd.str().c_str(), "r");
-  if(NULL == dfp) return false;
+  file2blame_cut.insert(budget.blame_cut.begin(), budget.blame_cut.end());
 
-  std::ostringstream rankcmd;
-  while (fscanf (dfp, "%s %u %u", line_commit_sha, &nothing_line, &line_num) == 3){
-    std::string str_cmt(line_commit_sha);
+  for (auto &bl : blamed_lines){
+    std::string &str_cmt = bl.second.commit;
     if (commit2rank.count(str_cmt)){
-      line_rank[line_num] = commit2rank[str_cmt];
+      line_rank[bl.first] = commit2rank[str_cmt];
     } else {
-      rankcmd.str("");
-      rankcmd.clear();
-      rankcmd << "cd " << git_directory
-              << " && git rev-list --count "
-              << line_commit_sha;
-      curdfp = popen(rankcmd.str().c_str(), "r");
-      if(NULL == curdfp) continue;
-      if (fscanf (curdfp, "%u", &cur_num_parents) == 1){
-        rank4line = head_num_parents - cur_num_parents;
-        commit2rank[str_cmt] = line_rank[line_num] 
-                             = inst_norm_rank(head_num_parents, rank4line);
-      }
-      pclose(curdfp);
+      /* not committed yet */
+      if (str_cmt.find_first_not_of('0') == std::string::npos) continue;
+      cur_num_parents = history->commit_count(str_cmt);
+      if (cur_num_parents == WRONG_VALUE) continue;
+      rank4line = head_num_parents - cur_num_parents;
+      commit2rank[str_cmt] = line_rank[bl.first] 
+                           = inst_norm_rank(head_num_parents, rank4line);
     }
     
   }
-  pclose(dfp);
 
   if (!line_rank.empty()) file2line2rank_map[relative_file_path] = line_rank;
   return true;
@@ -606,37 +412,15 @@ bool cal_line_age_rank(std::string relative_file_path, std::string git_directory
 
 
 
-/* Check if file exists in HEAD using command mode.
+/* Check if file exists in HEAD.
 return:
     exist: 1; not exist: 0 */
-bool is_file_exist(std::string relative_file_path, std::string git_directory){
-
-  //string cmd("cd /home/usrname/repo && git cat-file -e HEAD:util/read.h 2>&1");
-  std::ostringstream cmd;
-
-  char result_buf[1024];
-  int rc = 0;
-  bool isSuccess = false;
-  FILE *fp;
+bool is_file_exist(std::string relative_file_path, std::string git_directory,
+                   ChurnHistory *history){
 
   if(access(git_directory.c_str(), F_OK) == -1) return false;
   
-  cmd << "cd " << git_directory << " && git cat-file -e HEAD:" 
-      << relative_file_path << " 2>&1";
-
-	fp = popen(cmd.str().c_str(), "r");
-	if(NULL == fp) return false;
-	// when cmd fail, output "fatal: Path 'tdio.h' does not exist in 'HEAD'";
-  // when succeed, output nothing
-  if (fgets(result_buf, sizeof(result_buf), fp) != NULL) isSuccess = false;
-  else isSuccess = true;
-	
-  rc = pclose(fp);
-  if(-1 == rc){
-    printf("git cat-file pclose() fails\n");
-  }
-  
-  return isSuccess;
+  return history->file_exists(relative_file_path);
 
 }
 
@@ -683,360 +467,1716 @@ std::string get_file_path_relative_to_git_dir(std::string relative_file_path,
 
 }
 
+/* Scores of the lines of one source file, indexed by line number. Lines
+  without a score hold 0, which never beats the best score of a BB. */
+struct ChurnLineScores {
+  std::vector<double> age, rank, change;
+  bool unexist = false;   // not in HEAD (or not indexed): skip its BBs
+};
+
+#define CHURN_NO_FILE 0xffffffffU
+
+/* The source files of a module. Each DIFile is resolved to a path relative
+  to the repository once, and paths are interned to dense IDs. */
+struct ChurnFileTable {
+  DenseMap<const DIFile *, unsigned int> difile_ids;
+  std::map<std::string, unsigned int> path_ids;
+  std::vector<std::string> paths;
+  std::vector<ChurnLineScores> scores;
+};
+
+/* Source file ID of an instruction and its line.
+  Instructions inlined from elsewhere use the location they were inlined at.
+  Returns CHURN_NO_FILE if the instruction has no usable debug location. */
+unsigned int get_inst_file_id(Instruction &I, std::string &git_directory,
+                              ChurnFileTable &files, unsigned int &line){
+
+  std::string filename, filedir, clean_relative_path;
+  DILocation *Loc = I.getDebugLoc().get(); 
+  const DIFile *file;
+  unsigned int id = CHURN_NO_FILE;
+
+  line = 0;
+  if (!Loc) return CHURN_NO_FILE;
+
+  line = Loc->getLine();
+  file = Loc->getFile();
+  if (Loc->getFilename().empty()){
+    DILocation *oDILoc = Loc->getInlinedAt();
+    if (oDILoc){
+      line = oDILoc->getLine();
+      file = oDILoc->getFile();
+    }
+  }
 
+  if (!file) return CHURN_NO_FILE;
 
+  auto known = files.difile_ids.find(file);
+  if (known != files.difile_ids.end()) return known->second;
 
-bool AFLCoverage::runOnModule(Module &M) {
+  filename = file->getFilename().str();
+  filedir = file->getDirectory().str();
 
-  LLVMContext &C = M.getContext();
-  
-  Type *VoidTy;
-  IntegerType *Int1Ty;
-  IntegerType *Int8Ty;
-  IntegerType *Int32Ty;
-  IntegerType *Int64Ty;
-  Type *Int8PtrTy;
-  Type *Int64PtrTy;
-  Type *DoubleTy;
-  Type *FloatTy;
-  GlobalVariable *AFLMapPtr;
-  GlobalVariable *AFLPrevLoc;
-  unsigned NoSanMetaId;
-  MDTuple *NoneMetaNode;
-  VoidTy = Type::getVoidTy(C);
-  Int1Ty = IntegerType::getInt1Ty(C);
-  Int8Ty = IntegerType::getInt8Ty(C);
-  Int32Ty = IntegerType::getInt32Ty(C);
-  Int64Ty = IntegerType::getInt64Ty(C);
-  Int8PtrTy = PointerType::getUnqual(Int8Ty);
-  Int64PtrTy = PointerType::getUnqual(Int64Ty);
-  DoubleTy = Type::getDoubleTy(C);
-  FloatTy = Type::getFloatTy(C);
-  NoSanMetaId = C.getMDKindID("nosanitize");
-  NoneMetaNode = MDNode::get(C, None);
+  /* take care of git blame path: relative to repo dir */
+  if (!filename.empty() && !filedir.empty())
+    clean_relative_path = get_file_path_relative_to_git_dir(filename, filedir, git_directory);
 
-  /* Show a banner */
+  if (!clean_relative_path.empty()){
+    auto interned = files.path_ids.find(clean_relative_path);
+    if (interned != files.path_ids.end()) id = interned->second;
+    else{
+      id = files.paths.size();
+      files.path_ids[clean_relative_path] = id;
+      files.paths.push_back(clean_relative_path);
+      files.scores.push_back(ChurnLineScores());
+    }
+  }
 
-  char be_quiet = 0;
+  files.difile_ids[file] = id;
+  return id;
 
-  if (isatty(2) && !getenv("AFL_QUIET")) {
+}
 
-    SAYF(cCYA "afl-llvm-pass " cBRI VERSION cRST " by <aflchurn>\n");
+/* Move the scores of a file from a line -> score map into its line array. */
+void set_line_scores(std::map<std::string, std::map<unsigned int, double>> &file2line2score_map,
+                     std::string relative_file_path, std::vector<double> &scores){
 
-  } else be_quiet = 1;
+  auto f2l = file2line2score_map.find(relative_file_path);
 
-  /* Decide instrumentation ratio */
+  if (f2l == file2line2score_map.end() || f2l->second.empty()) return;
 
-  char* inst_ratio_str = getenv("AFL_INST_RATIO");
-  unsigned int inst_ratio = 100;
+  scores.assign(f2l->second.rbegin()->first + 1, 0);
+  for (auto &l2s : f2l->second) scores[l2s.first] = l2s.second;
 
-  if (inst_ratio_str) {
+  file2line2score_map.erase(f2l);
 
-    if (sscanf(inst_ratio_str, "%u", &inst_ratio) != 1 || !inst_ratio ||
-        inst_ratio > 100)
-      FATAL("Bad value of AFL_INST_RATIO (must be between 1 and 100)");
+}
 
-  }
 
-  // default: instrument changes and days
-  bool use_cmd_change = true, use_cmd_age_rank = false, use_cmd_age = true;
+/* On-disk cache of line scores, shared by all compiler processes of a build.
+   Without it, every module that includes a header re-runs git blame/log/show/diff
+   on it. An entry is keyed by HEAD, the blob of the file in the working tree,
+   its path and the AFLChurn settings, so a hit is always valid for the current
+   build. Writers hold a per-entry flock() while computing and publish with
+   rename(), so concurrent processes never see partial entries and only one of
+   them does the work.
+   Set AFLCHURN_CACHE_DIR to relocate the cache or AFLCHURN_DISABLE_CACHE to
+   turn it off. */
+std::string get_churn_cache_dir(std::string git_directory){
 
-  char *day_sig_str, *change_sig_str;
+  std::string cache_dir;
+  char *env_dir = getenv("AFLCHURN_CACHE_DIR");
 
-  unsigned short change_sig = CHURN_LOG_CHANGE; //day_sig, 
+  if (getenv("AFLCHURN_DISABLE_CACHE")) return "";
 
-  if (getenv("AFLCHURN_DISABLE_AGE")) use_cmd_age = false;
-  day_sig_str = getenv("AFLCHURN_ENABLE_RANK");
-  if (day_sig_str){
-    if (!strcmp(day_sig_str, "rrank")){
-      use_cmd_age_rank = true;
-      use_cmd_age = false;
-    } else{
-      FATAL("Set proper age signal");
-    }
+  if (env_dir) cache_dir.assign(env_dir);
+  else{
+    // result: /home/usr/repo_name/.git
+    cache_dir = execute_git_cmd(git_directory, "git rev-parse --absolute-git-dir");
+    if (cache_dir.empty()) return "";
+    cache_dir.append("/aflchurn-cache");
   }
 
-  if (getenv("AFLCHURN_DISABLE_CHURN")) use_cmd_change = false;
-  change_sig_str = getenv("AFLCHURN_CHURN_SIG");
-  if (change_sig_str){
-    if (!use_cmd_change) FATAL("Cannot simultaneously set AFLCHURN_DISABLE_CHURN and AFLCHURN_CHURN_SIG!");
-    if (!strcmp(change_sig_str, "logchange")){
-      change_sig = CHURN_LOG_CHANGE;
-    } else if (!strcmp(change_sig_str, "change")){
-      change_sig = CHURN_CHANGE;
-    } else if (!strcmp(change_sig_str, "change2")){
-      change_sig = CHURN_CHANGE2;
-    } else {
-      FATAL("Wrong change signal.");
-    }
+  if (mkdir(cache_dir.c_str(), 0700) && errno != EEXIST){
+    WARNF("Unable to create history cache %s, not caching.", cache_dir.c_str());
+    return "";
   }
 
-  unsigned int bb_select_ratio = CHURN_INSERT_RATIO;
-  char *bb_select_ratio_str = getenv("AFLCHURN_INST_RATIO");
+  return cache_dir;
 
-  if (bb_select_ratio_str) {
+}
 
-    if (sscanf(bb_select_ratio_str, "%u", &bb_select_ratio) != 1 || !bb_select_ratio ||
-        bb_select_ratio > 100)
-      FATAL("Bad value of AFLCHURN_INST_RATIO (must be between 1 and 100)");
+/* Name of the cache entry for key; the full key is kept inside the entry to
+   rule out collisions of the 64-bit name. */
+std::string get_churn_cache_entry(std::string cache_dir, std::string key){
 
-  }
+  char entry_name[17];
 
-  /* Get globals for the SHM region and the previous location. Note that
-     __afl_prev_loc is thread-local. */
+  snprintf(entry_name, sizeof(entry_name), "%08x%08x",
+           hash32(key.c_str(), key.length(), HASH_CONST),
+           hash32(key.c_str(), key.length(), ~HASH_CONST));
 
-  AFLMapPtr =
-      new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
-                         GlobalValue::ExternalLinkage, 0, "__afl_area_ptr");
+  return cache_dir + "/" + entry_name;
 
-  AFLPrevLoc = new GlobalVariable(
-      M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
-      0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+}
 
-  /* Instrument all the things! */
+/* Take the per-entry lock; returns the fd to close() when done, or -1. */
+int lock_churn_cache(std::string cache_entry){
 
-  int inst_blocks = 0, inst_ages = 0, inst_changes = 0, inst_fitness = 0;
-  double module_total_ages = 0, module_total_changes = 0, module_total_fitness = 0,
-      module_ave_ages = 0, module_ave_chanegs = 0, module_ave_fitness = 0;
+  std::string lock_path = cache_entry + ".lock";
+  int fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0600);
 
-  // Choose part of BBs to insert the age/change signal
-  int changes_inst_threshold = 0; // for change
-  unsigned long init_commit_days = 0, head_commit_days = 0; // for age
-  unsigned int head_num_parents = 0; // for ranks
-  double norm_change_thd = 0, norm_age_thd = 0, norm_rank_thd = 0;
+  if (fd < 0) return -1;
 
-  std::set<unsigned int> bb_lines;
-  std::set<std::string> unexist_files, processed_files;
-  unsigned int line;
-  std::string git_path;
-  
-  int git_no_found = 1, // 0: found; otherwise, not found
-      is_one_commit = 0; // don't calculate for --depth 1
+  if (flock(fd, LOCK_EX)){
+    close(fd);
+    return -1;
+  }
 
-  std::map<std::string, double> commit_rank;
-  // file name (relative path): line NO. , score
-  std::map<std::string, std::map<unsigned int, double>> map_age_scores, map_bursts_scores, map_rank_age;
+  return fd;
 
-  for (auto &F : M){
-    /* Get repository path and object */
-    if (git_no_found && !is_one_commit){
-      SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
-      std::string funcdir, funcfile, func_abs_path;// func_clean_path;
-      
-      F.getAllMetadata(MDs);
-      for (auto &MD : MDs) {
-        if (MDNode *N = MD.second) {
-          if (auto *subProgram = dyn_cast<DISubprogram>(N)) {
-            funcfile = subProgram->getFilename().str();
-            funcdir = subProgram->getDirectory().str();
+}
 
-            if (!funcfile.empty() && !funcdir.empty()){
-              // fix path here; if "funcfile" does not start with "/", use funcdir as the prefix of funcfile
-              if (!startsWith(funcfile, "/")){
-                func_abs_path = funcdir;
-                func_abs_path.append("/");
-                func_abs_path.append(funcfile);
-              } else func_abs_path = funcfile;
+/* Entry format: the key on the first line, then one "<kind> <line> <score>"
+   record per line, kind being 'a' (age), 'r' (rank) or 'c' (changes). */
+bool load_churn_cache(std::string cache_entry, std::string key,
+                std::string relative_file_path,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2age_map,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2rank_map,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2change_map){
 
-              // get the real path for the current file
-              char *realp = realpath(func_abs_path.c_str(), NULL);
-              if (realp == NULL) git_no_found = 1;
-              else{
-                func_abs_path.assign(realp);
-                free(realp);
-                git_no_found = 0;
-              }
+  std::ifstream entry(cache_entry);
+  std::string entry_key;
+  std::map<unsigned int, double> line_age, line_rank, line_change;
+  char kind;
+  unsigned int line;
+  double score;
 
-              if (!git_no_found){
-                /* Directory of the file. */
-                func_abs_path = func_abs_path.substr(0, func_abs_path.find_last_of("\\/")); //remove filename in string
-                //git rev-parse --show-toplevel: show the root folder of a repository
-                // result: /home/usr/repo_name
-                std::string cmd_repo ("git rev-parse --show-toplevel 2>&1");
-                
-                git_path = execute_git_cmd(func_abs_path, cmd_repo);
-                if (git_path.empty()) git_no_found = 1;
-                else git_path.append("/"); // result: /home/usr/repo_name/
-                
-                /* Check shallow git repository */
-                // git rev-list HEAD --count: count the number of commits
-                if (!git_no_found){
-                  std::string cmd_count ("git rev-list HEAD --count 2>&1");
-                  std::string commit_cnt = execute_git_cmd(git_path, cmd_count);
-                  
-                  if (commit_cnt.compare("1") == 0){ //only one commit
-                    git_no_found = 1;
-                    is_one_commit = 1;
-                    OKF("Shallow repository clone. Ignoring file %s.", funcfile.c_str());
-                    break;
-                  }
-                  // #change threshold
-                  // changes_inst_threshold = get_threshold_changes(git_path);
-                  //get commit time
-                  std::string head_cmd("git show -s --format=%ct HEAD");
-                  head_commit_days = get_commit_time_days(git_path, head_cmd);
-                  std::string init_cmd("git log --reverse --date=unix --oneline --format=%cd | head -n1");
-                  init_commit_days = get_commit_time_days(git_path, init_cmd);
-                  /* Get the number of commits before HEAD */
-                  head_num_parents = get_max_ranks(git_path);
-                  /* thresholds */
-                  norm_change_thd = inst_norm_change(THRESHOLD_CHANGES, change_sig);
-                  norm_age_thd = inst_norm_age(head_commit_days - init_commit_days, THRESHOLD_DAYS);
-                  norm_rank_thd = inst_norm_rank(head_num_parents, THRESHOLD_RANKS);
-                  break;
-                }
-                
-              }
-          
-            }
-              
-          }
-        }
-      }
+  if (!entry.is_open()) return false;
+  if (!std::getline(entry, entry_key) || entry_key != key) return false;
+
+  while (entry >> kind >> line >> score){
+    switch (kind){
+      case 'a': line_age[line] = score; break;
+      case 'r': line_rank[line] = score; break;
+      case 'c': line_change[line] = score; break;
+      default: return false;
     }
-    
-    for (auto &BB : F) {
-      
-      BasicBlock::iterator IP = BB.getFirstInsertionPt();
-      IRBuilder<> IRB(&(*IP));
+  }
 
-      if (AFL_R(100) >= inst_ratio) continue;
+  if (!entry.eof()) return false;
 
-      /* Make up cur_loc */
+  if (!line_age.empty()) file2line2age_map[relative_file_path] = line_age;
+  if (!line_rank.empty()) file2line2rank_map[relative_file_path] = line_rank;
+  if (!line_change.empty()) file2line2change_map[relative_file_path] = line_change;
 
-      unsigned int cur_loc = AFL_R(MAP_SIZE);
+  return true;
 
-      ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
+}
 
-      double bb_rank_age = 0, bb_age_best = 0, bb_burst_best = 0, bb_rank_best = 0;
-      double bb_raw_fitness, tmp_score;
-      bool bb_raw_fitness_flag = false;
-      
-      if (!bb_lines.empty())
-            bb_lines.clear();
-      bb_lines.insert(0);
-      
-      for (auto &I: BB){
+void save_churn_cache(std::string cache_entry, std::string key,
+                std::string relative_file_path,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2age_map,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2rank_map,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2change_map){
+
+  std::string tmp_path = cache_entry + ".XXXXXX";
+  std::vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+  FILE *fp;
+  int fd;
+
+  tmp_name.push_back('\0');
+  fd = mkstemp(tmp_name.data());
+  if (fd < 0) return;
+
+  fp = fdopen(fd, "w");
+  if (!fp){
+    close(fd);
+    unlink(tmp_name.data());
+    return;
+  }
+
+  fprintf(fp, "%s\n", key.c_str());
+
+  if (file2line2age_map.count(relative_file_path))
+    for (auto l2s : file2line2age_map[relative_file_path])
+      fprintf(fp, "a %u %.17g\n", l2s.first, l2s.second);
+
+  if (file2line2rank_map.count(relative_file_path))
+    for (auto l2s : file2line2rank_map[relative_file_path])
+      fprintf(fp, "r %u %.17g\n", l2s.first, l2s.second);
+
+  if (file2line2change_map.count(relative_file_path))
+    for (auto l2s : file2line2change_map[relative_file_path])
+      fprintf(fp, "c %u %.17g\n", l2s.first, l2s.second);
+
+  if (fclose(fp) || rename(tmp_name.data(), cache_entry.c_str()))
+    unlink(tmp_name.data());
+
+}
+
+
+/* AFLCHURN_SCORE_DIGEST, for the object cache of afl-clang-fast: one
+  "<path> <digest>" line per file of the module, the digest being over its
+  line scores ("new" for files git does not have). */
+void save_churn_score_digest(const char *digest_path, ChurnFileTable &files){
+
+  FILE *fp = fopen(digest_path, "w");
+
+  if (!fp) return;
+
+  for (auto &pi : files.path_ids){
+    ChurnLineScores &scores = files.scores[pi.second];
+    std::vector<double> all;
+
+    if (scores.unexist){
+      fprintf(fp, "%s new\n", pi.first.c_str());
+      continue;
+    }
+
+    for (auto *v : {&scores.age, &scores.rank, &scores.change}){
+      all.push_back(v->size());
+      all.insert(all.end(), v->begin(), v->end());
+    }
+
+    fprintf(fp, "%s %08x%08x\n", pi.first.c_str(),
+            hash32(all.data(), all.size() * sizeof(double), HASH_CONST),
+            hash32(all.data(), all.size() * sizeof(double), ~HASH_CONST));
+  }
+
+  fclose(fp);
+
+}
+
+
+/* Get unix time in microseconds */
+static unsigned long long get_cur_time_us(void){
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+
+}
+
+/* Line scores of files that are neither cached nor indexed, computed by a
+   bounded pool of threads before instrumentation starts. Each file is one
+   job (git blame for ages and ranks), and the churn walk over all of them
+   is one more, started first since it takes longest. Workers open their own
+   ChurnHistory: the readers keep caches that are not meant to be shared.
+   The pool size is AFLCHURN_THREADS, or the number of CPUs up to
+   CHURN_MAX_THREADS. */
+void score_churn_files(std::vector<std::string> &files, std::string git_directory,
+                ChurnHistory *history, bool use_age, bool use_rank, bool use_change,
+                unsigned long head_commit_days, unsigned long init_commit_days,
+                unsigned int head_num_parents, unsigned short change_sig,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2age_map,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2rank_map,
+                std::map<std::string, std::map<unsigned int, double>> &file2line2change_map,
+                std::map<std::string, ChurnCut> &file2cut,
+                std::map<std::string, ChurnBlameCut> &file2blame_cut,
+                std::map<std::string, unsigned long long> *file2usecs){
+
+  struct ChurnScores {
+    std::map<std::string, std::map<unsigned int, double>> age, rank, change;
+    std::map<std::string, double> commit_rank;
+    std::map<std::string, unsigned long long> usecs;
+    std::map<std::string, ChurnCut> cut;
+    std::map<std::string, ChurnBlameCut> blame_cut;
+  };
+
+  char *threads_str = getenv("AFLCHURN_THREADS");
+  unsigned int thread_cnt = std::min(std::thread::hardware_concurrency(),
+                                     (unsigned int)CHURN_MAX_THREADS);
+  unsigned int job_cnt = files.size() + (use_change ? 1 : 0);
+  std::atomic<unsigned int> next_job(0);
+  std::vector<ChurnScores> scores;
+  std::vector<std::thread> workers;
+
+  if (threads_str){
+    if (sscanf(threads_str, "%u", &thread_cnt) != 1 || !thread_cnt ||
+        thread_cnt > 256)
+      FATAL("Bad value of AFLCHURN_THREADS (must be between 1 and 256)");
+  }
+
+  if (!thread_cnt) thread_cnt = 1;
+  if (thread_cnt > job_cnt) thread_cnt = job_cnt;
+  if (!thread_cnt) return;
+
+  scores.resize(thread_cnt);
+
+  /* Job 0 is the churn walk, if any; the others are files. */
+  auto work = [&](unsigned int t, ChurnHistory *h){
+    ChurnScores &sc = scores[t];
+    unsigned int job;
+
+    while ((job = next_job++) < job_cnt){
+      if (use_change && !job){
+        calculate_line_change(files, h, sc.change, change_sig, sc.cut);
+        continue;
+      }
+      std::string &file = files[job - (use_change ? 1 : 0)];
+      unsigned long long start_us = get_cur_time_us();
+      if (use_age)
+        calculate_line_age(file, h, sc.age, head_commit_days, init_commit_days,
+                           sc.blame_cut);
+      if (use_rank)
+        cal_line_age_rank(file, h, sc.rank, sc.commit_rank, head_num_parents,
+                          sc.blame_cut);
+      sc.usecs[file] = get_cur_time_us() - start_us;
+    }
+  };
+
+  if (thread_cnt == 1) work(0, history);
+  else{
+    for (unsigned int t = 0; t < thread_cnt; t++)
+      workers.push_back(std::thread([&, t](){
+        ChurnHistory *h = open_churn_history(git_directory, get_churn_stats());
+        work(t, h);
+        delete h;
+      }));
+    for (auto &w : workers) w.join();
+  }
+
+  /* Files are disjoint across workers */
+  for (auto &sc : scores){
+    file2line2age_map.insert(sc.age.begin(), sc.age.end());
+    file2line2rank_map.insert(sc.rank.begin(), sc.rank.end());
+    file2line2change_map.insert(sc.change.begin(), sc.change.end());
+    file2cut.insert(sc.cut.begin(), sc.cut.end());
+    file2blame_cut.insert(sc.blame_cut.begin(), sc.blame_cut.end());
+    if (file2usecs) file2usecs->insert(sc.usecs.begin(), sc.usecs.end());
+  }
+
+}
+
+/* Precomputed scores from aflchurn-index (AFLCHURN_INDEX): the pass then runs
+   without git, e.g. on a source tree shipped without .git. The index is only
+   trusted for files that are unchanged since it was written.
+   Root of the sources: AFLCHURN_INDEX_ROOT, or the directory of the index. */
+std::string get_churn_index_root(const char *index_path){
+
+  std::string root;
+  char *env_root = getenv("AFLCHURN_INDEX_ROOT");
+  char *realp = realpath(env_root ? env_root : index_path, NULL);
+
+  if (realp == NULL) PFATAL("Unable to find '%s'", env_root ? env_root : index_path);
+  root.assign(realp);
+  free(realp);
+
+  if (!env_root) root = root.substr(0, root.find_last_of("/"));
+  root.append("/");
+
+  return root;
+
+}
+
+/* Scores of the lines of a file from what aflchurn-index (or aflchurn-histd)
+  recorded for them, line 1 first. */
+void set_churn_index_scores(const ChurnIndexLine *lines, unsigned int line_cnt,
+                unsigned long head_commit_days, unsigned long init_commit_days,
+                unsigned int head_num_parents, unsigned short change_sig,
+                ChurnLineScores &line_scores){
+
+  int max_days = head_commit_days - init_commit_days;
+
+  line_scores.age.assign(line_cnt + 1, 0);
+  line_scores.rank.assign(line_cnt + 1, 0);
+  line_scores.change.assign(line_cnt + 1, 0);
+
+  for (unsigned int i = 0; i < line_cnt; i++){
+    const ChurnIndexLine &l = lines[i];
+
+    /* only lines that git blame knows about carry a day */
+    if (l.day)
+      line_scores.age[i + 1] = inst_norm_age(max_days, head_commit_days - l.day);
+    if (l.count)
+      line_scores.rank[i + 1] = inst_norm_rank(head_num_parents, head_num_parents - l.count);
+    if (l.changes)
+      line_scores.change[i + 1] = inst_norm_change(l.changes, change_sig);
+  }
+
+}
+
+bool load_churn_index(const ChurnIndex &idx, std::string relative_file_path,
+                std::string root_directory,
+                unsigned long head_commit_days, unsigned long init_commit_days,
+                unsigned int head_num_parents, unsigned short change_sig,
+                ChurnLineScores &line_scores){
+
+  const ChurnIndexFile *f = find_churn_index_file(idx, relative_file_path);
+
+  if (!f) return false;
+
+  if (get_churn_blob_id(root_directory + relative_file_path)
+        .compare(0, std::string::npos, f->blob, sizeof(f->blob))){
+    WARNF("%s changed since it was indexed, ignoring it.", relative_file_path.c_str());
+    return false;
+  }
+
+  set_churn_index_scores(&idx.lines[f->line_idx], f->line_cnt, head_commit_days,
+                         init_commit_days, head_num_parents, change_sig, line_scores);
+
+  return true;
+
+}
+
+
+/* aflchurn-histd (AFLCHURN_HISTD): HEAD and the line data of the module's
+  files come from the daemon that afl-clang-fast started for the repository,
+  over a Unix socket, instead of from git in every compiler process.
+  Anything going wrong with it falls back to git. */
+struct ChurnHistdHead {
+  std::string sha;
+  unsigned long head_time = 0, init_time = 0;
+  unsigned int count = 0;
+};
+
+/* Top level of the repository that directory dir is in, with a trailing
+  '/', found by looking for .git; empty if there is none. */
+std::string find_churn_repo_dir(std::string dir){
+
+  struct stat st;
+
+  while (!dir.empty()){
+    if (!stat((dir + "/.git").c_str(), &st)) return dir + "/";
+    dir = dir.substr(0, dir.find_last_of("/"));
+  }
+
+  return "";
+
+}
+
+static bool send_churn_histd(int fd, const std::string &req){
+
+  size_t done = 0;
+
+  while (done < req.length()){
+    ssize_t n = send(fd, req.data() + done, req.length() - done, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    done += n;
+  }
+
+  return true;
+
+}
+
+static bool recv_churn_histd(int fd, void *buf, size_t len){
+
+  u8 *p = (u8 *)buf;
+
+  while (len){
+    ssize_t n = read(fd, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+
+  return true;
+
+}
+
+static bool recv_churn_histd_line(int fd, std::string &line){
+
+  char c;
+
+  line.clear();
+  while (recv_churn_histd(fd, &c, 1)){
+    if (c == '\n') return true;
+    line += c;
+  }
+
+  return false;
+
+}
+
+/* Connected to the daemon of the repository at git_directory, with HEAD in
+  head; -1 if there is no daemon or it counts churn differently. It may have
+  only just been started, so give it CHURN_HISTD_WAIT ms to come up. */
+int connect_churn_histd(std::string git_directory, ChurnHistdHead &head){
+
+  std::string sock_path = git_directory + ".git/" CHURN_HISTD_SOCKET, reply;
+  unsigned long long deadline = get_cur_time_us() + CHURN_HISTD_WAIT * 1000ULL;
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd = -1;
+
+  /* The daemon does not serve worktrees, where .git is a file */
+  if (stat((git_directory + ".git").c_str(), &st) || !S_ISDIR(st.st_mode) ||
+      sock_path.length() >= sizeof(addr.sun_path)) return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock_path.c_str());
+
+  while (1){
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) break;
+    close(fd);
+    if (get_cur_time_us() > deadline) return -1;
+    usleep(10000);
+  }
+
+  if (!send_churn_histd(fd, "HEAD " + get_churn_settings() + "\n") ||
+      !recv_churn_histd_line(fd, reply)){
+    close(fd);
+    return -1;
+  }
+
+  std::istringstream rs(reply);
+  std::string status;
+
+  if (!(rs >> status >> head.sha >> head.head_time >> head.init_time >> head.count) ||
+      status != "OK"){
+    WARNF("aflchurn-histd: %s", reply.c_str());
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+
+}
+
+/* Line data of each of paths; false if the daemon went away. Files it does
+  not have (not in HEAD) come back without lines and not found. */
+bool get_churn_histd_lines(int fd, std::vector<std::string> &paths,
+                std::vector<std::vector<ChurnIndexLine>> &lines,
+                std::vector<bool> &found){
+
+  std::string req = "LINES\n", reply;
+
+  for (auto &path : paths) req += path + "\n";
+  if (!send_churn_histd(fd, req + "\n")) return false;
+
+  lines.assign(paths.size(), std::vector<ChurnIndexLine>());
+  found.assign(paths.size(), false);
+
+  for (unsigned int i = 0; i < paths.size(); i++){
+    if (!recv_churn_histd_line(fd, reply)) return false;
+    if (reply == "-") continue;
+    lines[i].resize(strtoul(reply.c_str(), NULL, 10));
+    if (!recv_churn_histd(fd, lines[i].data(), lines[i].size() * sizeof(ChurnIndexLine)))
+      return false;
+    found[i] = true;
+  }
+
+  return true;
+
+}
+
+
+
+
+/* Opt-in profile of the pass (AFLCHURN_PROFILE=<file>): one JSON record
+  per module is appended to the file, so that a whole build can be summed up
+  with aflchurn-profile.py. Times are wall-clock microseconds. */
+struct ChurnProfile {
+  unsigned long long start_us, discovery_us = 0, scoring_us = 0, instrument_us = 0;
+  unsigned long long subprocesses;
+  unsigned long long calls[CHURN_Q_COUNT], usecs[CHURN_Q_COUNT];
+  unsigned int cached_files = 0, scored_files = 0;
+  std::map<std::string, unsigned long long> file_usecs;
+  std::map<std::string, ChurnCut> history_cut;
+  std::map<std::string, ChurnBlameCut> blame_cut;
+};
+
+std::string json_string(const std::string &str){
+
+  std::string out = "\"";
+  char buf[8];
+
+  for (unsigned char c : str){
+    if (c == '"' || c == '\\'){
+      out += '\\';
+      out += c;
+    } else if (c < 0x20){
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else out += c;
+  }
+
+  return out + "\"";
+
+}
+
+/* Queries and processes are counted from the start of the module on. */
+void start_churn_profile(ChurnProfile &prof){
+
+  ChurnStats *stats = get_churn_stats();
+
+  prof.start_us = get_cur_time_us();
+  prof.subprocesses = get_churn_subprocess_count() + pass_subprocess_count;
+  for (int q = 0; q < CHURN_Q_COUNT; q++){
+    prof.calls[q] = stats->calls[q];
+    prof.usecs[q] = stats->usecs[q];
+  }
+
+}
+
+void write_churn_profile(const char *profile_path, ChurnProfile &prof, Module &M,
+                std::string mode, std::string git_directory, ChurnFileTable &files,
+                int inst_blocks, int inst_ages, int inst_changes, int inst_fitness){
+
+  ChurnStats *stats = get_churn_stats();
+  std::ostringstream rec;
+  unsigned int unexist = 0;
+  bool first = true;
+  int fd;
+
+  rec << "{\"module\": " << json_string(M.getModuleIdentifier())
+      << ", \"repo\": " << json_string(git_directory)
+      << ", \"mode\": " << json_string(mode)
+      << ", \"usecs\": {\"total\": " << get_cur_time_us() - prof.start_us
+      << ", \"discovery\": " << prof.discovery_us
+      << ", \"scoring\": " << prof.scoring_us
+      << ", \"instrument\": " << prof.instrument_us << "}"
+      << ", \"subprocesses\": "
+      << get_churn_subprocess_count() + pass_subprocess_count - prof.subprocesses;
+
+  rec << ", \"queries\": {";
+  for (int q = 0; q < CHURN_Q_COUNT; q++){
+    unsigned long long calls = stats->calls[q] - prof.calls[q];
+    if (!calls) continue;
+    rec << (first ? "" : ", ") << json_string(churn_query_names[q])
+        << ": {\"calls\": " << calls
+        << ", \"usecs\": " << stats->usecs[q] - prof.usecs[q] << "}";
+    first = false;
+  }
+
+  rec << "}, \"unexist_files\": [";
+  for (unsigned int id = 0; id < files.paths.size(); id++){
+    if (!files.scores[id].unexist) continue;
+    rec << (unexist++ ? ", " : "") << json_string(files.paths[id]);
+  }
+
+  rec << "], \"files\": {\"total\": " << files.paths.size()
+      << ", \"unexist\": " << unexist
+      << ", \"cached\": " << prof.cached_files
+      << ", \"scored\": " << prof.scored_files << "}";
+
+  first = true;
+  rec << ", \"file_usecs\": {";
+  for (auto &fu : prof.file_usecs){
+    rec << (first ? "" : ", ") << json_string(fu.first) << ": " << fu.second;
+    first = false;
+  }
+
+  first = true;
+  rec << "}, \"history_cut\": {";
+  for (auto &hc : prof.history_cut){
+    rec << (first ? "" : ", ") << json_string(hc.first)
+        << ": {\"diffed\": " << hc.second.diffed
+        << ", \"total\": " << hc.second.total << "}";
+    first = false;
+  }
+
+  first = true;
+  rec << "}, \"blame_cut\": {";
+  for (auto &bc : prof.blame_cut){
+    rec << (first ? "" : ", ") << json_string(bc.first)
+        << ": {\"commits\": " << bc.second.commits
+        << ", \"lines\": " << bc.second.lines
+        << ", \"cut_lines\": " << bc.second.cut_lines << "}";
+    first = false;
+  }
+
+  rec << "}, \"bbs\": {\"instrumented\": " << inst_blocks
+      << ", \"age\": " << inst_ages
+      << ", \"churn\": " << inst_changes
+      << ", \"fitness\": " << inst_fitness << "}}\n";
+
+  /* Compiler processes of a build append to the same file. */
+  fd = open(profile_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0){
+    WARNF("Unable to write the profile to %s.", profile_path);
+    return;
+  }
+
+  flock(fd, LOCK_EX);
+  if (write(fd, rec.str().c_str(), rec.str().length()) < 0)
+    WARNF("Unable to write the profile to %s.", profile_path);
+  close(fd);
+
+}
+
+
+/* The slot of type Ty at offset in the shared memory */
+
+static Value *get_churn_shm_slot(IRBuilder<> &IRB, Value *MapPtr,
+                                 unsigned int offset, Type *Ty){
+
+  return IRB.CreateBitCast(IRB.CreateGEP(IRB.getInt8Ty(), MapPtr,
+                                         IRB.getInt32(offset)),
+                           PointerType::getUnqual(Ty));
+
+}
+
+/* *Ptr += Inc, with the accesses marked nosanitize */
+
+static void add_to_churn_counter(IRBuilder<> &IRB, Value *Ptr, Value *Inc){
+
+  LLVMContext &C = IRB.getContext();
+  unsigned NoSanMetaId = C.getMDKindID("nosanitize");
+  MDNode *NoneMetaNode = MDNode::get(C, None);
+  Type *Ty = Inc->getType();
+
+  LoadInst *Old = IRB.CreateLoad(Ty, Ptr);
+  Old->setMetadata(NoSanMetaId, NoneMetaNode);
+  Value *New = Ty->isFloatingPointTy() ? IRB.CreateFAdd(Old, Inc)
+                                       : IRB.CreateAdd(Old, Inc);
+  IRB.CreateStore(New, Ptr)->setMetadata(NoSanMetaId, NoneMetaNode);
+
+}
+
+/* *Ptr += Inc as a relaxed atomic add, for AFLCHURN_THREAD_FITNESS */
+
+static void add_to_churn_counter_atomic(IRBuilder<> &IRB, Value *Ptr, Value *Inc){
+
+  LLVMContext &C = IRB.getContext();
+  unsigned NoSanMetaId = C.getMDKindID("nosanitize");
+  MDNode *NoneMetaNode = MDNode::get(C, None);
+  AtomicRMWInst::BinOp Op = Inc->getType()->isFloatingPointTy() ? AtomicRMWInst::FAdd
+                                                                : AtomicRMWInst::Add;
+
+#if LLVM_VERSION_MAJOR >= 13
+  IRB.CreateAtomicRMW(Op, Ptr, Inc, MaybeAlign(8), AtomicOrdering::Monotonic)
+     ->setMetadata(NoSanMetaId, NoneMetaNode);
+#else
+  IRB.CreateAtomicRMW(Op, Ptr, Inc, AtomicOrdering::Monotonic)
+     ->setMetadata(NoSanMetaId, NoneMetaNode);
+#endif
+
+}
+
+/* Where AFLCHURN_HOIST_FITNESS hands the fitness gathered in a function over
+   to the shared memory: before the function returns or unwinds, and before
+   calls that might not come back (exit(), or anything that may call it). */
+
+static bool is_churn_flush_point(Instruction &I){
+
+  if (isa<ReturnInst>(I) || isa<ResumeInst>(I)) return true;
+
+  CallBase *CB = dyn_cast<CallBase>(&I);
+  if (!CB || isa<IntrinsicInst>(I) || CB->isInlineAsm()) return false;
+
+#if LLVM_VERSION_MAJOR >= 12
+  if (CB->hasFnAttr(Attribute::WillReturn)) return false;
+#endif
+
+  return true;
+
+}
+
+
+/* AFLCHURN_STABLE_IDS: a hash of where a block is instead of a random ID,
+   so that code which did not change keeps its IDs in the next build. The key
+   is the function (with its source file, if local), the position of the
+   block in it, and the line and column of its first instruction relative to
+   the start of the function; code added above a function does not move its
+   blocks. */
+
+static u32 get_stable_block_hash(Module &M, Function &F, BasicBlock &BB,
+                                 unsigned int pos, u32 seed){
+
+  std::string key = F.getName().str();
+
+  if (F.hasLocalLinkage()) key += "@" + M.getSourceFileName();
+  key += "#" + std::to_string(pos);
+
+  for (auto &I : BB){
+    DILocation *Loc = I.getDebugLoc().get();
+    if (!Loc || !Loc->getLine()) continue;
+    DISubprogram *SP = F.getSubprogram();
+    unsigned int line = Loc->getLine(), start = SP ? SP->getLine() : 0;
+    key += ":" + std::to_string(line >= start ? line - start : line)
+         + ":" + std::to_string(Loc->getColumn());
+    break;
+  }
+
+  /* hash32() only reads whole 8-byte words */
+  key.resize((key.length() + 7) & ~7, '\0');
+
+  return hash32(key.data(), key.length(), seed);
+
+}
+
+/* AFLCHURN_DICT: the tokens a block compares its input with. Integer
+   constants of comparisons and switch cases go in the byte order of the
+   target, unless they are no larger than a byte (havoc tries those anyway);
+   strings only when they are passed to a comparison function. */
+
+static void add_churn_dict_int(const APInt &Val, const DataLayout &DL,
+                               std::vector<std::string> &tokens){
+
+  unsigned int bytes = Val.getBitWidth() / 8;
+  if (Val.getBitWidth() % 8 || bytes < 2 || bytes > 8) return;
+
+  int64_t sval = Val.getSExtValue();
+  if (sval >= -128 && sval < 256) return;
+
+  uint64_t uval = Val.getZExtValue();
+  std::string token(bytes, '\0');
+  for (unsigned int i = 0; i < bytes; i++)
+    token[DL.isLittleEndian() ? i : bytes - 1 - i] = (char)(uval >> (8 * i));
+
+  tokens.push_back(token);
+
+}
+
+static void get_churn_dict_tokens(BasicBlock &BB, const DataLayout &DL,
+                                  std::vector<std::string> &tokens){
+
+  static const std::set<std::string> cmp_funcs = {
+    "memcmp", "bcmp", "strcmp", "strncmp", "strcasecmp", "strncasecmp",
+    "strstr", "strcasestr", "memmem"
+  };
+
+  for (auto &I : BB){
+
+    if (auto *Cmp = dyn_cast<ICmpInst>(&I)){
+      for (Value *Op : Cmp->operands())
+        if (auto *CI = dyn_cast<ConstantInt>(Op)) add_churn_dict_int(CI->getValue(), DL, tokens);
+      continue;
+    }
+
+    if (auto *SI = dyn_cast<SwitchInst>(&I)){
+      for (auto &Case : SI->cases())
+        add_churn_dict_int(Case.getCaseValue()->getValue(), DL, tokens);
+      continue;
+    }
+
+    CallBase *CB = dyn_cast<CallBase>(&I);
+    Function *Callee = CB ? CB->getCalledFunction() : NULL;
+    if (!Callee || !cmp_funcs.count(Callee->getName().str())) continue;
+
+    /* memcmp() and the like compare no more than their length */
+    uint64_t max_len = ~0ULL;
+    if (CB->arg_size() >= 3)
+      if (auto *Len = dyn_cast<ConstantInt>(CB->getArgOperand(2)))
+        if (Len->getBitWidth() <= 64) max_len = Len->getZExtValue();
+
+    for (Value *Arg : CB->args()){
+      StringRef Str;
+      if (!getConstantStringInfo(Arg, Str)) continue;
+      Str = Str.substr(0, max_len);
+      if (Str.size() >= 2) tokens.push_back(Str.str());
+    }
+
+  }
+
+}
+
+/* AFLCHURN_SELECTIVE_SAN: take the sanitizers out of a function. ASan
+   only instruments functions with the sanitize_address attribute, and runs
+   after this pass; UBSan checks are already in the code, as branches to a
+   block that reports (__ubsan_handle_*) or traps, and those branches are
+   made unconditional. Returns whether F had any checks. */
+
+static bool is_ubsan_report(Instruction &I){
+
+  CallBase *CB = dyn_cast<CallBase>(&I);
+  Function *Callee = CB ? CB->getCalledFunction() : NULL;
+
+  return Callee && (Callee->getName().startswith("__ubsan_handle_") ||
+                    Callee->getIntrinsicID() == Intrinsic::ubsantrap);
+
+}
+
+static bool has_sanitizer_checks(Function &F){
+
+  if (F.hasFnAttribute(Attribute::SanitizeAddress)) return true;
+
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (is_ubsan_report(I)) return true;
+
+  return false;
+
+}
+
+static bool drop_sanitizer_checks(Function &F){
+
+  bool had_checks = F.hasFnAttribute(Attribute::SanitizeAddress);
+  std::vector<BasicBlock *> handlers;
+
+  F.removeFnAttr(Attribute::SanitizeAddress);
+
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (is_ubsan_report(I)){
+        handlers.push_back(&BB);
+        break;
+      }
+
+  for (BasicBlock *Handler : handlers){
+    std::vector<BasicBlock *> preds(pred_begin(Handler), pred_end(Handler));
+    for (BasicBlock *Pred : preds){
+      BranchInst *Br = dyn_cast<BranchInst>(Pred->getTerminator());
+      if (!Br || !Br->isConditional()) continue;
+
+      BasicBlock *Pass = Br->getSuccessor(Br->getSuccessor(0) == Handler ? 1 : 0);
+      if (Pass == Handler) continue;
+
+      BranchInst::Create(Pass, Br);
+      Handler->removePredecessor(Pred);
+      Br->eraseFromParent();
+      had_checks = true;
+    }
+  }
+
+  if (!handlers.empty()) removeUnreachableBlocks(F);
+
+  return had_checks;
+
+}
+
+/* AFLCHURN_PRUNE: a block that post-dominates its immediate dominator, and
+   is in the same loop, runs exactly as often as that one, so its probe tells
+   nothing new. Map each such block to the first block of its chain that
+   has a probe. Whether a block without one to go by gets a probe is up to
+   sample, so that blocks are only ever implied by a probe that exists; the
+   chain of a block that was left out goes on from the next block. Calls
+   that do not return can still leave the rest of the chain unexecuted. */
+
+static void get_implied_blocks(Function &F,
+                               DenseMap<BasicBlock *, BasicBlock *> &implied_by,
+                               DenseSet<BasicBlock *> &probes,
+                               const std::function<bool(BasicBlock *)> &sample){
+
+  DominatorTree DT(F);
+  PostDominatorTree PDT(F);
+  LoopInfo LI(DT);
+
+  /* Dominators first, so that their own probe block is known */
+  for (auto *Node : depth_first(DT.getRootNode())){
+    BasicBlock *BB = Node->getBlock(), *Dom, *ProbeBB = NULL;
+
+    if (Node->getIDom()){
+      Dom = Node->getIDom()->getBlock();
+      if (PDT.dominates(BB, Dom) && LI.getLoopFor(BB) == LI.getLoopFor(Dom)){
+        auto Probe = implied_by.find(Dom);
+        if (Probe != implied_by.end()) ProbeBB = Probe->second;
+        else if (probes.count(Dom)) ProbeBB = Dom;
+      }
+    }
+
+    if (ProbeBB) implied_by[BB] = ProbeBB;
+    else if (sample(BB)) probes.insert(BB);
+  }
+
+}
+
+/* What the blocks behind one probe add to the fitness: one count per
+   weighted block, and its record for AFLCHURN_METADATA */
+
+struct ChurnProbeWeight {
+  double sum = 0;
+  unsigned long long fixed_sum = 0;
+  unsigned int cnt = 0;
+  unsigned long long channel_sum[CHURN_CHANNELS] = {0, 0, 0};
+  unsigned int channel_cnt[CHURN_CHANNELS] = {0, 0, 0};
+  std::vector<std::tuple<unsigned int, unsigned int, double, double, double>> meta;
+};
+
+bool instrument_churn_module(Module &M, bool lto) {
+
+  LLVMContext &C = M.getContext();
   
-        line = 0;
-        std::string filename, filedir, clean_relative_path;
-        /* Connect targets with instructions */
-        DILocation *Loc = I.getDebugLoc().get(); 
-        if (Loc && !git_no_found){
-          filename = Loc->getFilename().str();
-          filedir = Loc->getDirectory().str();
-          line = Loc->getLine();
-          if (filename.empty()){
-            DILocation *oDILoc = Loc->getInlinedAt();
-            if (oDILoc){
-              line = oDILoc->getLine();
-              filename = oDILoc->getFilename().str();
-              filedir = oDILoc->getDirectory().str();
-            }
-          }
+  Type *VoidTy;
+  IntegerType *Int8Ty;
+  IntegerType *Int32Ty;
+  IntegerType *Int64Ty;
+  Type *Int8PtrTy;
+  Type *DoubleTy;
+  Type *FloatTy;
+  GlobalVariable *AFLMapPtr;
+  GlobalVariable *AFLPrevLoc;
+  unsigned NoSanMetaId;
+  MDTuple *NoneMetaNode;
+  VoidTy = Type::getVoidTy(C);
+  Int8Ty = IntegerType::getInt8Ty(C);
+  Int32Ty = IntegerType::getInt32Ty(C);
+  Int64Ty = IntegerType::getInt64Ty(C);
+  Int8PtrTy = PointerType::getUnqual(Int8Ty);
+  DoubleTy = Type::getDoubleTy(C);
+  FloatTy = Type::getFloatTy(C);
+  NoSanMetaId = C.getMDKindID("nosanitize");
+  NoneMetaNode = MDNode::get(C, None);
+
+  /* Show a banner */
+
+  char be_quiet = 0;
+
+  if (isatty(2) && !getenv("AFL_QUIET")) {
+
+    if (lto) SAYF(cCYA "afl-llvm-pass [lto] " cBRI VERSION cRST " by <aflchurn>\n");
+    else SAYF(cCYA "afl-llvm-pass " cBRI VERSION cRST " by <aflchurn>\n");
+
+  } else be_quiet = 1;
+
+  /* Decide instrumentation ratio */
+
+  char* inst_ratio_str = getenv("AFL_INST_RATIO");
+  unsigned int inst_ratio = 100;
+
+  if (inst_ratio_str) {
+
+    if (sscanf(inst_ratio_str, "%u", &inst_ratio) != 1 || !inst_ratio ||
+        inst_ratio > 100)
+      FATAL("Bad value of AFL_INST_RATIO (must be between 1 and 100)");
+
+  }
+
+  // default: instrument changes and days
+  bool use_cmd_change = true, use_cmd_age_rank = false, use_cmd_age = true;
+
+  char *day_sig_str, *change_sig_str;
+
+  unsigned short change_sig = CHURN_LOG_CHANGE; //day_sig, 
+
+  if (getenv("AFLCHURN_DISABLE_AGE")) use_cmd_age = false;
+  day_sig_str = getenv("AFLCHURN_ENABLE_RANK");
+  if (day_sig_str){
+    if (!strcmp(day_sig_str, "rrank")){
+      use_cmd_age_rank = true;
+      use_cmd_age = false;
+    } else{
+      FATAL("Set proper age signal");
+    }
+  }
+
+  if (getenv("AFLCHURN_DISABLE_CHURN")) use_cmd_change = false;
+  change_sig_str = getenv("AFLCHURN_CHURN_SIG");
+  if (change_sig_str){
+    if (!use_cmd_change) FATAL("Cannot simultaneously set AFLCHURN_DISABLE_CHURN and AFLCHURN_CHURN_SIG!");
+    if (!strcmp(change_sig_str, "logchange")){
+      change_sig = CHURN_LOG_CHANGE;
+    } else if (!strcmp(change_sig_str, "change")){
+      change_sig = CHURN_CHANGE;
+    } else if (!strcmp(change_sig_str, "change2")){
+      change_sig = CHURN_CHANGE2;
+    } else {
+      FATAL("Wrong change signal.");
+    }
+  }
+
+  /* Accumulate fitness in fixed point (integer adds) instead of doubles */
+  bool use_fixed_fitness = getenv("AFLCHURN_FIXED_POINT") != NULL;
+  /* ... and per call of a function rather than in every BB */
+  bool use_hoist_fitness = getenv("AFLCHURN_HOIST_FITNESS") != NULL;
+  /* ... and per thread, merged by the runtime; implies the above */
+  bool use_thread_fitness = getenv("AFLCHURN_THREAD_FITNESS") != NULL;
+  if (use_thread_fitness) use_hoist_fitness = true;
+  /* ... or not at all: leave the weights in a table for afl-fuzz, which
+     needs an edge ID per map entry (LTO mode) */
+  bool use_weight_table = lto && getenv("AFLCHURN_WEIGHT_TABLE");
+  /* Also add up age, rank and churn on their own, for afl-fuzz to combine
+     (AFLCHURN_FORMULA); all three are then scored, whatever is enabled */
+  bool use_channels = getenv("AFLCHURN_CHANNELS") != NULL;
+  bool score_age = use_cmd_age || use_channels,
+       score_rank = use_cmd_age_rank || use_channels,
+       score_change = use_cmd_change || use_channels;
+
+  /* Leave what we know about each block in a section for other tools */
+  bool use_metadata = getenv("AFLCHURN_METADATA") != NULL;
+
+  /* Same IDs for the same code in every build */
+  bool stable_ids = getenv("AFLCHURN_STABLE_IDS") != NULL;
+
+  /* Probe only the blocks that others do not imply */
+  bool prune_blocks = getenv("AFLCHURN_PRUNE") != NULL;
+
+  /* Collect the magic values of weighted blocks for afl-fuzz -x */
+  bool use_dict = getenv("AFLCHURN_DICT") != NULL;
+
+  /* Tell callers apart in churned functions; needs prev_loc (not LTO) */
+  bool use_ctx = !lto && getenv("AFLCHURN_CTX");
+
+  /* Sanitize only churned functions; the sanitizers have already run on
+     the modules that LTO mode links */
+  bool selective_san = !lto && getenv("AFLCHURN_SELECTIVE_SAN");
+
+  if (!lto && getenv("AFLCHURN_WEIGHT_TABLE") && !be_quiet)
+    WARNF("AFLCHURN_WEIGHT_TABLE needs LTO mode (-flto); instrumenting the weights.");
+
+  if (lto && getenv("AFLCHURN_CTX") && !be_quiet)
+    WARNF("AFLCHURN_CTX does not work in LTO mode, which has no prev_loc; ignored.");
+
+  if (lto && getenv("AFLCHURN_SELECTIVE_SAN") && !be_quiet)
+    WARNF("AFLCHURN_SELECTIVE_SAN does not work in LTO mode, the modules are sanitized already; ignored.");
+
+  /* Thresholds of AFLCHURN_SELECTIVE_SAN, if not those of config.h */
+  unsigned int san_days = THRESHOLD_DAYS, san_ranks = THRESHOLD_RANKS,
+               san_changes = THRESHOLD_CHANGES;
+  const char *san_names[3] = {"AFLCHURN_SAN_DAYS", "AFLCHURN_SAN_RANKS",
+                              "AFLCHURN_SAN_CHANGES"};
+  unsigned int *san_values[3] = {&san_days, &san_ranks, &san_changes};
+
+  for (int i = 0; i < 3; i++){
+    char *san_str = getenv(san_names[i]);
+    if (san_str && (sscanf(san_str, "%u", san_values[i]) != 1 || !*san_values[i]))
+      FATAL("Bad value of %s (must be a positive integer)", san_names[i]);
+  }
+
+  unsigned int bb_select_ratio = CHURN_INSERT_RATIO;
+  char *bb_select_ratio_str = getenv("AFLCHURN_INST_RATIO");
+
+  if (bb_select_ratio_str) {
+
+    if (sscanf(bb_select_ratio_str, "%u", &bb_select_ratio) != 1 || !bb_select_ratio ||
+        bb_select_ratio > 100)
+      FATAL("Bad value of AFLCHURN_INST_RATIO (must be between 1 and 100)");
+
+  }
+
+  /* Get globals for the SHM region and the previous location. Note that
+     __afl_prev_loc is thread-local. LTO mode does not need the latter. */
+
+  AFLMapPtr =
+      new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
+                         GlobalValue::ExternalLinkage, 0, "__afl_area_ptr");
+
+  AFLPrevLoc = lto ? NULL : new GlobalVariable(
+      M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
+      0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+
+  /* AFLCHURN_THREAD_FITNESS: the slot of the thread (the leading fields of
+     struct churn_fitness in afl-llvm-rt.o.c, in memory shared with the fork
+     server) and the hook that hands a thread its slot. */
+
+  StructType *FitnessTy = StructType::get(DoubleTy, Int64Ty, Int64Ty);
+  PointerType *FitnessPtrTy = PointerType::getUnqual(FitnessTy);
+  GlobalVariable *AFLFitnessSlot = NULL;
+  FunctionCallee AFLRegisterThread;
+
+  if (use_thread_fitness) {
+    AFLFitnessSlot = new GlobalVariable(
+        M, FitnessPtrTy, false, GlobalValue::ExternalLinkage, 0, "__aflchurn_fitness_slot",
+        0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+    AFLRegisterThread = M.getOrInsertFunction("__aflchurn_register_thread", FitnessPtrTy);
+  }
+
+  /* Instrument all the things! */
+
+  int inst_blocks = 0, inst_ages = 0, inst_changes = 0, inst_fitness = 0;
+  int pruned_blocks = 0, ctx_functions = 0;
+  int san_kept = 0, san_dropped = 0;
+  unsigned int map_size = MAP_SIZE, weight_slot;
+#ifdef WORD_SIZE_64
+  IntegerType *CntTy = Int64Ty;
+#else
+  IntegerType *CntTy = Int32Ty;
+#endif /* ^WORD_SIZE_64 */
+  unsigned int next_loc = 0; // LTO mode: next edge ID
+  DenseMap<BasicBlock *, unsigned int> block_ids;
+  DenseMap<BasicBlock *, BasicBlock *> implied_by;
+  std::vector<Constant *> weight_table;
+  StructType *WeightRecTy = StructType::get(Int32Ty, FloatTy);
+  std::vector<Constant *> meta_records;
+  std::map<std::string, double> dict_tokens; // token -> best weight
+  StructType *MetaRecTy =
+      StructType::get(Int32Ty, Int32Ty, Int32Ty, FloatTy, FloatTy, FloatTy);
+  double module_total_ages = 0, module_total_changes = 0, module_total_fitness = 0,
+      module_ave_ages = 0, module_ave_chanegs = 0, module_ave_fitness = 0;
+
+  // Choose part of BBs to insert the age/change signal
+  int changes_inst_threshold = 0; // for change
+  unsigned long init_commit_days = 0, head_commit_days = 0; // for age
+  unsigned int head_num_parents = 0; // for ranks
+  double norm_change_thd = 0, norm_age_thd = 0, norm_rank_thd = 0;
+
+  std::set<unsigned int> bb_lines;
+  ChurnFileTable module_files;
+  unsigned int line, file_id;
+  std::string git_path;
+  ChurnHistory *history = NULL;
+  
+  int git_no_found = 1, // 0: found; otherwise, not found
+      is_one_commit = 0; // don't calculate for --depth 1
+
+  // file name (relative path): line NO. , score
+  std::map<std::string, std::map<unsigned int, double>> map_age_scores, map_bursts_scores, map_rank_age;
+
+  /* History cache: entries depend on HEAD, the file blob and these settings */
+  std::string cache_dir, head_sha, cache_cfg;
+  unsigned int cached_files = 0;
+  /* Precomputed scores instead of git */
+  char *index_str = getenv("AFLCHURN_INDEX");
+  ChurnIndex churn_index;
+  /* Where the time goes */
+  char *profile_str = getenv("AFLCHURN_PROFILE");
+  ChurnProfile profile;
+  /* History daemon instead of git */
+  bool use_histd = getenv("AFLCHURN_HISTD") && !index_str;
+  int histd_fd = -1;
+  ChurnHistdHead histd_head;
+  unsigned int histd_files = 0;
+  bool histd_scored = false;
+
+  if (profile_str) start_churn_profile(profile);
+
+  cache_cfg = "age=" + std::to_string(score_age)
+            + " rank=" + std::to_string(score_rank)
+            + " churn=" + std::to_string(score_change)
+            + " sig=" + std::to_string(change_sig)
+            + " " + get_churn_settings();
+
+  if (index_str){
+    if (!open_churn_index(index_str, churn_index))
+      FATAL("Unable to read the churn index '%s'; rebuild it with aflchurn-index.", index_str);
+    git_path = get_churn_index_root(index_str);
+    head_commit_days = churn_index.hdr->head_time / 86400;
+    init_commit_days = churn_index.hdr->init_time / 86400;
+    head_num_parents = churn_index.hdr->head_count;
+    git_no_found = 0;
+  }
+
+  for (auto &F : M){
+    /* Get repository path and object */
+    if (git_no_found && !is_one_commit){
+      SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
+      std::string funcdir, funcfile, func_abs_path;// func_clean_path;
+      
+      F.getAllMetadata(MDs);
+      for (auto &MD : MDs) {
+        if (MDNode *N = MD.second) {
+          if (auto *subProgram = dyn_cast<DISubprogram>(N)) {
+            funcfile = subProgram->getFilename().str();
+            funcdir = subProgram->getDirectory().str();
+
+            if (!funcfile.empty() && !funcdir.empty()){
+              // fix path here; if "funcfile" does not start with "/", use funcdir as the prefix of funcfile
+              if (!startsWith(funcfile, "/")){
+                func_abs_path = funcdir;
+                func_abs_path.append("/");
+                func_abs_path.append(funcfile);
+              } else func_abs_path = funcfile;
+
+              // get the real path for the current file
+              char *realp = realpath(func_abs_path.c_str(), NULL);
+              if (realp == NULL) git_no_found = 1;
+              else{
+                func_abs_path.assign(realp);
+                free(realp);
+                git_no_found = 0;
+              }
 
-          /* take care of git blame path: relative to repo dir */
-          if (!filename.empty() && !filedir.empty()){
-            
-            clean_relative_path = get_file_path_relative_to_git_dir(filename, filedir, git_path);
-            
-            if (!clean_relative_path.empty()){
-              /* calculate score of a block */
-                /* Check if file exists in HEAD using command mode */
-              if (unexist_files.count(clean_relative_path)) break;
-
-              if (!bb_lines.count(line)){
-                bb_lines.insert(line);
-                /* process files that have not been processed */
-                if (!processed_files.count(clean_relative_path)){
-                  processed_files.insert(clean_relative_path);
-
-                  /* Check if file exists in HEAD using command mode */
-                  if (!is_file_exist(clean_relative_path, git_path)){
-                    unexist_files.insert(clean_relative_path);
-                    break;
-                  }
-                  
-                  /* the ages for lines */
-                  if (use_cmd_age) 
-                    calculate_line_age_git_cmd(clean_relative_path, git_path, map_age_scores,
-                                                head_commit_days, init_commit_days);
-                  if (use_cmd_age_rank)
-                    cal_line_age_rank(clean_relative_path, git_path, map_rank_age, 
-                                            commit_rank, head_num_parents);
-                  /* the number of changes for lines */
-                  if (use_cmd_change)
-                    calculate_line_change_git_cmd(clean_relative_path, git_path, 
-                                                      map_bursts_scores, change_sig);
+              if (!git_no_found){
+                /* Directory of the file. */
+                func_abs_path = func_abs_path.substr(0, func_abs_path.find_last_of("\\/")); //remove filename in string
+                /* The daemon knows all of the below */
+                if (use_histd){
+                  git_path = find_churn_repo_dir(func_abs_path);
+                  if (!git_path.empty())
+                    histd_fd = connect_churn_histd(git_path, histd_head);
+                }
+
+                //git rev-parse --show-toplevel: show the root folder of a repository
+                // result: /home/usr/repo_name
+                if (histd_fd < 0){
+                  std::string cmd_repo ("git rev-parse --show-toplevel 2>&1");
                   
+                  git_path = execute_git_cmd(func_abs_path, cmd_repo);
+                  if (git_path.empty()) git_no_found = 1;
+                  else git_path.append("/"); // result: /home/usr/repo_name/
                 }
                 
-                if (use_cmd_age){
-                  // calculate line age
-                  if (map_age_scores.count(clean_relative_path)){
-                    if (map_age_scores[clean_relative_path].count(line)){
-                      // use the best value of a line as the value of a BB
-                      tmp_score = map_age_scores[clean_relative_path][line];
-                      if (bb_age_best < tmp_score) bb_rank_age = bb_age_best = tmp_score;
-                    }
+                /* Check shallow git repository */
+                // git rev-list HEAD --count: count the number of commits
+                if (!git_no_found && histd_fd >= 0){
+                  head_num_parents = histd_head.count;
+                  if (head_num_parents == 1){
+                    git_no_found = 1;
+                    is_one_commit = 1;
+                    close(histd_fd);
+                    histd_fd = -1;
+                    OKF("Shallow repository clone. Ignoring file %s.", funcfile.c_str());
+                    break;
                   }
+                  head_commit_days = histd_head.head_time / 86400;
+                  init_commit_days = histd_head.init_time / 86400;
+                  break;
                 }
-
-                if (use_cmd_age_rank){
-                  if (map_rank_age.count(clean_relative_path)){
-                    if (map_rank_age[clean_relative_path].count(line)){
-                      tmp_score = map_rank_age[clean_relative_path][line];
-                      if (bb_rank_best < tmp_score) bb_rank_age = bb_rank_best = tmp_score;
-                    }
+                if (!git_no_found){
+                  history = get_churn_history(git_path);
+                  /* Get the number of commits before HEAD */
+                  head_num_parents = history->commit_count("HEAD");
+                  
+                  if (head_num_parents == 1){ //only one commit
+                    git_no_found = 1;
+                    is_one_commit = 1;
+                    OKF("Shallow repository clone. Ignoring file %s.", funcfile.c_str());
+                    break;
                   }
-                }
-
-                if (use_cmd_change){
-                  // calculate line change
-                  if (map_bursts_scores.count(clean_relative_path)){
-                    if (map_bursts_scores[clean_relative_path].count(line)){
-                      tmp_score = map_bursts_scores[clean_relative_path][line];
-                      if (bb_burst_best < tmp_score) bb_burst_best = tmp_score;
-                    }
+                  // #change threshold
+                  // changes_inst_threshold = get_threshold_changes(git_path);
+                  //get commit time
+                  head_commit_days = history->head_time() / 86400;
+                  init_commit_days = history->init_time() / 86400;
+                  /* Where to share line scores with other compiler processes */
+                  cache_dir = get_churn_cache_dir(git_path);
+                  if (!cache_dir.empty()){
+                    head_sha = history->head_commit();
+                    if (head_sha.empty()) cache_dir.clear();
                   }
+                  break;
                 }
-              
+                
               }
-            }
           
+            }
+              
+          }
+        }
+      }
+    }
+    
+  }
+
+  if (profile_str) profile.discovery_us = get_cur_time_us() - profile.start_us;
 
+  /* thresholds */
+  if (!git_no_found){
+    norm_change_thd = inst_norm_change(THRESHOLD_CHANGES, change_sig);
+    norm_age_thd = inst_norm_age(head_commit_days - init_commit_days, THRESHOLD_DAYS);
+    norm_rank_thd = inst_norm_rank(head_num_parents, THRESHOLD_RANKS);
+  }
+
+  /* Is a line above the given thresholds, for the scores in use? */
+  auto is_churned_line = [&](ChurnLineScores &scores, unsigned int line,
+                             double age_thd, double rank_thd, double change_thd){
+    return (use_cmd_age && line < scores.age.size() && scores.age[line] > age_thd) ||
+           (use_cmd_age_rank && line < scores.rank.size() && scores.rank[line] > rank_thd) ||
+           (use_cmd_change && line < scores.change.size() && scores.change[line] > change_thd);
+  };
+
+  /* Score the source files of the whole module before instrumenting it, so that
+    the changes of all of them come from a single walk over the history. */
+  if (!git_no_found){
+
+    std::vector<std::string> score_files;
+    /* cache entry -> file, key and lock; in entry order, so that concurrent
+      compiler processes take the locks in the same order */
+    std::map<std::string, std::tuple<std::string, std::string, int>> cache_entries;
+
+    for (auto &F : M)
+      for (auto &BB : F)
+        for (auto &I : BB)
+          get_inst_file_id(I, git_path, module_files, line);
+
+    /* All files in one round trip; if the daemon went away, use git after all */
+    if (histd_fd >= 0){
+      std::vector<std::vector<ChurnIndexLine>> histd_lines;
+      std::vector<bool> histd_found;
+
+      if (get_churn_histd_lines(histd_fd, module_files.paths, histd_lines, histd_found)){
+        for (unsigned int id = 0; id < module_files.paths.size(); id++){
+          if (!histd_found[id]){
+            module_files.scores[id].unexist = true;
+            continue;
           }
+          set_churn_index_scores(histd_lines[id].data(), histd_lines[id].size(),
+                                 head_commit_days, init_commit_days, head_num_parents,
+                                 change_sig, module_files.scores[id]);
+          histd_files++;
         }
-      } 
- 
-      /* Load prev_loc */
+        histd_scored = true;
+      } else{
+        WARNF("Lost aflchurn-histd, asking git instead.");
+        history = get_churn_history(git_path);
+      }
+
+      close(histd_fd);
+      histd_fd = -1;
+    }
 
-      LoadInst *PrevLoc = IRB.CreateLoad(AFLPrevLoc);
-      PrevLoc->setMetadata(NoSanMetaId, NoneMetaNode);
-      Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+    for (unsigned int id = 0; !histd_scored && id < module_files.paths.size(); id++){
+      std::string &file = module_files.paths[id];
+      if (index_str){
+        if (!load_churn_index(churn_index, file, git_path, head_commit_days,
+                              init_commit_days, head_num_parents, change_sig,
+                              module_files.scores[id]))
+          module_files.scores[id].unexist = true;
+        continue;
+      }
+      /* Check if file exists in HEAD */
+      if (!is_file_exist(file, git_path, history)){
+        module_files.scores[id].unexist = true;
+        continue;
+      }
+      if (!cache_dir.empty()){
+        std::string blob_sha = history->blob_id(file);
+        if (!blob_sha.empty()){
+          std::string cache_key = head_sha + " " + blob_sha + " " + cache_cfg + " " + file;
+          cache_entries[get_churn_cache_entry(cache_dir, cache_key)] =
+                                    std::make_tuple(file, cache_key, -1);
+          continue;
+        }
+      }
+      score_files.push_back(file);
+    }
 
-      /* Load SHM pointer */
+    /* Reuse the scores if another process already computed them */
+    for (auto it = cache_entries.begin(); it != cache_entries.end(); ){
+      std::string &file = std::get<0>(it->second), &cache_key = std::get<1>(it->second);
+      int cache_lock = lock_churn_cache(it->first);
+
+      if (load_churn_cache(it->first, cache_key, file,
+                           map_age_scores, map_rank_age, map_bursts_scores)){
+        cached_files++;
+        if (cache_lock >= 0) close(cache_lock);
+        it = cache_entries.erase(it);
+      } else{
+        std::get<2>(it->second) = cache_lock;
+        score_files.push_back(file);
+        ++it;
+      }
+    }
+
+    /* the ages and the number of changes for lines */
+    if (!score_files.empty())
+      score_churn_files(score_files, git_path, history, score_age, score_rank,
+                        score_change, head_commit_days, init_commit_days,
+                        head_num_parents, change_sig,
+                        map_age_scores, map_rank_age, map_bursts_scores,
+                        profile.history_cut, profile.blame_cut,
+                        profile_str ? &profile.file_usecs : NULL);
+
+    profile.cached_files = cached_files;
+    profile.scored_files = score_files.size();
+
+    for (auto &ce : cache_entries){
+      save_churn_cache(ce.first, std::get<1>(ce.second), std::get<0>(ce.second),
+                        map_age_scores, map_rank_age, map_bursts_scores);
+      if (std::get<2>(ce.second) >= 0) close(std::get<2>(ce.second));
+    }
+
+    /* From here on, scores are looked up by file ID and line */
+    for (unsigned int id = 0; id < module_files.paths.size(); id++){
+      set_line_scores(map_age_scores, module_files.paths[id], module_files.scores[id].age);
+      set_line_scores(map_rank_age, module_files.paths[id], module_files.scores[id].rank);
+      set_line_scores(map_bursts_scores, module_files.paths[id], module_files.scores[id].change);
+    }
+
+  }
+
+  if (profile_str)
+    profile.scoring_us = get_cur_time_us() - profile.start_us - profile.discovery_us;
+
+  if (getenv("AFLCHURN_SCORE_DIGEST"))
+    save_churn_score_digest(getenv("AFLCHURN_SCORE_DIGEST"), module_files);
+
+  /* AFLCHURN_SELECTIVE_SAN: functions keep their sanitizer checks if a line
+     is above the thresholds, or comes from a file git does not have (new
+     code). Without any scored line, there is nothing to go by either. */
+  if (selective_san && !git_no_found){
+    double san_age_thd = inst_norm_age(head_commit_days - init_commit_days, san_days),
+           san_rank_thd = inst_norm_rank(head_num_parents, san_ranks),
+           san_change_thd = inst_norm_change(san_changes, change_sig);
+
+    for (auto &F : M){
+      if (F.isDeclaration()) continue;
+
+      bool keep = false, scored = false;
+
+      for (auto &BB : F){
+        for (auto &I : BB){
+          file_id = get_inst_file_id(I, git_path, module_files, line);
+          if (file_id == CHURN_NO_FILE) continue;
+
+          ChurnLineScores &file_scores = module_files.scores[file_id];
+          if (file_scores.unexist ||
+              is_churned_line(file_scores, line, san_age_thd, san_rank_thd, san_change_thd)){
+            keep = true;
+            break;
+          }
+          scored = true;
+        }
+        if (keep) break;
+      }
+
+      if (keep || !scored) san_kept += has_sanitizer_checks(F);
+      else san_dropped += drop_sanitizer_checks(F);
+    }
+  }
+
+  /* LTO mode counts every block under an ID of its own instead of hashing
+     (prev_loc, cur_loc) pairs. An edge is then told apart by the block it
+     leaves (if that has a single successor) or the one it enters (if that has
+     a single predecessor); critical edges have neither, so give them a block
+     first. These blocks only jump on and get no churn weight of their own. */
+
+  DenseSet<BasicBlock *> source_blocks, probe_blocks;
+
+  if (lto)
+    for (auto &F : M){
+      if (F.isDeclaration()) continue;
+      for (auto &BB : F) source_blocks.insert(&BB);
+      SplitAllCriticalEdges(F);
+    }
+
+  /* Which blocks get a probe: AFL_INST_RATIO of them, picked by the hash of
+     the block with stable IDs and at random otherwise. Decided before any
+     block is instrumented, so that pruning knows which probes exist. */
+
+  for (auto &F : M){
+    DenseMap<BasicBlock *, unsigned int> block_pos;
+    unsigned int pos = 0;
+
+    if (F.isDeclaration()) continue;
+    for (auto &BB : F) block_pos[&BB] = pos++;
+
+    auto sample = [&](BasicBlock *BB){
+      if (stable_ids)
+        return get_stable_block_hash(M, F, *BB, block_pos[BB], ~HASH_CONST) % 100 <
+               inst_ratio;
+      return AFL_R(100) < inst_ratio;
+    };
+
+    if (prune_blocks) get_implied_blocks(F, implied_by, probe_blocks, sample);
+    else
+      for (auto &BB : F)
+        if (sample(&BB)) probe_blocks.insert(&BB);
+  }
+
+  /* Number the edges up front: the map needs as many bytes as there are
+     IDs, and the fitness slots go right after it. The runtime learns the
+     size from __aflchurn_map_size and reports it to the tools. Stable IDs
+     are hashed instead, and keep the whole map. */
+
+  if (stable_ids){
+    for (auto &F : M){
+      unsigned int pos = 0;
+      for (auto &BB : F){
+        if (probe_blocks.count(&BB)){
+          block_ids[&BB] = get_stable_block_hash(M, F, BB, pos, HASH_CONST) % MAP_SIZE;
+          next_loc++;
+        }
+        pos++;
+      }
+    }
+  } else if (lto){
+    for (auto &F : M)
+      for (auto &BB : F)
+        if (probe_blocks.count(&BB)) block_ids[&BB] = next_loc++;
+
+    map_size = next_loc ? next_loc : 1;
+    map_size = (map_size + MAP_SIZE_ALIGN - 1) & ~(MAP_SIZE_ALIGN - 1);
+    if (map_size > MAP_SIZE_MAX) map_size = MAP_SIZE_MAX;
+  }
+
+  if (lto){
+
+    new GlobalVariable(M, Int32Ty, true, GlobalValue::ExternalLinkage,
+                       ConstantInt::get(Int32Ty, map_size), "__aflchurn_map_size");
+  }
+
+  weight_slot = use_fixed_fitness ? map_size + 16 : map_size;
+
+  for (auto &F : M){
+
+    /* AFLCHURN_HOIST_FITNESS: what the weighted BBs executed in this call of
+       F add up to so far */
+    AllocaInst *FitSum = NULL, *FitCnt = NULL;
+
+    /* AFLCHURN_PRUNE: blocks without a probe go first, so that what they
+       weigh is known once the block that implies them gets its probe */
+    std::vector<BasicBlock *> blocks;
+    DenseMap<BasicBlock *, ChurnProbeWeight> probe_weights;
+
+    for (auto &BB : F)
+      if (implied_by.count(&BB)) blocks.push_back(&BB);
+    for (auto &BB : F)
+      if (!implied_by.count(&BB)) blocks.push_back(&BB);
+
+    /* AFLCHURN_CTX: in a function with a line above the thresholds, the
+       prev_loc it is entered with (the block of the caller) is mixed into
+       the prev_loc of each of its blocks, so that its edges are told apart
+       per call site. Other functions stay as they are. */
+    bool ctx_fn = false;
+    Value *CtxLoc = NULL;
+
+    for (auto &BB : F){
+      if (!use_ctx || git_no_found || ctx_fn) break;
+      for (auto &I : BB){
+        file_id = get_inst_file_id(I, git_path, module_files, line);
+        if (file_id == CHURN_NO_FILE || module_files.scores[file_id].unexist) continue;
+
+        if (is_churned_line(module_files.scores[file_id], line,
+                            norm_age_thd, norm_rank_thd, norm_change_thd)){
+          ctx_fn = true;
+          break;
+        }
+      }
+    }
+    
+    for (BasicBlock *Block : blocks) {
       
-      LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
-      MapPtr->setMetadata(NoSanMetaId, NoneMetaNode);
-      Value *MapPtrIdx =
-          IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
+      BasicBlock &BB = *Block;
+      BasicBlock::iterator IP = BB.getFirstInsertionPt();
+      IRBuilder<> IRB(&(*IP));
+      unsigned int cur_loc = 0;
+      bool implied = implied_by.count(&BB);
 
-      /* Update bitmap */
+      /* Make up cur_loc */
 
-      LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
-      Counter->setMetadata(NoSanMetaId, NoneMetaNode);
-      Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
-      IRB.CreateStore(Incr, MapPtrIdx)
-          ->setMetadata(NoSanMetaId, NoneMetaNode);
+      if (implied) pruned_blocks++;
+      else if (lto || stable_ids){
+        auto ID = block_ids.find(&BB);
+        if (ID == block_ids.end()) continue;
+        cur_loc = ID->second % map_size;
+      } else {
+        if (!probe_blocks.count(&BB)) continue;
+        cur_loc = AFL_R(MAP_SIZE);
+      }
+
+      ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
+
+      double bb_rank_age = 0, bb_age_best = 0, bb_burst_best = 0, bb_rank_best = 0;
+      double bb_raw_fitness = 0, tmp_score;
+      bool bb_raw_fitness_flag = false;
+      double bb_channel[CHURN_CHANNELS] = {0, 0, 0};
+      unsigned int bb_file = CHURN_NO_FILE, bb_line = 0;
+      
+      if (!bb_lines.empty())
+            bb_lines.clear();
+      bb_lines.insert(0);
+      
+      for (auto &I: BB){
+  
+        /* Connect targets with instructions */
+        if (git_no_found || (lto && !source_blocks.count(&BB))) break;
+
+        file_id = get_inst_file_id(I, git_path, module_files, line);
+        if (file_id == CHURN_NO_FILE) continue;
 
+        /* calculate score of a block */
+        ChurnLineScores &file_scores = module_files.scores[file_id];
+        if (file_scores.unexist) break;
+
+        if (bb_lines.count(line)) continue;
+        bb_lines.insert(line);
+
+        if (bb_file == CHURN_NO_FILE){
+          bb_file = file_id;
+          bb_line = line;
+        }
+        
+        if (use_cmd_age){
+          // calculate line age; use the best value of a line as the value of a BB
+          if (line < file_scores.age.size()){
+            tmp_score = file_scores.age[line];
+            if (bb_age_best < tmp_score) bb_rank_age = bb_age_best = tmp_score;
+          }
+        }
 
-      /* Set prev_loc to cur_loc >> 1 */
+        if (use_cmd_age_rank){
+          if (line < file_scores.rank.size()){
+            tmp_score = file_scores.rank[line];
+            if (bb_rank_best < tmp_score) bb_rank_age = bb_rank_best = tmp_score;
+          }
+        }
 
-      StoreInst *Store =
-          IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
-      Store->setMetadata(NoSanMetaId, NoneMetaNode);
+        if (use_cmd_change){
+          // calculate line change
+          if (line < file_scores.change.size()){
+            tmp_score = file_scores.change[line];
+            if (bb_burst_best < tmp_score) bb_burst_best = tmp_score;
+          }
+        }
 
+        if (use_channels){
+          if (line < file_scores.age.size())
+            bb_channel[CHURN_CH_AGE] = std::max(bb_channel[CHURN_CH_AGE], file_scores.age[line]);
+          if (line < file_scores.rank.size())
+            bb_channel[CHURN_CH_RANK] = std::max(bb_channel[CHURN_CH_RANK], file_scores.rank[line]);
+          if (line < file_scores.change.size())
+            bb_channel[CHURN_CH_CHURN] = std::max(bb_channel[CHURN_CH_CHURN], file_scores.change[line]);
+        }
+      } 
+ 
       /* insert age/churn into BBs */
       if ((use_cmd_age || use_cmd_age_rank) && !use_cmd_change){
         /* Age only; Add age of lines */
@@ -1093,52 +2233,320 @@ bool AFLCoverage::runOnModule(Module &M) {
         
       }
 
+      /* Add the block to what its probe adds up */
+      ChurnProbeWeight &PW = probe_weights[implied ? implied_by[&BB] : &BB];
+
       if (bb_raw_fitness_flag) {
-        Constant *Weight = ConstantFP::get(DoubleTy, bb_raw_fitness);
-        Constant *MapLoc = ConstantInt::get(Int32Ty, MAP_SIZE);
-        Constant *MapCntLoc = ConstantInt::get(Int32Ty, MAP_SIZE + 8);
-        
-        // add to shm, churn raw fitness
-        Value *MapWtPtr = IRB.CreateGEP(MapPtr, MapLoc);
-        LoadInst *MapWt = IRB.CreateLoad(DoubleTy, MapWtPtr);
-        MapWt->setMetadata(NoSanMetaId, NoneMetaNode);
-        Value *IncWt = IRB.CreateFAdd(MapWt, Weight);
-        IRB.CreateStore(IncWt, MapWtPtr)
+        // churn raw fitness quantized to CHURN_FIXED_SHIFT fractional bits;
+        // never 0, so that the block still counts
+        unsigned long long fixed_fitness =
+                                llround(ldexp(bb_raw_fitness, CHURN_FIXED_SHIFT));
+        PW.sum += bb_raw_fitness;
+        PW.fixed_sum += fixed_fitness ? fixed_fitness : 1;
+        PW.cnt++;
+      }
+
+      /* Each signal on its own, selected like in a build with only that one;
+         always per block, in fixed point */
+      if (use_channels){
+        double channel_thd[CHURN_CHANNELS] = {norm_age_thd, norm_rank_thd, norm_change_thd};
+
+        for (unsigned int ch = 0; ch < CHURN_CHANNELS; ch++){
+          if (!(bb_channel[ch] > 0) ||
+              (bb_channel[ch] <= channel_thd[ch] && AFL_R(100) >= bb_select_ratio)) continue;
+
+          unsigned long long fixed_score = llround(ldexp(bb_channel[ch], CHURN_FIXED_SHIFT));
+          PW.channel_sum[ch] += fixed_score ? fixed_score : 1;
+          PW.channel_cnt[ch]++;
+        }
+      }
+
+      if (use_metadata && bb_file != CHURN_NO_FILE)
+        PW.meta.push_back(std::make_tuple(bb_file, bb_line, bb_rank_age, bb_burst_best,
+                                          bb_raw_fitness_flag ? bb_raw_fitness : 0));
+
+      if (use_dict && bb_raw_fitness_flag){
+        std::vector<std::string> tokens;
+        get_churn_dict_tokens(BB, M.getDataLayout(), tokens);
+        for (auto &token : tokens)
+          if (token.size() <= MAX_DICT_FILE && dict_tokens[token] < bb_raw_fitness)
+            dict_tokens[token] = bb_raw_fitness;
+      }
+
+      if (implied) continue;
+
+      /* Load SHM pointer */
+      
+      LoadInst *MapPtr = IRB.CreateLoad(Int8PtrTy, AFLMapPtr);
+      MapPtr->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *MapPtrIdx;
+
+      if (lto) MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, CurLoc);
+      else {
+
+        /* Load prev_loc */
+
+        LoadInst *PrevLoc = IRB.CreateLoad(Int32Ty, AFLPrevLoc);
+        PrevLoc->setMetadata(NoSanMetaId, NoneMetaNode);
+        Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
+
+        /* The entry block dominates the others; without a probe there, the
+           function goes without a context */
+        if (ctx_fn && &BB == &F.getEntryBlock()){
+          CtxLoc = PrevLoc;
+          ctx_functions++;
+        }
+
+        MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
+
+      }
+
+      /* Update bitmap */
+
+      LoadInst *Counter = IRB.CreateLoad(Int8Ty, MapPtrIdx);
+      Counter->setMetadata(NoSanMetaId, NoneMetaNode);
+      Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
+      IRB.CreateStore(Incr, MapPtrIdx)
           ->setMetadata(NoSanMetaId, NoneMetaNode);
 
-        // add to shm, block count
-#ifdef WORD_SIZE_64
-        Value *MapCntPtr = IRB.CreateGEP(MapPtr, MapCntLoc);
-        LoadInst *MapCnt = IRB.CreateLoad(Int64Ty, MapCntPtr);
-        MapCnt->setMetadata(NoSanMetaId, NoneMetaNode);
-        Value *IncCnt = IRB.CreateAdd(MapCnt, ConstantInt::get(Int64Ty, 1));
-        IRB.CreateStore(IncCnt, MapCntPtr)
-                ->setMetadata(NoSanMetaId, NoneMetaNode);
-#else
-        Value *MapCntPtr = IRB.CreateGEP(MapPtr, MapCntLoc);
-        LoadInst *MapCnt = IRB.CreateLoad(Int32Ty, MapCntPtr);
-        MapCnt->setMetadata(NoSanMetaId, NoneMetaNode);
-        Value *IncCnt = IRB.CreateAdd(MapCnt, ConstantInt::get(Int32Ty, 1));
-        IRB.CreateStore(IncCnt, MapCntPtr)
-                ->setMetadata(NoSanMetaId, NoneMetaNode);
 
-#endif
+      /* Set prev_loc to cur_loc >> 1, in the context of the caller if any */
+
+      if (!lto) {
+        Value *NewPrevLoc = ConstantInt::get(Int32Ty, cur_loc >> 1);
+        if (CtxLoc) NewPrevLoc = IRB.CreateXor(CtxLoc, NewPrevLoc);
+        StoreInst *Store = IRB.CreateStore(NewPrevLoc, AFLPrevLoc);
+        Store->setMetadata(NoSanMetaId, NoneMetaNode);
+      }
+
+      if (PW.cnt) {
+        Constant *Weight, *Cnt = ConstantInt::get(CntTy, PW.cnt);
+
+        if (use_fixed_fitness) Weight = ConstantInt::get(Int64Ty, PW.fixed_sum);
+        else Weight = ConstantFP::get(DoubleTy, PW.sum);
+
+        if (use_weight_table) {
+          // afl-fuzz weighs the hits of this edge; the blocks it implies
+          // only by their mean
+          weight_table.push_back(ConstantStruct::get(WeightRecTy,
+              {ConstantInt::get(Int32Ty, cur_loc),
+               ConstantFP::get(FloatTy, PW.sum / PW.cnt)}));
+        } else if (use_hoist_fitness) {
+          // add to the locals of the function
+          if (!FitSum) {
+            IRBuilder<> EntryIRB(&*F.getEntryBlock().getFirstInsertionPt());
+            FitSum = EntryIRB.CreateAlloca(Weight->getType());
+            FitCnt = EntryIRB.CreateAlloca(CntTy);
+            EntryIRB.CreateStore(Constant::getNullValue(Weight->getType()), FitSum);
+            EntryIRB.CreateStore(ConstantInt::get(CntTy, 0), FitCnt);
+          }
+          add_to_churn_counter(IRB, FitSum, Weight);
+          add_to_churn_counter(IRB, FitCnt, Cnt);
+        } else {
+          // add to shm, churn raw fitness and block count
+          add_to_churn_counter(IRB, get_churn_shm_slot(IRB, MapPtr, weight_slot,
+                                                       Weight->getType()), Weight);
+          add_to_churn_counter(IRB, get_churn_shm_slot(IRB, MapPtr, map_size + 8, CntTy),
+                               Cnt);
+        }
+      }
+
+      for (unsigned int ch = 0; ch < CHURN_CHANNELS; ch++){
+        if (!PW.channel_cnt[ch]) continue;
+
+        add_to_churn_counter(IRB, get_churn_shm_slot(IRB, MapPtr,
+                                 map_size + CHURN_CHANNEL_SHM + 16 * ch, Int64Ty),
+                             ConstantInt::get(Int64Ty, PW.channel_sum[ch]));
+        add_to_churn_counter(IRB, get_churn_shm_slot(IRB, MapPtr,
+                                 map_size + CHURN_CHANNEL_SHM + 16 * ch + 8, CntTy),
+                             ConstantInt::get(CntTy, PW.channel_cnt[ch]));
       }
 
+      for (auto &rec : PW.meta)
+        meta_records.push_back(ConstantStruct::get(MetaRecTy,
+            {ConstantInt::get(Int32Ty, cur_loc), ConstantInt::get(Int32Ty, std::get<0>(rec)),
+             ConstantInt::get(Int32Ty, std::get<1>(rec)),
+             ConstantFP::get(FloatTy, std::get<2>(rec)),
+             ConstantFP::get(FloatTy, std::get<3>(rec)),
+             ConstantFP::get(FloatTy, std::get<4>(rec))}));
+
       inst_blocks++;
 
     }
+
+    /* Hand what this call of F gathered over to the shared memory, or to
+       the accumulators of the thread */
+    if (FitSum){
+
+      std::vector<Instruction *> flush_points;
+
+      for (auto &BB : F)
+        for (auto &I : BB)
+          if (is_churn_flush_point(I)) flush_points.push_back(&I);
+
+      for (auto *I : flush_points){
+        IRBuilder<> IRB(I);
+        Type *SumTy = FitSum->getAllocatedType();
+        Value *Sum = IRB.CreateLoad(SumTy, FitSum), *Cnt = IRB.CreateLoad(CntTy, FitCnt);
+
+        if (use_thread_fitness) {
+          /* A thread gets its slot the first time it gets here */
+          LoadInst *Slot = IRB.CreateLoad(FitnessPtrTy, AFLFitnessSlot);
+          BasicBlock *Head = I->getParent();
+          Instruction *Then = SplitBlockAndInsertIfThen(
+              IRB.CreateIsNull(Slot), I, false,
+              MDBuilder(C).createBranchWeights(1, 1 << 20));
+          Value *NewSlot = IRBuilder<>(Then).CreateCall(AFLRegisterThread);
+
+          IRB.SetInsertPoint(I);
+          PHINode *ThreadSlot = IRB.CreatePHI(FitnessPtrTy, 2);
+          ThreadSlot->addIncoming(Slot, Head);
+          ThreadSlot->addIncoming(NewSlot, Then->getParent());
+
+          /* Atomic, for the fork server may merge the slot at any time */
+          add_to_churn_counter_atomic(IRB, IRB.CreateStructGEP(FitnessTy, ThreadSlot,
+                                                               use_fixed_fitness ? 1 : 0), Sum);
+          add_to_churn_counter_atomic(IRB, IRB.CreateStructGEP(FitnessTy, ThreadSlot, 2),
+                                      IRB.CreateZExt(Cnt, Int64Ty));
+        } else {
+          LoadInst *MapPtr = IRB.CreateLoad(Int8PtrTy, AFLMapPtr);
+          MapPtr->setMetadata(NoSanMetaId, NoneMetaNode);
+          add_to_churn_counter(IRB, get_churn_shm_slot(IRB, MapPtr, weight_slot, SumTy), Sum);
+          add_to_churn_counter(IRB, get_churn_shm_slot(IRB, MapPtr, map_size + 8, CntTy), Cnt);
+        }
+
+        IRB.CreateStore(Constant::getNullValue(SumTy), FitSum);
+        IRB.CreateStore(ConstantInt::get(CntTy, 0), FitCnt);
+      }
+
+      /* Keep the sums in registers */
+      DominatorTree DT(F);
+      PromoteMemToReg({FitSum, FitCnt}, DT);
+
+    }
+
+  }
+
+  if (profile_str){
+    profile.instrument_us = get_cur_time_us() - profile.start_us -
+                            profile.discovery_us - profile.scoring_us;
+    write_churn_profile(profile_str, profile, M,
+                        index_str ? "index" : (git_no_found ? "none" : "git"),
+                        git_path, module_files,
+                        inst_blocks, inst_ages, inst_changes, inst_fitness);
+  }
+
+  /* Edge ID, weight records in a section of their own; see config.h */
+  if (!weight_table.empty()){
+    ArrayType *TableTy = ArrayType::get(WeightRecTy, weight_table.size());
+    GlobalVariable *Table = new GlobalVariable(M, TableTy, true,
+        GlobalValue::PrivateLinkage, ConstantArray::get(TableTy, weight_table),
+        "__aflchurn_weights");
+    Table->setSection(CHURN_WEIGHTS_SECTION);
+    appendToUsed(M, {Table});
+  }
+
+  /* Block records and file paths of this module in a chunk of their own;
+     see config.h */
+  if (!meta_records.empty()){
+    std::string paths;
+    for (auto &path : module_files.paths){
+      paths += path;
+      paths += '\0';
+    }
+    paths.resize((paths.size() + 3) & ~3, '\0');
+
+    uint32_t header[5] = {CHURN_META_MAGIC, 0, lto ? (uint32_t)CHURN_META_LTO : 0,
+                          (uint32_t)meta_records.size(),
+                          (uint32_t)module_files.paths.size()};
+    header[1] = sizeof(header) + meta_records.size() * 24 + paths.size();
+    ArrayType *RecsTy = ArrayType::get(MetaRecTy, meta_records.size());
+    Constant *Chunk = ConstantStruct::getAnon(
+        {ConstantDataArray::get(C, ArrayRef<uint32_t>(header)), ConstantArray::get(RecsTy, meta_records),
+         ConstantDataArray::getString(C, paths, false)}, true);
+    GlobalVariable *Meta = new GlobalVariable(M, Chunk->getType(), true,
+        GlobalValue::PrivateLinkage, Chunk, "__aflchurn_meta");
+    Meta->setSection(CHURN_META_SECTION);
+#if LLVM_VERSION_MAJOR >= 10
+    Meta->setAlignment(MaybeAlign(4));
+#else
+    Meta->setAlignment(4);
+#endif
+    appendToUsed(M, {Meta});
+  }
+
+  /* Dictionary tokens of this module in a chunk of their own; see config.h */
+  if (!dict_tokens.empty()){
+    std::vector<Constant *> chunk;
+    uint32_t size = 12;
+
+    chunk.push_back(nullptr);
+    for (auto &dt : dict_tokens){
+      std::string bytes = dt.first;
+      uint32_t len = bytes.size();
+      bytes.resize((len + 3) & ~3, '\0');
+      chunk.push_back(ConstantFP::get(FloatTy, dt.second));
+      chunk.push_back(ConstantInt::get(Int32Ty, len));
+      chunk.push_back(ConstantDataArray::getString(C, bytes, false));
+      size += 8 + bytes.size();
+    }
+
+    uint32_t header[3] = {CHURN_DICT_MAGIC, size, (uint32_t)dict_tokens.size()};
+    chunk[0] = ConstantDataArray::get(C, ArrayRef<uint32_t>(header));
+    Constant *Chunk = ConstantStruct::getAnon(chunk, true);
+    GlobalVariable *Dict = new GlobalVariable(M, Chunk->getType(), true,
+        GlobalValue::PrivateLinkage, Chunk, "__aflchurn_dict");
+    Dict->setSection(CHURN_DICT_SECTION);
+#if LLVM_VERSION_MAJOR >= 10
+    Dict->setAlignment(MaybeAlign(4));
+#else
+    Dict->setAlignment(4);
+#endif
+    appendToUsed(M, {Dict});
+  }
+
+  /* Tell afl-fuzz that the channels are filled in; see CHANNELS_SIG */
+  if (use_channels){
+    Constant *Sig = ConstantDataArray::getString(C, CHANNELS_SIG);
+    GlobalVariable *SigVar = new GlobalVariable(M, Sig->getType(), true,
+        GlobalValue::PrivateLinkage, Sig, "__aflchurn_channels_sig");
+    appendToUsed(M, {SigVar});
   }
 
+  if (lto && !stable_ids && next_loc > map_size)
+    WARNF("%u edges do not fit in the map of %u entries and some share IDs; "
+          "raise MAP_SIZE_MAX_POW2 in config.h.", next_loc, map_size);
+
   /* Say something nice. */
 
   if (!be_quiet) {
 
     if (!inst_blocks) WARNF("No instrumentation targets found.");
-    else OKF("Instrumented %u locations (%s mode, ratio %u%%).",
-             inst_blocks, getenv("AFL_HARDEN") ? "hardened" :
+    else OKF("Instrumented %u locations (%s%s mode, ratio %u%%).",
+             inst_blocks, lto ? "LTO, " : "", getenv("AFL_HARDEN") ? "hardened" :
              ((getenv("AFL_USE_ASAN") || getenv("AFL_USE_MSAN")) ?
               "ASAN/MSAN" : "non-hardened"), inst_ratio);
+    if (selective_san && !git_no_found)
+      OKF("Sanitizer checks kept in %u functions, taken out of %u unchanged ones.",
+          san_kept, san_dropped);
+    if (ctx_functions)
+      OKF("Edges of %u churned functions are told apart by their caller.",
+          ctx_functions);
+    if (pruned_blocks)
+      OKF("Pruned %u blocks implied by others, their weight goes to those.",
+          pruned_blocks);
+    if (lto && !stable_ids && next_loc && next_loc <= map_size)
+      OKF("Edge IDs 0-%u are unique, the map takes %u bytes.",
+          next_loc - 1, map_size);
+    if (!meta_records.empty())
+      OKF("Records of %u blocks written to the %s section.",
+          (unsigned int)meta_records.size(), CHURN_META_SECTION);
+    if (!dict_tokens.empty())
+      OKF("%u dictionary tokens of weighted blocks written to the %s section.",
+          (unsigned int)dict_tokens.size(), CHURN_DICT_SECTION);
+    if (use_weight_table)
+      OKF("Weights of %u edges written to the %s section for afl-fuzz.",
+          (unsigned int)weight_table.size(), CHURN_WEIGHTS_SECTION);
     OKF("AFLChurn instrumentation ratio %u%%", bb_select_ratio);
     if (inst_ages) module_ave_ages = module_total_ages / inst_ages;
     if (inst_changes) module_ave_chanegs = module_total_changes / inst_changes;
@@ -1158,6 +2566,28 @@ bool AFLCoverage::runOnModule(Module &M) {
 
     OKF("BB Churn Raw Fitness. Instrumented %u BBs with average raw fitness of %.6f",
                     inst_fitness, module_ave_fitness);
+    if (cached_files)
+      OKF("Reused line scores of %u files from the history cache.", cached_files);
+    if (histd_files)
+      OKF("Got line scores of %u files from aflchurn-histd.", histd_files);
+    if (!profile.history_cut.empty()){
+      unsigned long long diffed = 0, total = 0;
+      for (auto &hc : profile.history_cut){
+        diffed += hc.second.diffed;
+        total += hc.second.total;
+      }
+      OKF("History of %u files cut short, churn extrapolated from %llu of their %llu commits.",
+          (unsigned int)profile.history_cut.size(), diffed, total);
+    }
+    if (!profile.blame_cut.empty()){
+      unsigned long long cut_lines = 0, lines = 0;
+      for (auto &bc : profile.blame_cut){
+        cut_lines += bc.second.cut_lines;
+        lines += bc.second.lines;
+      }
+      OKF("Blame of %u files cut short, %llu of their %llu lines given to the boundary commit.",
+          (unsigned int)profile.blame_cut.size(), cut_lines, lines);
+    }
       
 
   }
@@ -1174,6 +2604,14 @@ static void registerAFLPass(const PassManagerBuilder &,
 
 }
 
+
+static void registerAFLLTOPass(const PassManagerBuilder &,
+                               legacy::PassManagerBase &PM) {
+
+  PM.add(new AFLCoverage(true));
+
+}
+
 // TODO: which one? early or last? - rosen
 
 // static RegisterStandardPasses RegisterAFLPass(
@@ -1185,3 +2623,75 @@ static RegisterStandardPasses RegisterAFLPass(
 
 static RegisterStandardPasses RegisterAFLPass0(
     PassManagerBuilder::EP_EnabledOnOptLevel0, registerAFLPass);
+
+
+/* The same passes for the legacy LTO pipeline, where afl-clang-fast -flto
+   loads this library into the linker. */
+
+static RegisterStandardPasses RegisterAFLLTOPass(
+    PassManagerBuilder::EP_FullLinkTimeOptimizationLast, registerAFLLTOPass);
+
+
+#if LLVM_VERSION_MAJOR >= 11
+
+/* New pass manager, loaded with -fpass-plugin (and --load-pass-plugin in
+   lld for LTO). */
+
+namespace {
+
+  class AFLCoveragePass : public PassInfoMixin<AFLCoveragePass> {
+
+    public:
+
+      AFLCoveragePass(bool lto) : lto(lto) { }
+
+      PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+        return instrument_churn_module(M, lto) ? PreservedAnalyses::none()
+                                               : PreservedAnalyses::all();
+      }
+
+    private:
+
+      bool lto;
+
+  };
+
+}
+
+#if LLVM_VERSION_MAJOR >= 14
+typedef OptimizationLevel AFLOptLevel;
+#else
+typedef PassBuilder::OptimizationLevel AFLOptLevel;
+#endif
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+
+  return {LLVM_PLUGIN_API_VERSION, "AFLChurn", VERSION, [](PassBuilder &PB) {
+
+    PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager &MPM, AFLOptLevel) {
+          MPM.addPass(AFLCoveragePass(false));
+        });
+
+    /* For opt -passes=aflchurn or aflchurn-lto */
+
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+          if (Name != "aflchurn" && Name != "aflchurn-lto") return false;
+          MPM.addPass(AFLCoveragePass(Name == "aflchurn-lto"));
+          return true;
+        });
+
+#if LLVM_VERSION_MAJOR >= 15
+    PB.registerFullLinkTimeOptimizationLastEPCallback(
+        [](ModulePassManager &MPM, AFLOptLevel) {
+          MPM.addPass(AFLCoveragePass(true));
+        });
+#endif
+
+  }};
+
+}
+
+#endif /* LLVM_VERSION_MAJOR >= 11 */
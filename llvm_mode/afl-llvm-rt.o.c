@@ -55,17 +55,207 @@
 
 /* Globals needed by the injected instrumentation. The __afl_area_initial region
    is used for instrumentation output before __afl_map_shm() has a chance to run.
-   It will end up as .comm, so it shouldn't be too wasteful. */
+   It will end up as .comm, so it shouldn't be too wasteful. LTO builds with a
+   larger map get a larger region when they start (area_dummy). */
 
 u8  __afl_area_initial[MAP_SIZE + WEIGHT_SHM];
 u8* __afl_area_ptr = __afl_area_initial;
 
+static u8* area_dummy = __afl_area_initial;
+
 __thread u32 __afl_prev_loc;
 
+/* Size of the map: LTO builds define __aflchurn_map_size, the rest of them
+   use MAP_SIZE. The fitness slots follow the map. */
+
+extern const u32 __aflchurn_map_size __attribute__((weak));
+
+u32 __afl_map_size = MAP_SIZE;
+
+
+/* Per-thread sums of the BB fitness for code built with
+   AFLCHURN_THREAD_FITNESS, so that threads neither lose updates of the
+   shared slots nor fight over their cache line. Each thread adds to a slot
+   of its own in a shared mapping, with atomic adds; the pass knows the
+   layout of the leading fields. The slots go to the shared memory with
+   atomic exchanges, so that no update is lost or counted twice whoever
+   merges them: the fork server after each run (which covers crashes,
+   _exit() and timeouts), the persistent loop before it stops, and, without
+   a fork server, atexit() and the handlers of fatal signals. */
+
+struct churn_fitness {
+
+  double sum;                         /* Fitness of the weighted BBs      */
+  u64    fixed;                       /* ... in fixed point               */
+  u64    cnt;                         /* Number of weighted BBs           */
+
+  u8     pad[40];                     /* One cache line per thread        */
+
+};
+
+struct churn_fitness_slots {
+
+  u32 used;                           /* Slots handed out                 */
+  u8  pad[60];
+
+  struct churn_fitness slot[CHURN_FITNESS_SLOTS];
+
+};
+
+__thread struct churn_fitness *__aflchurn_fitness_slot;
+
+static struct churn_fitness_slots *fitness_slots;
+
+static const s32 fatal_signals[] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL };
+static struct sigaction old_fatal_actions[sizeof(fatal_signals) / sizeof(s32)];
+
+
+/* Running in persistent mode? Talking to a fork server? */
+
+static u8 is_persistent, forkserver_on;
+
+
+/* The shared mapping; made before the fork server starts, or earlier if
+   instrumented code runs first. */
+
+static struct churn_fitness_slots *get_fitness_slots(void) {
+
+  struct churn_fitness_slots *s;
+
+  if (fitness_slots) return fitness_slots;
+
+  s = mmap(NULL, sizeof(struct churn_fitness_slots), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (s == MAP_FAILED) _exit(1);
+
+  if (!__sync_bool_compare_and_swap(&fitness_slots, NULL, s))
+    munmap(s, sizeof(struct churn_fitness_slots));
 
-/* Running in persistent mode? */
+  return fitness_slots;
 
-static u8 is_persistent;
+}
+
+
+/* Move the sums of all slots to the shared memory. Async-signal-safe. */
+
+static void __afl_merge_fitness(void) {
+
+  struct churn_fitness_slots *s = fitness_slots;
+  u32 i, used;
+
+  if (!s) return;
+
+  used = __atomic_load_n(&s->used, __ATOMIC_RELAXED);
+  if (used > CHURN_FITNESS_SLOTS) used = CHURN_FITNESS_SLOTS;
+
+  for (i = 0; i < used; i++) {
+
+    struct churn_fitness *f = &s->slot[i];
+    u64 sum_bits = __atomic_exchange_n((u64 *)&f->sum, 0, __ATOMIC_RELAXED),
+        fixed = __atomic_exchange_n(&f->fixed, 0, __ATOMIC_RELAXED),
+        cnt = __atomic_exchange_n(&f->cnt, 0, __ATOMIC_RELAXED);
+    double sum;
+
+    if (!cnt && !fixed && !sum_bits) continue;
+
+    memcpy(&sum, &sum_bits, sizeof(sum));
+
+    *(double *)(__afl_area_ptr + __afl_map_size) += sum;
+    *(u64 *)(__afl_area_ptr + __afl_map_size + 16) += fixed;
+
+#ifdef WORD_SIZE_64
+    *(u64 *)(__afl_area_ptr + __afl_map_size + 8) += cnt;
+#else
+    *(u32 *)(__afl_area_ptr + __afl_map_size + 8) += cnt;
+#endif /* ^WORD_SIZE_64 */
+
+  }
+
+}
+
+
+/* Without a fork server, a crash would take the sums along: merge them,
+   then let the signal do what it would have done. */
+
+static void fitness_fatal_signal(int sig) {
+
+  u32 i;
+
+  __afl_merge_fitness();
+
+  for (i = 0; i < sizeof(fatal_signals) / sizeof(s32); i++)
+    if (fatal_signals[i] == sig) sigaction(sig, &old_fatal_actions[i], NULL);
+
+  raise(sig);
+
+}
+
+
+/* Called by the instrumentation when a thread first adds to its sums;
+   returns the slot of the thread. */
+
+struct churn_fitness *__aflchurn_register_thread(void) {
+
+  static volatile u32 handlers_set;
+  struct churn_fitness_slots *s = get_fitness_slots();
+  u32 i = __atomic_fetch_add(&s->used, 1, __ATOMIC_RELAXED);
+
+  if (i >= CHURN_FITNESS_SLOTS) i = CHURN_FITNESS_SLOTS - 1;
+
+  __aflchurn_fitness_slot = &s->slot[i];
+
+  if (!forkserver_on && !__sync_lock_test_and_set(&handlers_set, 1)) {
+
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fitness_fatal_signal;
+    sigemptyset(&sa.sa_mask);
+
+    for (i = 0; i < sizeof(fatal_signals) / sizeof(s32); i++)
+      sigaction(fatal_signals[i], &sa, &old_fatal_actions[i]);
+
+  }
+
+  return __aflchurn_fitness_slot;
+
+}
+
+
+/* Forget what the slots hold, e.g. what ran before the persistent loop. */
+
+static void drop_fitness(void) {
+
+  struct churn_fitness_slots *s = fitness_slots;
+  u32 i, used;
+
+  if (!s) return;
+
+  used = __atomic_load_n(&s->used, __ATOMIC_RELAXED);
+  if (used > CHURN_FITNESS_SLOTS) used = CHURN_FITNESS_SLOTS;
+
+  for (i = 0; i < used; i++) {
+    __atomic_store_n((u64 *)&s->slot[i].sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->slot[i].fixed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->slot[i].cnt, 0, __ATOMIC_RELAXED);
+  }
+
+}
+
+
+/* Before a new child: whatever the slots hold belongs to the fork server. */
+
+static void reset_fitness_slots(void) {
+
+  struct churn_fitness_slots *s = fitness_slots;
+
+  if (!s) return;
+
+  memset(s->slot, 0, sizeof(s->slot));
+  s->used = 0;
+
+}
 
 
 /* SHM setup. */
@@ -102,15 +292,18 @@ static void __afl_map_shm(void) {
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
+  u32 hello = FS_OPT_MAP_SIZE | __afl_map_size;
   s32 child_pid;
 
   u8  child_stopped = 0;
 
-  /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+  /* Phone home and tell the parent that we're OK, and how large a map we
+     need. If parent isn't there, assume we're not running in forkserver mode
+     and just execute program. */
+
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  forkserver_on = 1;
 
   while (1) {
 
@@ -134,6 +327,8 @@ static void __afl_start_forkserver(void) {
 
       /* Once woken up, create a clone of our process. */
 
+      reset_fitness_slots();
+
       child_pid = fork();
       if (child_pid < 0) _exit(1);
 
@@ -141,6 +336,7 @@ static void __afl_start_forkserver(void) {
 
       if (!child_pid) {
 
+        __aflchurn_fitness_slot = NULL;
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
         return;
@@ -170,6 +366,10 @@ static void __afl_start_forkserver(void) {
 
     if (WIFSTOPPED(status)) child_stopped = 1;
 
+    /* The sums of the child, however it ended, or of this iteration. */
+
+    __afl_merge_fitness();
+
     /* Relay wait status to pipe, then loop back. */
 
     if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
@@ -195,9 +395,10 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (is_persistent) {
 
-      memset(__afl_area_ptr, 0, MAP_SIZE + WEIGHT_SHM);
+      memset(__afl_area_ptr, 0, __afl_map_size + WEIGHT_SHM);
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
+      drop_fitness();
     }
 
     cycle_cnt  = max_cnt;
@@ -208,6 +409,11 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
   if (is_persistent) {
 
+    /* afl-fuzz reads the fitness when we stop; the fork server merges
+       the sums, too, in case other threads add to them until then. */
+
+    __afl_merge_fitness();
+
     if (--cycle_cnt) {
 
       raise(SIGSTOP);
@@ -223,7 +429,7 @@ int __afl_persistent_loop(unsigned int max_cnt) {
          follows the loop is not traced. We do that by pivoting back to the
          dummy output region. */
 
-      __afl_area_ptr = __afl_area_initial;
+      __afl_area_ptr = area_dummy;
 
     }
 
@@ -243,6 +449,9 @@ void __afl_manual_init(void) {
 
   if (!init_done) {
 
+    get_fitness_slots();
+    atexit(__afl_merge_fitness);
+
     __afl_map_shm();
     __afl_start_forkserver();
     init_done = 1;
@@ -256,6 +465,31 @@ void __afl_manual_init(void) {
 
 __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
+  if (&__aflchurn_map_size) __afl_map_size = __aflchurn_map_size;
+
+  if (__afl_map_size > MAP_SIZE) {
+
+    area_dummy = mmap(NULL, __afl_map_size + WEIGHT_SHM, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (area_dummy == MAP_FAILED) _exit(1);
+
+    __afl_area_ptr = area_dummy;
+
+  }
+
+  /* The tools ask for the map size before they set up the shared memory:
+     send the fork server hello and leave without running any further. */
+
+  if (getenv(MAP_SIZE_ENV_VAR)) {
+
+    u32 hello = FS_OPT_MAP_SIZE | __afl_map_size;
+
+    if (write(FORKSRV_FD + 1, &hello, 4) != 4) _exit(1);
+    _exit(0);
+
+  }
+
   is_persistent = !!getenv(PERSIST_ENV_VAR);
 
   if (getenv(DEFER_ENV_VAR)) return;
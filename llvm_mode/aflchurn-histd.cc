@@ -0,0 +1,496 @@
+/*
+   aflchurn - history daemon
+   -------------------------
+
+   With AFLCHURN_HISTD set, afl-clang-fast starts one aflchurn-histd per
+   repository, and the pass in every compiler process asks it for what it
+   would otherwise get from git: HEAD, its time, the time of the oldest
+   commit, the commit count, and for every source file the same per-line
+   data aflchurn-index stores (day of the last change, commits reachable
+   from it, commits that changed the line). The daemon keeps the data in
+   memory. When HEAD moves, it only drops the files whose blob in HEAD
+   changed; edits in the working tree are caught by the blob of the file.
+
+   The daemon listens on .git/aflchurn-histd.sock and exits after
+   CHURN_HISTD_IDLE seconds without requests. Line-based protocol, one
+   connection per pass instance:
+
+     HEAD <settings>\n     -> OK <sha> <head time> <init time> <count>\n
+                              or ERR <reason>\n
+     LINES\n<path>\n...\n  -> per path, -\n (not in HEAD) or <n>\n followed by
+                              n ChurnIndexLine records
+
+   <settings> are the AFLCHURN_SINCE_MONTHS and history budget of the pass,
+   which have to match those the daemon was started with.
+*/
+
+#define AFL_LLVM_PASS
+
+#include "../config.h"
+#include "../types.h"
+#include "../debug.h"
+
+#include "churn-history.h"
+#include "churn-index.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::string repo_dir,            /* Top level, with a trailing '/'    */
+                   settings;            /* What the HEAD request must match  */
+
+struct HistdHead {
+  std::string sha;
+  u64 head_time, init_time;
+  u32 count;
+};
+
+struct HistdFile {
+  std::string blob, head_blob;          /* Working tree and HEAD             */
+  std::string head;                     /* HEAD commit it was scored at      */
+  bool ok;                              /* In HEAD and blamed                */
+  std::vector<ChurnIndexLine> lines;
+};
+
+/* Everything below is guarded by state_lock. Files in 'busy' are being
+   scored by some connection; the others wait for file_done. */
+
+static std::mutex state_lock;
+static std::condition_variable file_done;
+static HistdHead head;
+static std::map<std::string, HistdFile> files;
+static std::set<std::string> busy;
+static std::map<std::string, u32> commit_counts;
+
+static std::atomic<u32> active_conns(0);
+
+
+/* Commits reachable from commit, for ranks; 0 if it is not committed yet. */
+
+static u32 get_commit_count(ChurnHistory *history, const std::string &commit) {
+
+  u32 cnt;
+
+  if (commit.find_first_not_of('0') == std::string::npos) return 0;
+
+  {
+    std::lock_guard<std::mutex> g(state_lock);
+    auto it = commit_counts.find(commit);
+    if (it != commit_counts.end()) return it->second;
+  }
+
+  cnt = history->commit_count(commit);
+
+  std::lock_guard<std::mutex> g(state_lock);
+  commit_counts[commit] = cnt;
+  return cnt;
+
+}
+
+
+/* Catch up with HEAD: new times and count, and forget the files whose blob
+   in HEAD is not the one they were scored at; the others now hold for the
+   new HEAD too. Called with state_lock held. */
+
+static void update_head(ChurnHistory *history) {
+
+  std::string sha = history->head_commit();
+  u32 dropped = 0;
+
+  if (sha.empty() || sha == head.sha) return;
+
+  head.sha       = sha;
+  head.head_time = history->head_time();
+  head.init_time = history->init_time();
+  head.count     = history->commit_count("HEAD");
+
+  for (auto it = files.begin(); it != files.end(); ) {
+    if (history->head_blob(it->first) != it->second.head_blob) {
+      it = files.erase(it);
+      dropped++;
+    } else {
+      it->second.head = sha;
+      ++it;
+    }
+  }
+
+  if (dropped || !files.empty())
+    OKF("HEAD is %.12s, dropped %u of %u files.", sha.c_str(), dropped,
+        (u32)files.size() + dropped);
+
+}
+
+
+/* Blame each file for ages and ranks, then the churn of all of them at once,
+   as aflchurn-index does. */
+
+static void score_files(ChurnHistory *history, const std::vector<std::string> &paths,
+                        std::map<std::string, HistdFile> &out) {
+
+  std::map<std::string, std::map<unsigned int, unsigned int>> changes;
+  std::vector<std::string> scored;
+  ChurnBudget budget;
+  bool budgeted = get_churn_budget(budget);
+
+  for (auto &path : paths) {
+
+    std::map<unsigned int, ChurnBlame> blamed_lines;
+    HistdFile &f = out[path];
+
+    f.blob      = get_churn_blob_id(repo_dir + path);
+    f.head_blob = history->head_blob(path);
+    f.ok        = false;
+
+    if (f.blob.empty() || f.head_blob.empty() ||
+        !history->blame(path, blamed_lines, budgeted ? &budget : NULL)) continue;
+
+    for (auto &bl : blamed_lines) {
+
+      ChurnIndexLine l;
+
+      l.day     = bl.second.time / 86400;
+      l.count   = get_commit_count(history, bl.second.commit);
+      l.changes = 0;
+
+      if (f.lines.size() < bl.first) f.lines.resize(bl.first);
+      f.lines[bl.first - 1] = l;
+
+    }
+
+    f.ok = true;
+    scored.push_back(path);
+
+  }
+
+  if (scored.empty() ||
+      !history->churn(scored, get_churn_since_time(), changes, budgeted ? &budget : NULL))
+    return;
+
+  for (auto &fc : changes) {
+
+    std::vector<ChurnIndexLine> &lines = out[fc.first].lines;
+
+    for (auto &lc : fc.second) {
+      if (lines.size() < lc.first) {
+        ChurnIndexLine none = { 0, 0, 0 };
+        lines.resize(lc.first, none);
+      }
+      lines[lc.first - 1].changes = lc.second;
+    }
+
+  }
+
+}
+
+
+static bool send_all(int fd, const void *buf, size_t len) {
+
+  const u8 *p = (const u8 *)buf;
+
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+
+  return true;
+
+}
+
+
+/* Answer a LINES request: files that nobody has scored for their current
+   blob and HEAD are scored here, with a history opened for this request so
+   that it sees the current HEAD. If HEAD moves while they are scored, the
+   scores are thrown away and the request starts over. */
+
+static bool serve_lines(int fd, const std::vector<std::string> &paths) {
+
+  std::vector<std::string> blobs;
+  std::string reply;
+
+  for (auto &path : paths) blobs.push_back(get_churn_blob_id(repo_dir + path));
+
+  while (1) {
+
+    std::vector<std::string> mine;
+    std::map<std::string, HistdFile> scored;
+    std::string at;
+    ChurnHistory *history = open_churn_history(repo_dir);
+    bool stale = false;
+
+    {
+      std::lock_guard<std::mutex> g(state_lock);
+
+      update_head(history);
+      at = head.sha;
+
+      for (u32 i = 0; i < paths.size(); i++) {
+        auto it = files.find(paths[i]);
+        if (it != files.end() && it->second.blob == blobs[i] &&
+            it->second.head == at) continue;
+        if (busy.count(paths[i])) continue;
+        busy.insert(paths[i]);
+        mine.push_back(paths[i]);
+      }
+    }
+
+    if (!mine.empty()) score_files(history, mine, scored);
+    delete history;
+
+    std::unique_lock<std::mutex> l(state_lock);
+
+    for (auto &path : mine) {
+      if (at == head.sha) {
+        files[path] = scored[path];
+        files[path].head = at;
+      }
+      busy.erase(path);
+    }
+    if (!mine.empty()) file_done.notify_all();
+
+    file_done.wait(l, [&]() {
+      for (auto &path : paths) if (busy.count(path)) return false;
+      return true;
+    });
+
+    /* Whoever scored them may have done so at a HEAD that is gone. */
+
+    for (auto &path : paths) {
+      auto it = files.find(path);
+      if (it == files.end() || it->second.head != head.sha) stale = true;
+    }
+
+    if (stale) continue;
+
+    for (auto &path : paths) {
+
+      HistdFile &f = files[path];
+
+      if (!f.ok) {
+        reply += "-\n";
+        continue;
+      }
+
+      reply += std::to_string(f.lines.size()) + "\n";
+      reply.append((const char *)f.lines.data(), f.lines.size() * sizeof(ChurnIndexLine));
+
+    }
+
+    break;
+
+  }
+
+  return send_all(fd, reply.data(), reply.length());
+
+}
+
+
+/* One pass instance; requests until it hangs up. */
+
+static void serve(int fd) {
+
+  FILE *in = fdopen(fd, "r");
+  char *buf = NULL;
+  size_t buf_len = 0;
+  ssize_t len;
+
+  while ((len = getline(&buf, &buf_len, in)) > 0) {
+
+    std::string req(buf, len - (buf[len - 1] == '\n'));
+
+    if (!req.compare(0, 5, "HEAD ")) {
+
+      std::string reply;
+
+      if (req.substr(5) != settings) {
+        reply = "ERR daemon started with " + settings + "\n";
+      } else {
+        ChurnHistory *history = open_churn_history(repo_dir);
+        std::lock_guard<std::mutex> g(state_lock);
+        update_head(history);
+        delete history;
+        if (head.sha.empty()) reply = "ERR no HEAD\n";
+        else reply = "OK " + head.sha + " " + std::to_string(head.head_time) + " " +
+                     std::to_string(head.init_time) + " " +
+                     std::to_string(head.count) + "\n";
+      }
+
+      if (!send_all(fd, reply.data(), reply.length())) break;
+
+    } else if (req == "LINES") {
+
+      std::vector<std::string> paths;
+
+      while ((len = getline(&buf, &buf_len, in)) > 1)
+        paths.push_back(std::string(buf, len - (buf[len - 1] == '\n')));
+
+      if (!serve_lines(fd, paths)) break;
+
+    } else break;
+
+  }
+
+  free(buf);
+  fclose(in);
+  active_conns--;
+
+}
+
+
+/* Display usage hints. */
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ]\n\n"
+
+       "Serves the history of a repository to the compiler processes of a build\n"
+       "(AFLCHURN_HISTD). afl-clang-fast starts it on first use.\n\n"
+
+       "  -C dir        - repository to serve (current directory)\n"
+       "  -t secs       - exit after this long without requests (%u)\n\n"
+
+       "AFLCHURN_SINCE_MONTHS, the history budget and AFLCHURN_GIT_BACKEND apply\n"
+       "as for the pass.\n\n",
+
+       argv0, CHURN_HISTD_IDLE);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt, listen_fd, lock_fd;
+  u32 idle_secs = CHURN_HISTD_IDLE;
+  std::string base_dir = ".", sock_path;
+  struct sockaddr_un addr;
+  char *top;
+  FILE *fp;
+
+  while ((opt = getopt(argc, argv, "+C:t:")) > 0)
+
+    switch (opt) {
+
+      case 'C':
+
+        base_dir = optarg;
+        break;
+
+      case 't':
+
+        if (sscanf(optarg, "%u", &idle_secs) != 1 || !idle_secs)
+          FATAL("Bad value of -t");
+        break;
+
+      default:
+
+        usage((u8*)argv[0]);
+
+    }
+
+  // git rev-parse --show-toplevel: show the root folder of a repository
+  fp = popen(("cd '" + base_dir + "' && git rev-parse --show-toplevel 2>/dev/null").c_str(), "r");
+  if (!fp) PFATAL("popen() failed");
+
+  top = NULL;
+  {
+    size_t top_len = 0;
+    ssize_t len = getline(&top, &top_len, fp);
+    if (pclose(fp) || len <= 1) FATAL("'%s' is not in a git repository", base_dir.c_str());
+    top[len - 1] = 0;
+  }
+
+  repo_dir = std::string(top) + "/";
+  free(top);
+
+  sock_path = repo_dir + ".git/" CHURN_HISTD_SOCKET;
+  settings = get_churn_settings();
+
+  {
+    struct stat st;
+    if (stat((repo_dir + ".git").c_str(), &st) || !S_ISDIR(st.st_mode))
+      FATAL("%s.git is not a directory (worktrees are not supported)", repo_dir.c_str());
+  }
+
+  if (sock_path.length() >= sizeof(addr.sun_path))
+    FATAL("Socket path '%s' is too long", sock_path.c_str());
+
+  /* One daemon per repository: whoever holds the lock owns the socket. */
+
+  lock_fd = open((sock_path + ".lock").c_str(), O_RDWR | O_CREAT, 0600);
+  if (lock_fd < 0) PFATAL("Unable to create '%s.lock'", sock_path.c_str());
+  if (flock(lock_fd, LOCK_EX | LOCK_NB)) return 0;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock_path.c_str());
+
+  unlink(sock_path.c_str());
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) PFATAL("socket() failed");
+
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listen_fd, 64))
+    PFATAL("Unable to listen on '%s'", sock_path.c_str());
+
+  signal(SIGPIPE, SIG_IGN);
+
+  OKF("Serving %s on %s.", repo_dir.c_str(), sock_path.c_str());
+
+  while (1) {
+
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    s32 ret = poll(&pfd, 1, idle_secs * 1000);
+
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      PFATAL("poll() failed");
+    }
+
+    if (!ret) {
+      if (active_conns) continue;
+      break;
+    }
+
+    s32 fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+
+    active_conns++;
+    std::thread(serve, fd).detach();
+
+  }
+
+  /* Unlink while still holding the lock, so that a new daemon never loses
+     its socket to an old one. */
+
+  unlink(sock_path.c_str());
+  close(listen_fd);
+  close(lock_fd);
+
+  OKF("No requests for %u seconds, exiting.", idle_secs);
+  return 0;
+
+}
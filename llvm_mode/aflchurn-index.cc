@@ -0,0 +1,482 @@
+/*
+   aflchurn - line-score index builder
+   -----------------------------------
+
+   Walks the history of a git repository once and writes the age, rank and
+   churn data of every line of its C/C++ sources to an index file (see
+   churn-index.h). Building with AFLCHURN_INDEX pointing to that file makes
+   afl-llvm-pass.so read the scores from it instead of running git, so the
+   build only needs the source tree and the index, not .git.
+*/
+
+#define AFL_LLVM_PASS
+
+#include "../config.h"
+#include "../types.h"
+#include "../debug.h"
+
+#include "churn-history.h"
+#include "churn-index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+static std::string repo_dir;            /* Top level, with a trailing '/'    */
+static u8 all_files,                    /* Index every tracked file (-a)     */
+          update_mode;                  /* Replay new commits only (-u)      */
+
+static std::map<std::string, u32> commit_counts;
+
+struct IndexedFile {
+  std::string blob, head_blob;
+  std::vector<ChurnIndexLine> lines;
+};
+
+
+/* Run a shell command in dir; one string per line of its output. */
+
+static bool run_lines(std::string dir, std::string cmd, std::vector<std::string> &out) {
+
+  std::string full = "cd '" + dir + "' && " + cmd;
+  char *buf = NULL;
+  size_t buf_len = 0;
+  ssize_t len;
+  FILE *fp = popen(full.c_str(), "r");
+
+  if (!fp) return false;
+
+  while ((len = getline(&buf, &buf_len, fp)) > 0) {
+    if (buf[len - 1] == '\n') buf[len - 1] = 0;
+    out.push_back(buf);
+  }
+
+  free(buf);
+  return !pclose(fp);
+
+}
+
+
+/* Commits reachable from commit, for ranks; 0 if it is not committed yet. */
+
+static u32 get_commit_count(ChurnHistory *history, const std::string &commit) {
+
+  if (commit.find_first_not_of('0') == std::string::npos) return 0;
+
+  if (!commit_counts.count(commit))
+    commit_counts[commit] = history->commit_count(commit);
+
+  return commit_counts[commit];
+
+}
+
+
+/* Only C and C++ sources and headers are instrumented. */
+
+static bool is_source_file(const std::string &path) {
+
+  static const char *exts[] = { ".c", ".cc", ".cpp", ".cxx", ".c++", ".C",
+                                ".h", ".hh", ".hpp", ".hxx", ".h++", ".H",
+                                ".inc", ".def", ".ipp", ".tcc", ".inl", NULL };
+  size_t dot = path.rfind('.');
+
+  if (all_files) return true;
+  if (dot == std::string::npos) return false;
+
+  for (u32 i = 0; exts[i]; i++)
+    if (!path.compare(dot, std::string::npos, exts[i])) return true;
+
+  return false;
+
+}
+
+
+/* Age and rank of each line from blame, then the churn of all files at once. */
+
+static void index_files(ChurnHistory *history, std::vector<std::string> &paths,
+                        std::map<std::string, IndexedFile> &out) {
+
+  std::map<std::string, std::map<unsigned int, unsigned int>> changes;
+  std::vector<std::string> indexed;
+  u32 done = 0;
+
+  for (auto &path : paths) {
+
+    std::map<unsigned int, ChurnBlame> blamed_lines;
+    IndexedFile f;
+
+    f.blob      = history->blob_id(path);
+    f.head_blob = history->head_blob(path);
+
+    /* Untracked in HEAD or gone from the working tree: the pass skips these. */
+    if (f.blob.empty() || f.head_blob.empty()) continue;
+
+    if (!history->blame(path, blamed_lines)) {
+      WARNF("Unable to blame '%s', skipping.", path.c_str());
+      continue;
+    }
+
+    for (auto &bl : blamed_lines) {
+
+      ChurnIndexLine l;
+
+      l.day     = bl.second.time / 86400;
+      l.count   = get_commit_count(history, bl.second.commit);
+      l.changes = 0;
+
+      if (f.lines.size() < bl.first) f.lines.resize(bl.first);
+      f.lines[bl.first - 1] = l;
+
+    }
+
+    out[path] = f;
+    indexed.push_back(path);
+
+    if (!(++done % 100))
+      ACTF("Blamed %u/%u files...", done, (u32)paths.size());
+
+  }
+
+  ACTF("Walking the history of %u files...", (u32)indexed.size());
+
+  if (!history->churn(indexed, get_churn_since_time(), changes))
+    WARNF("Unable to compute the churn, indexing ages only.");
+
+  for (auto &fc : changes) {
+
+    std::vector<ChurnIndexLine> &lines = out[fc.first].lines;
+
+    for (auto &lc : fc.second) {
+      if (lines.size() < lc.first) {
+        ChurnIndexLine none = { 0, 0, 0 };
+        lines.resize(lc.first, none);
+      }
+      lines[lc.first - 1].changes = lc.second;
+    }
+
+  }
+
+}
+
+
+/* Number of lines of a working tree file, as git blame counts them. */
+
+static u32 count_file_lines(const std::string &path) {
+
+  FILE *fp = fopen((repo_dir + path).c_str(), "r");
+  u32 lines = 0;
+  s32 c, last = '\n';
+
+  if (!fp) return 0;
+
+  while ((c = getc(fp)) != EOF) {
+    if (c == '\n') lines++;
+    last = c;
+  }
+
+  fclose(fp);
+  return lines + (last != '\n');
+
+}
+
+
+/* Carry the entries of the old index over to HEAD by replaying the commits
+   made since it was written: lines keep their age and rank unless a new
+   commit changed them, and get the new changes on top of the old ones.
+   Files that cannot be carried over stay in paths, for index_files(). */
+
+static void update_files(ChurnHistory *history, const ChurnIndex &idx,
+                         std::vector<std::string> &paths,
+                         std::map<std::string, IndexedFile> &out) {
+
+  std::string old_head(idx.hdr->head, sizeof(idx.hdr->head));
+  std::vector<std::string> replay_paths, full_paths;
+  std::map<std::string, IndexedFile> found;
+  std::map<std::string, ChurnReplay> replayed;
+
+  if (idx.hdr->since_time || get_churn_since_time()) {
+    WARNF("AFLCHURN_SINCE_MONTHS moves with time, re-indexing everything.");
+    return;
+  }
+
+  /* Only files that were clean when indexed and are clean now: the index
+     holds their lines at the old HEAD, and the replay yields HEAD lines. */
+
+  for (auto &path : paths) {
+
+    const ChurnIndexFile *o = find_churn_index_file(idx, path);
+    IndexedFile f;
+
+    f.blob      = history->blob_id(path);
+    f.head_blob = history->head_blob(path);
+
+    if (f.blob.empty() || f.head_blob.empty() || f.blob != f.head_blob ||
+        (o && memcmp(o->blob, o->head_blob, sizeof(o->blob)))) {
+      full_paths.push_back(path);
+      continue;
+    }
+
+    found[path] = f;
+    replay_paths.push_back(path);
+
+  }
+
+  if (!replay_paths.empty() && !history->replay(replay_paths, old_head, replayed)) {
+    WARNF("Indexed HEAD %.12s is not an ancestor of HEAD, re-indexing everything.",
+          old_head.c_str());
+    return;
+  }
+
+  for (auto &path : replay_paths) {
+
+    const ChurnIndexFile *o = find_churn_index_file(idx, path);
+    auto r = replayed.find(path);
+    IndexedFile &f = found[path];
+    ChurnIndexLine none = { 0, 0, 0 };
+
+    /* Lines that lead to another version, or a file that is new to the
+       index but not to the history. */
+
+    if (r == replayed.end() || (!o && !r->second.base.empty())) {
+      full_paths.push_back(path);
+      continue;
+    }
+
+    f.lines.assign(count_file_lines(path), none);
+
+    for (auto &seg : r->second.base) {
+
+      u32 end = MIN(seg.end, o->line_cnt + 1);
+
+      for (u32 b = seg.start; b < end; b++) {
+
+        u32 h = seg.collapsed ? seg.head : seg.head + (b - seg.start);
+        const ChurnIndexLine &ol = idx.lines[o->line_idx + b - 1];
+
+        if (!h || h > f.lines.size()) continue;
+
+        ChurnIndexLine &l = f.lines[h - 1];
+
+        if (ol.day > l.day) {
+          l.day   = ol.day;
+          l.count = ol.count;
+        }
+        l.changes = MAX(l.changes, ol.changes);
+
+      }
+
+    }
+
+    for (auto &lb : r->second.last) {
+      if (!lb.first || lb.first > f.lines.size()) continue;
+      f.lines[lb.first - 1].day   = lb.second.time / 86400;
+      f.lines[lb.first - 1].count = get_commit_count(history, lb.second.commit);
+    }
+
+    for (auto &lc : r->second.changes)
+      if (lc.first && lc.first <= f.lines.size())
+        f.lines[lc.first - 1].changes += lc.second;
+
+    out[path] = f;
+
+  }
+
+  OKF("Replayed the history since %.12s for %u files.", old_head.c_str(),
+      (u32)(paths.size() - full_paths.size()));
+
+  paths.swap(full_paths);
+
+}
+
+
+/* Header, file table, lines and paths, written next to out_file and renamed
+   into place so that concurrent builds never map a partial index. */
+
+static void write_index(std::string out_file, ChurnHistory *history,
+                        std::map<std::string, IndexedFile> &files) {
+
+  ChurnIndexHeader hdr;
+  std::vector<ChurnIndexFile> table;
+  std::string strings, head = history->head_commit();
+  u64 line_total = 0;
+  std::string tmp_file = out_file + ".tmp";
+  FILE *fp;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CHURN_INDEX_MAGIC, 8);
+  hdr.version    = CHURN_INDEX_VERSION;
+  hdr.file_cnt   = files.size();
+  hdr.head_time  = history->head_time();
+  hdr.init_time  = history->init_time();
+  hdr.since_time = get_churn_since_time();
+  hdr.head_count = history->commit_count("HEAD");
+  memcpy(hdr.head, head.c_str(), MIN(head.length(), sizeof(hdr.head)));
+
+  for (auto &f : files) {
+
+    ChurnIndexFile e;
+
+    memset(&e, 0, sizeof(e));
+    e.line_idx = line_total;
+    e.line_cnt = f.second.lines.size();
+    e.path_ofs = strings.length();
+    e.path_len = f.first.length();
+    memcpy(e.blob, f.second.blob.c_str(), MIN(f.second.blob.length(), sizeof(e.blob)));
+    memcpy(e.head_blob, f.second.head_blob.c_str(),
+           MIN(f.second.head_blob.length(), sizeof(e.head_blob)));
+
+    strings += f.first;
+    line_total += e.line_cnt;
+    table.push_back(e);
+
+  }
+
+  hdr.lines_ofs   = sizeof(hdr) + table.size() * sizeof(ChurnIndexFile);
+  hdr.strings_ofs = hdr.lines_ofs + line_total * sizeof(ChurnIndexLine);
+
+  fp = fopen(tmp_file.c_str(), "w");
+  if (!fp) PFATAL("Unable to create '%s'", tmp_file.c_str());
+
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(table.data(), sizeof(ChurnIndexFile), table.size(), fp);
+  for (auto &f : files)
+    fwrite(f.second.lines.data(), sizeof(ChurnIndexLine), f.second.lines.size(), fp);
+  fwrite(strings.data(), 1, strings.length(), fp);
+
+  if (ferror(fp) | fclose(fp)) PFATAL("Unable to write '%s'", tmp_file.c_str());
+
+  if (rename(tmp_file.c_str(), out_file.c_str()))
+    PFATAL("Unable to rename '%s'", tmp_file.c_str());
+
+  OKF("Indexed %u files, %llu lines, HEAD %.12s.", hdr.file_cnt,
+      (unsigned long long)line_total, hdr.head);
+
+}
+
+
+/* Display usage hints. */
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] [ file ... ]\n\n"
+
+       "Writes the age, rank and churn of every line of the given files (default:\n"
+       "all tracked C/C++ sources) for afl-clang-fast to use via AFLCHURN_INDEX.\n\n"
+
+       "  -o file       - output file (<repository>/" CHURN_INDEX_FILE ")\n"
+       "  -C dir        - repository to index (current directory)\n"
+       "  -a            - index all tracked files, not just C/C++ sources\n"
+       "  -u            - update the output file, replaying only new commits\n\n"
+
+       "AFLCHURN_SINCE_MONTHS and AFLCHURN_GIT_BACKEND apply as for the pass.\n\n",
+
+       argv0);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt;
+  std::string out_file, base_dir = ".";
+  std::vector<std::string> top, paths;
+  ChurnHistory *history;
+  ChurnIndex old_index = { NULL, 0, NULL, NULL, NULL, NULL };
+  bool have_old = false;
+  std::map<std::string, IndexedFile> files;
+
+  SAYF(cCYA "aflchurn-index " cBRI VERSION cRST " by <aflchurn>\n");
+
+  while ((opt = getopt(argc, argv, "+o:C:au")) > 0)
+
+    switch (opt) {
+
+      case 'o':
+
+        if (!out_file.empty()) FATAL("Multiple -o options not supported");
+        out_file = optarg;
+        break;
+
+      case 'C':
+
+        base_dir = optarg;
+        break;
+
+      case 'a':
+
+        all_files = 1;
+        break;
+
+      case 'u':
+
+        update_mode = 1;
+        break;
+
+      default:
+
+        usage((u8*)argv[0]);
+
+    }
+
+  // git rev-parse --show-toplevel: show the root folder of a repository
+  if (!run_lines(base_dir, "git rev-parse --show-toplevel 2>/dev/null", top) || top.empty())
+    FATAL("'%s' is not in a git repository", base_dir.c_str());
+
+  repo_dir = top[0] + "/";
+  if (out_file.empty()) out_file = repo_dir + CHURN_INDEX_FILE;
+
+  history = open_churn_history(repo_dir);
+
+  if (history->commit_count("HEAD") <= 1)
+    FATAL("Shallow repository clone, there is no history to index");
+
+  if (optind < argc) {
+
+    /* Paths on the command line are relative to the current directory. */
+
+    for (s32 i = optind; i < argc; i++) {
+      char *real = realpath(argv[i], NULL);
+      if (!real || strncmp(real, repo_dir.c_str(), repo_dir.length()))
+        FATAL("'%s' is not a file in %s", argv[i], repo_dir.c_str());
+      paths.push_back(real + repo_dir.length());
+      free(real);
+    }
+
+  } else {
+
+    std::vector<std::string> tracked;
+
+    if (!run_lines(repo_dir, "git -c core.quotepath=off ls-files", tracked))
+      FATAL("Unable to list the files of %s", repo_dir.c_str());
+
+    for (auto &t : tracked)
+      if (is_source_file(t)) paths.push_back(t);
+
+  }
+
+  ACTF("Indexing %u files of %s...", (u32)paths.size(), repo_dir.c_str());
+
+  if (update_mode) {
+    have_old = open_churn_index(out_file.c_str(), old_index);
+    if (have_old) update_files(history, old_index, paths, files);
+    else WARNF("No usable index in '%s', indexing everything.", out_file.c_str());
+  }
+
+  if (!paths.empty()) index_files(history, paths, files);
+  write_index(out_file, history, files);
+
+  if (have_old) munmap((void *)old_index.data, old_index.len);
+
+  delete history;
+  return 0;
+
+}
@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+#
+# aflchurn - block records of a binary
+# ------------------------------------
+#
+# Builds made with AFLCHURN_METADATA=1 carry, in the aflchurn_meta section,
+# the ID, source line and churn scores of every instrumented block (see
+# CHURN_META_SECTION in config.h). This script lists them, and with a map from
+# afl-showmap, tells which blocks a test case reached and how much of the
+# changed code is covered, file by file.
+#
+#   aflchurn-meta.py [ -m map ] [ -w ] [ -s ] binary
+#
+# Builds made with AFLCHURN_DICT=1 carry the comparison constants and strings
+# of their weighted blocks in the aflchurn_dict section instead (see
+# CHURN_DICT_SECTION); with -x, they are written as a dictionary for
+# afl-fuzz -x, heaviest first, and only the -n heaviest of them.
+#
+#   aflchurn-meta.py -x dict [ -n tokens ] binary
+#
+# Map indices are block IDs in LTO builds only; per-module builds hash two IDs
+# into an index, so their blocks are listed without hit counts.
+#
+
+import argparse
+import struct
+import sys
+from collections import defaultdict
+
+META_SECTION = b"aflchurn_meta"
+META_MAGIC = 0x4d484341
+META_LTO = 1
+DICT_SECTION = b"aflchurn_dict"
+DICT_MAGIC = 0x44484341
+MAX_DET_EXTRAS = 200
+
+
+def elf_section(path, name):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:4] != b"\x7fELF":
+        sys.exit("%s: not an ELF file" % path)
+
+    bo = "<" if data[5] == 1 else ">"
+    if data[4] == 2:
+        shoff, = struct.unpack_from(bo + "Q", data, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from(bo + "HHH", data, 0x3a)
+        shdr = bo + "IIQQQQIIQQ"
+    else:
+        shoff, = struct.unpack_from(bo + "I", data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from(bo + "HHH", data, 0x2e)
+        shdr = bo + "IIIIIIIIII"
+
+    def section(i):
+        s = struct.unpack_from(shdr, data, shoff + i * shentsize)
+        return s[0], s[4], s[5]  # name, offset, size
+
+    _, str_off, _ = section(shstrndx)
+    for i in range(shnum):
+        sh_name, off, size = section(i)
+        end = data.index(b"\0", str_off + sh_name)
+        if data[str_off + sh_name:end] == name:
+            return bo, data[off:off + size]
+
+    return bo, None
+
+
+def read_blocks(path):
+    bo, sec = elf_section(path, META_SECTION)
+    if sec is None:
+        sys.exit("%s: no %s section (build with AFLCHURN_METADATA=1)"
+                 % (path, META_SECTION.decode()))
+
+    blocks = []
+    pos = 0
+    while pos + 20 <= len(sec):
+        magic, size, flags, nblocks, nfiles = struct.unpack_from(bo + "5I", sec, pos)
+        if magic != META_MAGIC:
+            pos += 4  # padding between chunks
+            continue
+
+        paths = sec[pos + 20 + nblocks * 24:pos + size].split(b"\0")[:nfiles]
+        paths = [p.decode(errors="replace") for p in paths]
+
+        for i in range(nblocks):
+            bid, fid, line, age, churn, fitness = struct.unpack_from(
+                bo + "3I3f", sec, pos + 20 + i * 24)
+            blocks.append({"id": bid, "lto": bool(flags & META_LTO),
+                           "file": paths[fid] if fid < len(paths) else "?",
+                           "line": line, "age": age, "churn": churn,
+                           "fitness": fitness})
+        pos += size
+
+    return blocks
+
+
+def read_tokens(path):
+    bo, sec = elf_section(path, DICT_SECTION)
+    if sec is None:
+        sys.exit("%s: no %s section (build with AFLCHURN_DICT=1)"
+                 % (path, DICT_SECTION.decode()))
+
+    tokens = {}
+    pos = 0
+    while pos + 12 <= len(sec):
+        magic, size, ntokens = struct.unpack_from(bo + "3I", sec, pos)
+        if magic != DICT_MAGIC:
+            pos += 4  # padding between chunks
+            continue
+
+        rec = pos + 12
+        for i in range(ntokens):
+            weight, length = struct.unpack_from(bo + "fI", sec, rec)
+            token = sec[rec + 8:rec + 8 + length]
+            tokens[token] = max(weight, tokens.get(token, 0))
+            rec += 8 + ((length + 3) & ~3)
+        pos += size
+
+    return tokens
+
+
+def write_dict(path, tokens, count):
+    heaviest = sorted(tokens.items(), key=lambda t: (-t[1], t[0]))[:count]
+    with open(path, "w") as f:
+        for i, (token, weight) in enumerate(heaviest):
+            value = "".join(chr(c) if 0x20 <= c < 0x7f and c not in b'"\\'
+                            else "\\x%02x" % c for c in token)
+            f.write('# weight %.4f\nchurn_%u="%s"\n' % (weight, i, value))
+
+
+def read_map(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    # afl-showmap writes "index:count" lines, or the raw map with -b
+    try:
+        hits = {}
+        for line in data.decode().split():
+            idx, cnt = line.split(":")
+            hits[int(idx)] = int(cnt)
+        return hits
+    except ValueError:
+        return dict((i, c) for i, c in enumerate(data) if c)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="List AFLCHURN_METADATA block records.")
+    parser.add_argument("-m", metavar="map", help="afl-showmap output of a test case")
+    parser.add_argument("-w", action="store_true", help="only blocks with a fitness")
+    parser.add_argument("-s", action="store_true", help="summary per source file")
+    parser.add_argument("-x", metavar="dict", help="write the AFLCHURN_DICT tokens to this file")
+    parser.add_argument("-n", metavar="tokens", type=int, default=MAX_DET_EXTRAS,
+                        help="with -x, the number of tokens (default: %(default)s)")
+    parser.add_argument("binary", help="program or object file built with AFLCHURN_METADATA")
+    args = parser.parse_args()
+
+    if args.x:
+        tokens = read_tokens(args.binary)
+        write_dict(args.x, tokens, args.n)
+        sys.stderr.write("Wrote %u of %u tokens to %s.\n"
+                         % (min(args.n, len(tokens)), len(tokens), args.x))
+        return
+
+    blocks = read_blocks(args.binary)
+    if args.w:
+        blocks = [b for b in blocks if b["fitness"] > 0]
+
+    hits = read_map(args.m) if args.m else None
+    if hits is not None and not all(b["lto"] for b in blocks):
+        sys.stderr.write("Blocks of per-module builds have no hit counts.\n")
+
+    def hit(b):
+        return hits.get(b["id"], 0) if hits is not None and b["lto"] else None
+
+    if not args.s:
+        for b in sorted(blocks, key=lambda b: (b["file"], b["line"], b["id"])):
+            h = hit(b)
+            print("%6u  %s:%u  age %.4f  churn %.4f  fitness %.4f%s" % (
+                  b["id"], b["file"], b["line"], b["age"], b["churn"], b["fitness"],
+                  "" if h is None else "  hits %u" % h))
+        return
+
+    files = defaultdict(lambda: [0, 0, 0, 0, 0.0, 0.0])
+    for b in blocks:
+        f = files[b["file"]]
+        weighted = b["fitness"] > 0
+        f[0] += 1
+        f[1] += weighted
+        f[4] += b["fitness"]
+        if hit(b):
+            f[2] += 1
+            f[3] += weighted
+            f[5] += b["fitness"]
+
+    print("%8s %8s %10s %8s %8s %10s  %s" % ("blocks", "weighted", "fitness",
+                                             "hit", "hit w.", "hit fit.", "file"))
+    for name, (n, w, h, hw, fit, hfit) in sorted(files.items(), key=lambda f: -f[1][4]):
+        if hits is None:
+            h = hw = hfit = "-"
+        else:
+            hfit = "%.3f" % hfit
+        print("%8u %8u %10.3f %8s %8s %10s  %s" % (n, w, fit, h, hw, hfit, name))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# aflchurn - summary of instrumentation profiles
+# ----------------------------------------------
+#
+# Builds made with AFLCHURN_PROFILE=<file> leave one JSON record per compiled
+# module in <file>. This script sums them up: where the time of the pass went,
+# which history queries and files were the most expensive, and how much was
+# instrumented.
+#
+#   aflchurn-profile.py [ -n count ] profile.jsonl [ ... ]
+#
+
+import argparse
+import json
+import sys
+from collections import defaultdict
+
+
+def ms(usecs):
+    return "%.1f ms" % (usecs / 1000.0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Summarize AFLCHURN_PROFILE records.")
+    parser.add_argument("-n", type=int, default=10, metavar="count",
+                        help="entries in the top lists (default: 10)")
+    parser.add_argument("profiles", nargs="+", help="files written via AFLCHURN_PROFILE")
+    args = parser.parse_args()
+
+    modules = []
+    for path in args.profiles:
+        with open(path) as f:
+            for num, line in enumerate(f, 1):
+                line = line.strip()
+                if not line:
+                    continue
+                try:
+                    modules.append(json.loads(line))
+                except ValueError:
+                    sys.stderr.write("%s:%d: skipping a malformed record\n" % (path, num))
+
+    if not modules:
+        sys.exit("No records found.")
+
+    phases = defaultdict(int)
+    queries = defaultdict(lambda: [0, 0])
+    files = defaultdict(int)
+    bbs = defaultdict(int)
+    file_usecs = defaultdict(lambda: [0, 0])
+    unexist = defaultdict(int)
+    modes = defaultdict(int)
+    subprocesses = 0
+
+    for m in modules:
+        modes[m.get("mode", "?")] += 1
+        subprocesses += m.get("subprocesses", 0)
+        for k, v in m.get("usecs", {}).items():
+            phases[k] += v
+        for k, v in m.get("queries", {}).items():
+            queries[k][0] += v.get("calls", 0)
+            queries[k][1] += v.get("usecs", 0)
+        for k, v in m.get("files", {}).items():
+            files[k] += v
+        for k, v in m.get("bbs", {}).items():
+            bbs[k] += v
+        for k, v in m.get("file_usecs", {}).items():
+            file_usecs[k][0] += 1
+            file_usecs[k][1] += v
+        for k in m.get("unexist_files", []):
+            unexist[k] += 1
+
+    print("Modules       : %d (%s)" % (len(modules),
+          ", ".join("%s %d" % kv for kv in sorted(modes.items()))))
+    print("Pass time     : %s (discovery %s, scoring %s, instrumentation %s)" % (
+          ms(phases["total"]), ms(phases["discovery"]), ms(phases["scoring"]),
+          ms(phases["instrument"])))
+    print("Git processes : %d" % subprocesses)
+    print("Files         : %d seen, %d not in HEAD, %d from the cache, %d scored" % (
+          files["total"], files["unexist"], files["cached"], files["scored"]))
+    print("BBs           : %d instrumented, %d with age, %d with churn, %d with fitness" % (
+          bbs["instrumented"], bbs["age"], bbs["churn"], bbs["fitness"]))
+
+    if queries:
+        print("\nQueries by time:")
+        for name, (calls, usecs) in sorted(queries.items(), key=lambda q: -q[1][1]):
+            print("  %-14s %8d calls  %12s" % (name, calls, ms(usecs)))
+
+    if file_usecs:
+        print("\nSlowest files to score (blame for ages and ranks):")
+        for name, (count, usecs) in sorted(file_usecs.items(),
+                                           key=lambda f: -f[1][1])[:args.n]:
+            print("  %12s  %4dx  %s" % (ms(usecs), count, name))
+
+    print("\nSlowest modules:")
+    for m in sorted(modules, key=lambda m: -m.get("usecs", {}).get("total", 0))[:args.n]:
+        u = m.get("usecs", {})
+        print("  %12s  (scoring %s)  %s" % (ms(u.get("total", 0)), ms(u.get("scoring", 0)),
+                                            m.get("module", "?")))
+
+    if unexist:
+        print("\nFiles most often skipped as not in HEAD:")
+        for name, count in sorted(unexist.items(), key=lambda f: -f[1])[:args.n]:
+            print("  %4dx  %s" % (count, name))
+
+
+if __name__ == "__main__":
+    main()
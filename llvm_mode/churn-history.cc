@@ -0,0 +1,2699 @@
+/*
+   aflchurn - git history access for the LLVM pass
+   -----------------------------------------------
+
+   See churn-history.h for the interface. Two backends live here:
+
+   - PopenHistory runs one git command per query, exactly like the pass always
+     did, and is the reference for what every query means. The churn of all
+     files comes from a single pair of git log streams.
+
+   - InprocHistory reads the object database directly: loose objects, version
+     2 pack indexes (OFS/REF deltas included), loose and packed refs, shallow
+     clones and alternates. Blame passes lines from a commit to its parents
+     through -U0 diffs, as git blame does, with the same Myers algorithm git
+     uses by default; renames are not followed.
+
+   FallbackHistory puts the two together: each query goes to the in-process
+   reader first, and to git only if the reader could not answer it.
+*/
+
+#define AFL_LLVM_PASS
+
+#include "../config.h"
+#include "../types.h"
+
+#include "churn-history.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+
+
+/* Hex <-> raw SHA-1 conversion. */
+
+static std::string sha_to_hex(const std::string &raw) {
+
+  static const char hex[] = "0123456789abcdef";
+  std::string ret;
+
+  for (unsigned char c : raw) {
+    ret.push_back(hex[c >> 4]);
+    ret.push_back(hex[c & 15]);
+  }
+
+  return ret;
+
+}
+
+static bool hex_to_sha(const std::string &hex, std::string &raw) {
+
+  raw.clear();
+  if (hex.length() != 40) return false;
+
+  for (u32 i = 0; i < 40; i += 2) {
+    unsigned int byte;
+    if (!isxdigit(hex[i]) || !isxdigit(hex[i + 1]) ||
+        sscanf(hex.c_str() + i, "%2x", &byte) != 1) return false;
+    raw.push_back((char)byte);
+  }
+
+  return true;
+
+}
+
+
+/* Minimal SHA-1, used to name working tree files the way git hash-object
+   does. */
+
+static std::string sha1(const std::string &data) {
+
+  u32 h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  std::string msg = data;
+  u64 bit_len = (u64)data.length() * 8;
+  std::string out;
+
+  msg.push_back((char)0x80);
+  while (msg.length() % 64 != 56) msg.push_back(0);
+  for (s32 i = 7; i >= 0; i--) msg.push_back((char)(bit_len >> (i * 8)));
+
+  for (size_t chunk = 0; chunk < msg.length(); chunk += 64) {
+
+    u32 w[80], a, b, c, d, e;
+    const u8 *p = (const u8 *)msg.data() + chunk;
+
+    for (u32 i = 0; i < 16; i++)
+      w[i] = (p[i * 4] << 24) | (p[i * 4 + 1] << 16) | (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    for (u32 i = 16; i < 80; i++) {
+      u32 x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = (x << 1) | (x >> 31);
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+    for (u32 i = 0; i < 80; i++) {
+
+      u32 f, k, tmp;
+
+      if (i < 20)      { f = (b & c) | (~b & d);           k = 0x5A827999; }
+      else if (i < 40) { f = b ^ c ^ d;                    k = 0x6ED9EBA1; }
+      else if (i < 60) { f = (b & c) | (b & d) | (c & d);  k = 0x8F1BBCDC; }
+      else             { f = b ^ c ^ d;                    k = 0xCA62C1D6; }
+
+      tmp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+      e = d; d = c; c = (b << 30) | (b >> 2); b = a; a = tmp;
+
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+
+  }
+
+  for (u32 i = 0; i < 5; i++)
+    for (s32 j = 3; j >= 0; j--) out.push_back((char)(h[i] >> (j * 8)));
+
+  return out;
+
+}
+
+
+/* A -U0 diff hunk. As in git's "@@ -a,b +c,d @@" headers, lines are 1-based
+   and an empty side starts at the line just before the change. */
+
+struct ChurnHunk {
+  unsigned int old_start, old_count, new_start, new_count;
+};
+
+/* Split a file into lines; a missing final newline still ends a line. */
+
+static void split_lines(const std::string &data, std::vector<std::string> &lines) {
+
+  size_t start = 0, nl;
+
+  lines.clear();
+
+  while (start < data.length()) {
+    nl = data.find('\n', start);
+    if (nl == std::string::npos) nl = data.length();
+    lines.push_back(data.substr(start, nl - start));
+    start = nl + 1;
+  }
+
+}
+
+
+/* Myers' O(ND) difference algorithm in linear space ("An O(ND) Difference
+   Algorithm and Its Variations", 4b): find the middle snake of the edit graph,
+   then recurse on both halves. Changed lines are flagged in a_chg / b_chg. */
+
+static void diff_bisect(const u32 *a, s32 n, const u32 *b, s32 m,
+                        u8 *a_chg, u8 *b_chg);
+
+static void diff_lines_rec(const u32 *a, s32 n, const u32 *b, s32 m,
+                           u8 *a_chg, u8 *b_chg) {
+
+  /* Common prefix and suffix never change. */
+
+  while (n && m && a[0] == b[0]) { a++; b++; a_chg++; b_chg++; n--; m--; }
+  while (n && m && a[n - 1] == b[m - 1]) { n--; m--; }
+
+  if (!n) { memset(b_chg, 1, m); return; }
+  if (!m) { memset(a_chg, 1, n); return; }
+
+  diff_bisect(a, n, b, m, a_chg, b_chg);
+
+}
+
+static void diff_bisect(const u32 *a, s32 n, const u32 *b, s32 m,
+                        u8 *a_chg, u8 *b_chg) {
+
+  s32 max_d = (n + m + 1) / 2, v_off = max_d, v_len = 2 * max_d + 2;
+  s32 delta = n - m, k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+  bool front = (delta & 1);
+  std::vector<s32> v1(v_len, -1), v2(v_len, -1);
+
+  v1[v_off + 1] = 0;
+  v2[v_off + 1] = 0;
+
+  for (s32 d = 0; d < max_d; d++) {
+
+    /* Walk the front path one step. */
+
+    for (s32 k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+
+      s32 k1_off = v_off + k1, x1, y1;
+
+      if (k1 == -d || (k1 != d && v1[k1_off - 1] < v1[k1_off + 1]))
+        x1 = v1[k1_off + 1];
+      else
+        x1 = v1[k1_off - 1] + 1;
+
+      y1 = x1 - k1;
+      while (x1 < n && y1 < m && a[x1] == b[y1]) { x1++; y1++; }
+      v1[k1_off] = x1;
+
+      if (x1 > n) k1_end += 2;
+      else if (y1 > m) k1_start += 2;
+      else if (front) {
+        s32 k2_off = v_off + delta - k1;
+        if (k2_off >= 0 && k2_off < v_len && v2[k2_off] != -1 &&
+            x1 >= n - v2[k2_off]) {
+          diff_lines_rec(a, x1, b, y1, a_chg, b_chg);
+          diff_lines_rec(a + x1, n - x1, b + y1, m - y1, a_chg + x1, b_chg + y1);
+          return;
+        }
+      }
+
+    }
+
+    /* Walk the reverse path one step. */
+
+    for (s32 k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+
+      s32 k2_off = v_off + k2, x2, y2;
+
+      if (k2 == -d || (k2 != d && v2[k2_off - 1] < v2[k2_off + 1]))
+        x2 = v2[k2_off + 1];
+      else
+        x2 = v2[k2_off - 1] + 1;
+
+      y2 = x2 - k2;
+      while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) { x2++; y2++; }
+      v2[k2_off] = x2;
+
+      if (x2 > n) k2_end += 2;
+      else if (y2 > m) k2_start += 2;
+      else if (!front) {
+        s32 k1_off = v_off + delta - k2;
+        if (k1_off >= 0 && k1_off < v_len && v1[k1_off] != -1) {
+          s32 x1 = v1[k1_off], y1 = v_off + x1 - k1_off;
+          if (x1 >= n - x2) {
+            diff_lines_rec(a, x1, b, y1, a_chg, b_chg);
+            diff_lines_rec(a + x1, n - x1, b + y1, m - y1, a_chg + x1, b_chg + y1);
+            return;
+          }
+        }
+      }
+
+    }
+
+  }
+
+  /* Nothing in common. */
+
+  memset(a_chg, 1, n);
+  memset(b_chg, 1, m);
+
+}
+
+/* -U0 hunks turning old_data into new_data. */
+
+static void diff_contents(const std::string &old_data, const std::string &new_data,
+                          std::vector<ChurnHunk> &hunks) {
+
+  std::vector<std::string> old_lines, new_lines;
+  std::unordered_map<std::string, u32> line_ids;
+  std::vector<u32> a, b;
+  std::vector<u8> a_chg, b_chg;
+  u32 i = 0, j = 0;
+
+  hunks.clear();
+  if (old_data == new_data) return;
+
+  split_lines(old_data, old_lines);
+  split_lines(new_data, new_lines);
+
+  for (auto &l : old_lines) a.push_back(line_ids.emplace(l, line_ids.size()).first->second);
+  for (auto &l : new_lines) b.push_back(line_ids.emplace(l, line_ids.size()).first->second);
+
+  a_chg.assign(a.size() + 1, 0);
+  b_chg.assign(b.size() + 1, 0);
+
+  diff_lines_rec(a.data(), a.size(), b.data(), b.size(), a_chg.data(), b_chg.data());
+
+  while (i < a.size() || j < b.size()) {
+
+    ChurnHunk h;
+    u32 si = i, sj = j;
+
+    if (i < a.size() && j < b.size() && !a_chg[i] && !b_chg[j]) {
+      i++; j++;
+      continue;
+    }
+
+    while (i < a.size() && a_chg[i]) i++;
+    while (j < b.size() && b_chg[j]) j++;
+
+    if (i == si && j == sj) break; /* Out of sync; cannot happen. */
+
+    h.old_count = i - si;
+    h.new_count = j - sj;
+    h.old_start = h.old_count ? si + 1 : si;
+    h.new_start = h.new_count ? sj + 1 : sj;
+    hunks.push_back(h);
+
+  }
+
+}
+
+/* For each 0-based line of the new side, the 0-based old line it comes from,
+   or -1 if the hunks changed it. */
+
+static void map_new_to_old(const std::vector<ChurnHunk> &hunks, u32 new_lines,
+                           std::vector<s32> &new2old) {
+
+  u32 o = 0, n = 0;
+
+  new2old.assign(new_lines, -1);
+
+  for (auto &h : hunks) {
+
+    u32 new0 = h.new_count ? h.new_start - 1 : h.new_start;
+    u32 old0 = h.old_count ? h.old_start - 1 : h.old_start;
+
+    while (n < new0 && n < new_lines) new2old[n++] = o++;
+    o = old0 + h.old_count;
+    n += h.new_count;
+
+  }
+
+  while (n < new_lines) new2old[n++] = o++;
+
+}
+
+static u32 count_lines(const std::string &data) {
+
+  u32 cnt = 0;
+
+  for (char c : data) if (c == '\n') cnt++;
+  if (!data.empty() && data[data.length() - 1] != '\n') cnt++;
+
+  return cnt;
+
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Churn walk                                                               */
+/* ------------------------------------------------------------------------ */
+
+/* Both backends answer ChurnHistory::churn() with the same engine. They lay
+   out the (simplified) history of the paths as a list of commits, children
+   before parents, and hand out the -U0 hunks of each commit against each of
+   its parents on request. The engine starts from the HEAD version of every
+   path and, walking the list once, carries down which HEAD line each line of
+   an older version ended up as:
+
+   - lines outside the hunks move by the hunk offsets;
+
+   - the i-th removed line of a hunk becomes the i-th added line (surplus
+     removed lines become the last added line), so a line keeps its history
+     across edits and the old versions of a rewritten block count for it;
+
+   - lines removed by pure deletions are dropped.
+
+   A non-merge commit adds one change to every HEAD line its added lines map
+   to. Merges only pass lines on to their parents. Nothing here depends on
+   the number of commits that touch a path, and no commit is visited twice.
+
+   For ChurnHistory::replay(), the commits reachable from the base are
+   boundary nodes: the walk stops there, and the lines that arrive at one of
+   them are where the lines of the base version went, provided the boundary
+   commit has that version of the path. */
+
+#define CHURN_NO_NODE  0xffffffffU
+#define CHURN_INF      0xffffffffU
+
+struct ChurnNode {
+  std::vector<u32> parents;   /* One per diff; CHURN_NO_NODE if not walked  */
+  bool counted;               /* Inside the AFLCHURN_SINCE_MONTHS window    */
+  bool boundary;              /* Reachable from the replay base             */
+};
+
+/* Edge hunks for (node, parent slot, path). Returns -1 on error, 0 if the
+   parent does not have the path (the hunks then add the whole file), 1
+   otherwise. */
+
+typedef std::function<s32(u32, u32, u32, std::vector<ChurnHunk> &)> ChurnEdgeFn;
+
+/* The same without the diff, for paths out of budget: only whether the
+   commit changes the path (against that parent). */
+
+typedef std::function<s32(u32, u32, u32, bool &)> ChurnTouchFn;
+
+/* Does boundary node have the base version of path? */
+
+typedef std::function<bool(u32, u32)> ChurnBaseFn;
+
+/* Per path: the changes of each HEAD line and, when replaying, the newest
+   node that changed it, the segments that reached the base version, and
+   whether any reached another version. With a budget, also the commits that
+   were diffed, those that changed the path, the time spent on the diffs, and
+   whether the path ran out. */
+
+struct ChurnWalk {
+  std::vector<std::map<unsigned int, unsigned int>> changes;
+  std::vector<std::map<unsigned int, u32>> newest;
+  std::vector<std::vector<ChurnSeg>> base;
+  std::vector<bool> lost;
+  std::vector<u32> diffed, total;
+  std::vector<u64> usecs;
+  std::vector<bool> cut;
+};
+
+static bool seg_less(const ChurnSeg &a, const ChurnSeg &b) {
+
+  if (a.start != b.start) return a.start < b.start;
+  if (a.head != b.head) return a.head < b.head;
+  return a.collapsed < b.collapsed;
+
+}
+
+static u32 seg_head(const ChurnSeg &s, u32 line) {
+
+  return s.collapsed ? s.head : s.head + (line - s.start);
+
+}
+
+/* Sort, drop duplicates and join runs that continue each other. */
+
+static void normalize_segs(std::vector<ChurnSeg> &segs) {
+
+  std::vector<ChurnSeg> out;
+
+  std::sort(segs.begin(), segs.end(), seg_less);
+
+  for (auto &s : segs) {
+
+    if (!out.empty()) {
+
+      ChurnSeg &l = out.back();
+
+      if (l.end == s.start && l.collapsed == s.collapsed &&
+          (s.collapsed ? l.head == s.head : l.head + (l.end - l.start) == s.head)) {
+        l.end = s.end;
+        continue;
+      }
+
+      if (l.start == s.start && l.end == s.end && l.head == s.head &&
+          l.collapsed == s.collapsed) continue;
+
+    }
+
+    out.push_back(s);
+
+  }
+
+  segs.swap(out);
+
+}
+
+/* Visit the parts of segs (sorted) that overlap lines [from, to). Segments
+   may overlap each other after merges, hence the running maximum of ends. */
+
+class SegIndex {
+
+  public:
+
+    SegIndex(const std::vector<ChurnSeg> &s) : segs(s) {
+      u32 m = 0;
+      for (auto &seg : segs) max_end.push_back(m = std::max(m, seg.end));
+    }
+
+    template <typename F> void overlap(u32 from, u32 to, F visit) {
+
+      u32 i = std::upper_bound(max_end.begin(), max_end.end(), from) - max_end.begin();
+
+      for (; i < segs.size() && segs[i].start < to; i++) {
+        u32 x = std::max(from, segs[i].start), y = std::min(to, segs[i].end);
+        if (x < y) visit(segs[i], x, y);
+      }
+
+    }
+
+  private:
+
+    const std::vector<ChurnSeg> &segs;
+    std::vector<u32> max_end;
+
+};
+
+/* Segments of the parent version, given those of the child and the hunks
+   between them. */
+
+static void segs_to_parent(const std::vector<ChurnSeg> &child,
+                           const std::vector<ChurnHunk> &hunks,
+                           std::vector<ChurnSeg> &parent) {
+
+  SegIndex idx(child);
+  u32 o = 1;
+  s64 off = 0;
+
+  /* Parent lines [a, b) are child lines [a + d, b + d). */
+
+  auto shift = [&](u32 a, u32 b, s64 d) {
+    if (a >= b) return;
+    u32 from = a + d, to = (b == CHURN_INF) ? CHURN_INF : b + d;
+    idx.overlap(from, to, [&](const ChurnSeg &s, u32 x, u32 y) {
+      ChurnSeg p = { (u32)(x - d), y == CHURN_INF ? CHURN_INF : (u32)(y - d),
+                     seg_head(s, x), s.collapsed };
+      parent.push_back(p);
+    });
+  };
+
+  /* Parent lines [a, b) all become child line c. */
+
+  auto collapse = [&](u32 a, u32 b, u32 c) {
+    idx.overlap(c, c + 1, [&](const ChurnSeg &s, u32 x, u32 y) {
+      ChurnSeg p = { a, b, seg_head(s, x), true };
+      parent.push_back(p);
+    });
+  };
+
+  for (auto &h : hunks) {
+
+    u32 ob = h.old_count ? h.old_start : h.old_start + 1;
+    u32 nb = h.new_count ? h.new_start : h.new_start + 1;
+    u32 k = std::min(h.old_count, h.new_count);
+
+    shift(o, ob, (s64)nb - ob);
+    shift(ob, ob + k, (s64)nb - ob);
+    if (h.new_count && h.old_count > k)
+      collapse(ob + k, ob + h.old_count, nb + h.new_count - 1);
+
+    o = ob + h.old_count;
+    off = (s64)(nb + h.new_count) - o;
+
+  }
+
+  shift(o, CHURN_INF, off);
+
+}
+
+/* HEAD lines touched by the added lines of hunks. */
+
+static void count_changes(const std::vector<ChurnSeg> &child,
+                          const std::vector<ChurnHunk> &hunks, u32 node,
+                          std::map<unsigned int, unsigned int> &changes,
+                          std::map<unsigned int, u32> *newest) {
+
+  SegIndex idx(child);
+  std::vector<std::pair<u32, u32>> heads;
+  u32 next = 0;
+
+  for (auto &h : hunks) {
+    if (!h.new_count) continue;
+    idx.overlap(h.new_start, h.new_start + h.new_count,
+                [&](const ChurnSeg &s, u32 x, u32 y) {
+      if (s.collapsed) heads.push_back(std::make_pair(s.head, s.head + 1));
+      else heads.push_back(std::make_pair(seg_head(s, x), seg_head(s, x) + (y - x)));
+    });
+  }
+
+  /* One change per commit, however many old lines map to a HEAD line. */
+
+  std::sort(heads.begin(), heads.end());
+
+  for (auto &r : heads) {
+    for (u32 l = std::max(next, r.first); l < r.second; l++) {
+      changes[l]++;
+      if (newest) newest->emplace(l, node);
+    }
+    next = std::max(next, r.second);
+  }
+
+}
+
+/* The walk itself; nodes[0] is HEAD and parents come after their children.
+   Segments wait in 'pending' only between a commit's first child and the
+   commit itself. base_version is only set when replaying. Children are
+   visited first, so the newest node of a line is the first one to count it.
+
+   A path that has used up the budget keeps a single segment for the whole
+   file: where its lines go no longer matters, only which commits it still
+   reaches and whether they change it. Its changes are then scaled by the
+   share of diffed commits. */
+
+static bool walk_churn(const std::vector<ChurnNode> &nodes, u32 path_cnt,
+                       ChurnEdgeFn edge_hunks, ChurnTouchFn edge_touch,
+                       ChurnBaseFn base_version, const ChurnBudget *budget,
+                       ChurnWalk &walk) {
+
+  std::map<u32, std::vector<std::vector<ChurnSeg>>> pending;
+  ChurnSeg whole = { 1, CHURN_INF, 1, false };
+
+  walk.changes.assign(path_cnt, std::map<unsigned int, unsigned int>());
+  walk.newest.assign(path_cnt, std::map<unsigned int, u32>());
+  walk.base.assign(path_cnt, std::vector<ChurnSeg>());
+  walk.lost.assign(path_cnt, false);
+  walk.diffed.assign(path_cnt, 0);
+  walk.total.assign(path_cnt, 0);
+  walk.usecs.assign(path_cnt, 0);
+  walk.cut.assign(path_cnt, false);
+  if (nodes.empty()) return true;
+
+  pending[0].assign(path_cnt, std::vector<ChurnSeg>(1, whole));
+
+  for (u32 n = 0; n < nodes.size(); n++) {
+
+    auto it = pending.find(n);
+    const ChurnNode &node = nodes[n];
+    std::vector<std::vector<ChurnSeg>> segs;
+    bool count = node.counted && node.parents.size() == 1;
+
+    if (it == pending.end()) continue;
+    segs.swap(it->second);
+    pending.erase(it);
+
+    for (auto &s : segs) normalize_segs(s);
+
+    if (node.boundary) {
+      for (u32 p = 0; p < path_cnt; p++) {
+        if (segs[p].empty()) continue;
+        if (!base_version || !base_version(n, p)) walk.lost[p] = true;
+        else walk.base[p].insert(walk.base[p].end(), segs[p].begin(), segs[p].end());
+      }
+      continue;
+    }
+
+    for (u32 e = 0; e < node.parents.size(); e++) {
+
+      u32 parent = node.parents[e];
+
+      for (u32 p = 0; p < path_cnt; p++) {
+
+        std::vector<ChurnHunk> hunks;
+        s32 has_file;
+        bool changed;
+
+        if (segs[p].empty()) continue;
+
+        if (walk.cut[p]) {
+
+          has_file = edge_touch(n, e, p, changed);
+          if (has_file < 0) return false;
+
+          if (count && changed) walk.total[p]++;
+
+          if (!has_file || parent == CHURN_NO_NODE || parent <= n) continue;
+
+          std::vector<std::vector<ChurnSeg>> &slot = pending[parent];
+          if (slot.empty()) slot.resize(path_cnt);
+          slot[p].assign(1, whole);
+          continue;
+
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        has_file = edge_hunks(n, e, p, hunks);
+        if (has_file < 0) return false;
+
+        if (count) count_changes(segs[p], hunks, n, walk.changes[p],
+                                 base_version ? &walk.newest[p] : NULL);
+
+        if (count && !hunks.empty()) {
+          walk.diffed[p]++;
+          walk.total[p]++;
+        }
+
+        if (budget) {
+          walk.usecs[p] += std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start).count();
+          if ((budget->commits && walk.diffed[p] >= budget->commits) ||
+              (budget->usecs && walk.usecs[p] >= budget->usecs))
+            walk.cut[p] = true;
+        }
+
+        if (!has_file || parent == CHURN_NO_NODE || parent <= n) continue;
+
+        std::vector<std::vector<ChurnSeg>> &slot = pending[parent];
+        if (slot.empty()) slot.resize(path_cnt);
+        segs_to_parent(segs[p], hunks, slot[p]);
+
+      }
+
+    }
+
+  }
+
+  for (auto &b : walk.base) normalize_segs(b);
+
+  for (u32 p = 0; p < path_cnt; p++) {
+    u32 d = walk.diffed[p], t = walk.total[p];
+    if (!walk.cut[p] || !d || t <= d) continue;
+    for (auto &ln : walk.changes[p])
+      ln.second = ((u64)ln.second * t + d / 2) / d;
+  }
+
+  return true;
+
+}
+
+/* The results of a walk over paths, keyed by path. node_blame names the
+   commit behind each node. */
+
+static void walk_to_changes(const std::vector<std::string> &paths, ChurnWalk &walk,
+                            std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+                            ChurnBudget *budget) {
+
+  for (u32 p = 0; p < paths.size(); p++) {
+    if (!walk.changes[p].empty()) changes[paths[p]].swap(walk.changes[p]);
+    if (budget && walk.cut[p] && walk.total[p] > walk.diffed[p]) {
+      ChurnCut c = { walk.diffed[p], walk.total[p] };
+      budget->cut[paths[p]] = c;
+    }
+  }
+
+}
+
+static void walk_to_replay(const std::vector<std::string> &paths, ChurnWalk &walk,
+                           const std::vector<ChurnBlame> &node_blame,
+                           std::map<std::string, ChurnReplay> &files) {
+
+  for (u32 p = 0; p < paths.size(); p++) {
+
+    if (walk.lost[p]) continue;
+
+    ChurnReplay &r = files[paths[p]];
+
+    r.changes.swap(walk.changes[p]);
+    r.base.swap(walk.base[p]);
+    for (auto &ln : walk.newest[p]) r.last[ln.first] = node_blame[ln.second];
+
+  }
+
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* popen() backend                                                          */
+/* ------------------------------------------------------------------------ */
+
+class PopenHistory : public ChurnHistory {
+
+  public:
+
+    PopenHistory(std::string git_directory) : git_dir(git_directory) { }
+
+    std::string head_commit() override;
+    unsigned long head_time() override;
+    unsigned long init_time() override;
+    unsigned int commit_count(std::string commit) override;
+    bool file_exists(std::string path) override;
+    std::string blob_id(std::string path) override;
+    std::string head_blob(std::string path) override;
+    bool blame(std::string path, std::map<unsigned int, ChurnBlame> &lines,
+               ChurnBudget *budget) override;
+    bool churn(const std::vector<std::string> &paths, unsigned long since,
+               std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+               ChurnBudget *budget) override;
+    bool replay(const std::vector<std::string> &paths, std::string base,
+                std::map<std::string, ChurnReplay> &files) override;
+
+  private:
+
+    std::string git_dir;
+
+    FILE *run(std::string cmd);
+    std::string first_word(std::string cmd);
+    bool tree_blobs(std::string commit, const std::vector<std::string> &paths,
+                    std::map<std::string, std::string> &blobs);
+    bool walk_paths(const std::vector<std::string> &paths, unsigned long since,
+                    std::string base, const ChurnBudget *budget, ChurnWalk &walk,
+                    std::vector<ChurnBlame> &node_blame);
+
+};
+
+static std::atomic<unsigned long long> subprocess_count(0);
+
+FILE *PopenHistory::run(std::string cmd) {
+
+  std::ostringstream git_cmd;
+  git_cmd << "cd " << git_dir << " && " << cmd;
+  subprocess_count++;
+  return popen(git_cmd.str().c_str(), "r");
+
+}
+
+/* First word of the output; empty if the command fails. */
+std::string PopenHistory::first_word(std::string cmd) {
+
+  char buf[2048];
+  std::string ret;
+  FILE *fp = run(cmd);
+
+  if (!fp) return ret;
+  if (fscanf(fp, "%2047s", buf) == 1) ret.assign(buf);
+  if (pclose(fp)) ret.clear();
+
+  return ret;
+
+}
+
+std::string PopenHistory::head_commit() {
+
+  return first_word("git rev-parse HEAD");
+
+}
+
+unsigned long PopenHistory::head_time() {
+
+  return strtoul(first_word("git show -s --format=%ct HEAD").c_str(), NULL, 10);
+
+}
+
+unsigned long PopenHistory::init_time() {
+
+  return strtoul(first_word("git log --reverse --date=unix --oneline --format=%cd"
+                            " | head -n1").c_str(), NULL, 10);
+
+}
+
+unsigned int PopenHistory::commit_count(std::string commit) {
+
+  return strtoul(first_word("git rev-list --count " + commit).c_str(), NULL, 10);
+
+}
+
+bool PopenHistory::file_exists(std::string path) {
+
+  char buf[1024];
+  bool exists;
+  FILE *fp;
+
+  // when cmd fails, it outputs "fatal: Path 'tdio.h' does not exist in 'HEAD'";
+  // when it succeeds, nothing
+  fp = run("git cat-file -e HEAD:" + path + " 2>&1");
+  if (!fp) return false;
+  exists = (fgets(buf, sizeof(buf), fp) == NULL);
+  pclose(fp);
+
+  return exists;
+
+}
+
+std::string PopenHistory::blob_id(std::string path) {
+
+  return first_word("git hash-object -- " + path);
+
+}
+
+std::string PopenHistory::head_blob(std::string path) {
+
+  return first_word("git rev-parse -q --verify HEAD:" + path);
+
+}
+
+/* git blame -p: a "<sha> <orig line> <final line>[ <count>]" header per line,
+   commit details after the first header of each commit, then the tab-prefixed
+   content. With a budget, the blame stops at the commit after the first
+   'commits' that changed the file (lines older than that come out as
+   "boundary"), and runs under timeout(1) for 'usecs' in --incremental mode,
+   which prints groups of lines as it goes; the lines it has not got to by
+   then stay with the oldest commit it has reached. */
+bool PopenHistory::blame(std::string path, std::map<unsigned int, ChurnBlame> &lines,
+                         ChurnBudget *budget) {
+
+  std::map<std::string, unsigned long> commit_time;
+  std::map<unsigned int, std::string> line_commit;
+  std::set<std::string> boundary, walked;
+  std::string cur_commit, last_commit, range, cmd;
+  ChurnBlameCut cut = { 0, 0, 0 };
+  char *buf = NULL;
+  size_t buf_len = 0;
+  bool timed_out = false;
+  int status;
+  FILE *fp;
+
+  if (budget && (budget->commits || budget->usecs)) {
+
+    std::vector<std::pair<std::string, unsigned long>> revs;
+    char sha[41];
+    unsigned long t;
+
+    fp = run("git log -n " + std::to_string(budget->commits ? budget->commits + 1 : 1) +
+             " --format=\"%H %at\" HEAD -- " + path);
+    if (!fp) return false;
+
+    while (getline(&buf, &buf_len, fp) > 0)
+      if (sscanf(buf, "%40[0-9a-f] %lu", sha, &t) == 2)
+        revs.push_back(std::make_pair(std::string(sha), t));
+
+    if (pclose(fp)) revs.clear();
+
+    if (!revs.empty()) {
+      last_commit = revs[0].first;
+      commit_time[last_commit] = revs[0].second;
+    }
+
+    if (budget->commits && revs.size() > budget->commits)
+      range = " ^" + revs.back().first;
+
+  }
+
+  cmd = "git blame -p" + range + " -- " + path;
+
+  if (budget && budget->usecs) {
+    char secs[32];
+    snprintf(secs, sizeof(secs), "%llu.%06llu", budget->usecs / 1000000,
+             budget->usecs % 1000000);
+    cmd = "timeout " + std::string(secs) + " git blame --incremental" + range +
+          " -- " + path;
+  }
+
+  fp = run(cmd);
+  if (!fp) {
+    free(buf);
+    return false;
+  }
+
+  while (getline(&buf, &buf_len, fp) > 0) {
+
+    char sha[41];
+    unsigned int orig_line, final_line, count = 1;
+    unsigned long t;
+
+    if (buf[0] == '\t') continue;
+
+    if (sscanf(buf, "%40[0-9a-f] %u %u %u", sha, &orig_line, &final_line, &count) >= 3 &&
+        strlen(sha) == 40) {
+      cur_commit.assign(sha);
+      for (unsigned int i = 0; i < count; i++) line_commit[final_line + i] = cur_commit;
+      count = 1;
+    } else if (sscanf(buf, "author-time %lu", &t) == 1) {
+      commit_time[cur_commit] = t;
+      if (!boundary.count(cur_commit)) {
+        walked.insert(cur_commit);
+        if (last_commit.empty() || t <= commit_time[last_commit]) last_commit = cur_commit;
+      }
+    } else if (!strncmp(buf, "boundary", 8) && !range.empty()) {
+      boundary.insert(cur_commit);
+      walked.erase(cur_commit);
+    }
+
+  }
+
+  free(buf);
+  status = pclose(fp);
+
+  /* timeout(1) exits with 124 once it had to stop git. */
+
+  if (status && budget && budget->usecs && WIFEXITED(status) && WEXITSTATUS(status) == 124)
+    timed_out = true;
+  else if (status || line_commit.empty())
+    return false;
+
+  if (timed_out) {
+
+    std::ifstream in(git_dir + path);
+    std::stringstream data;
+    unsigned int total;
+
+    if (!in || last_commit.empty()) return false;
+    data << in.rdbuf();
+    total = count_lines(data.str());
+
+    for (unsigned int i = 1; i <= total; i++)
+      if (!line_commit.count(i)) {
+        line_commit[i] = last_commit;
+        cut.cut_lines++;
+      }
+
+  }
+
+  for (auto &lc : line_commit) {
+    ChurnBlame b;
+    b.commit = lc.second;
+    b.time = commit_time[lc.second];
+    lines[lc.first] = b;
+    if (boundary.count(lc.second)) cut.cut_lines++;
+  }
+
+  if (budget && cut.cut_lines) {
+    cut.commits = walked.size();
+    cut.lines = line_commit.size();
+    budget->blame_cut[path] = cut;
+  }
+
+  return true;
+
+}
+
+/* "@@ -8,0 +9,2 @@" or "@@ -10 +11,0 @@" or "@@ -466,8 +475 @@" or "@@ -8 +9 @@" */
+static bool parse_hunk(const char *buf, ChurnHunk &h) {
+
+  char *p;
+
+  if (strncmp(buf, "@@ -", 4)) return false;
+
+  h.old_start = strtoul(buf + 4, &p, 10);
+  h.old_count = (*p == ',') ? strtoul(p + 1, &p, 10) : 1;
+  if (strncmp(p, " +", 2)) return false;
+  h.new_start = strtoul(p + 2, &p, 10);
+  h.new_count = (*p == ',') ? strtoul(p + 1, &p, 10) : 1;
+
+  return true;
+
+}
+
+/* Two git logs for all paths. The first one lists the history simplified
+   the usual way, children first (--topo-order) and with parents rewritten to
+   that history (--parents). The second one adds the -U0 diffs, -m repeating a
+   merge once per parent. It cannot stand alone: -m keeps merges that have the
+   same blobs as one of their parents, and prints nothing for that parent.
+   With a base, both logs are limited to base..HEAD and the first one also
+   lists the boundary commits ("-" for %m) that the rewritten parents lead to. */
+bool PopenHistory::walk_paths(const std::vector<std::string> &paths, unsigned long since,
+                              std::string base, const ChurnBudget *budget, ChurnWalk &walk,
+                              std::vector<ChurnBlame> &node_blame) {
+
+  std::ostringstream limit, cmd;
+  std::map<std::string, u32> path_ids, node_ids;
+  std::vector<std::vector<std::string>> parent_shas;
+  std::vector<ChurnNode> nodes;
+  /* node -> parent slot -> path -> hunks; and the paths the parent lacks */
+  std::vector<std::vector<std::map<u32, std::vector<ChurnHunk>>>> edges;
+  std::vector<std::vector<std::set<u32>>> created;
+  std::map<u32, std::map<std::string, std::string>> boundary_blobs;
+  std::map<std::string, std::string> base_blobs;
+  std::string cur_sha;
+  u32 cur_node = CHURN_NO_NODE, cur_edge = 0, cur_path = CHURN_NO_NODE, skip = 0;
+  bool from_null = false;
+  char *buf = NULL;
+  size_t buf_len = 0;
+  FILE *fp;
+
+  for (u32 i = 0; i < paths.size(); i++) path_ids[paths[i]] = i;
+
+  if (since) limit << " --since=@" << since;
+  if (base.empty()) limit << " HEAD --";
+  else limit << " " << base << "..HEAD --";
+  for (auto &p : paths) limit << " " << p;
+
+  fp = run(std::string("git log --topo-order --parents --format=\"%m %at %H %P\"") +
+           (base.empty() ? "" : " --boundary") + limit.str());
+  if (!fp) return false;
+
+  while (getline(&buf, &buf_len, fp) > 0) {
+
+    std::istringstream words(buf);
+    std::string mark, sha, parent;
+    ChurnBlame nb;
+
+    if (!(words >> mark >> nb.time >> sha)) continue;
+
+    node_ids[sha] = nodes.size();
+    nodes.push_back(ChurnNode());
+    nodes.back().boundary = (mark == "-");
+    nodes.back().counted = !nodes.back().boundary;
+    parent_shas.push_back(std::vector<std::string>());
+    while (!nodes.back().boundary && words >> parent) parent_shas.back().push_back(parent);
+    nb.commit = sha;
+    node_blame.push_back(nb);
+
+  }
+
+  if (pclose(fp)) {
+    free(buf);
+    return false;
+  }
+
+  /* No commit since base touches the paths: HEAD has the base versions,
+     unless a merge brought in others. */
+
+  if (!base.empty() && nodes.empty()) {
+    ChurnBlame nb = { head_commit(), 0 };
+    nodes.push_back(ChurnNode());
+    nodes.back().boundary = true;
+    nodes.back().counted = false;
+    parent_shas.push_back(std::vector<std::string>());
+    node_blame.push_back(nb);
+  }
+
+  for (u32 n = 0; n < nodes.size(); n++) {
+
+    for (auto &parent : parent_shas[n]) {
+      auto it = node_ids.find(parent);
+      nodes[n].parents.push_back(it == node_ids.end() ? CHURN_NO_NODE : it->second);
+    }
+
+    /* Root commits are diffed against the empty tree. */
+    if (nodes[n].parents.empty() && !nodes[n].boundary)
+      nodes[n].parents.push_back(CHURN_NO_NODE);
+
+    edges.push_back(std::vector<std::map<u32, std::vector<ChurnHunk>>>(nodes[n].parents.size()));
+    created.push_back(std::vector<std::set<u32>>(nodes[n].parents.size()));
+
+  }
+
+  cmd << "git -c core.quotepath=off log --topo-order -m -p -U0 --no-renames"
+         " --no-color --no-ext-diff --format=\"@commit %H\"" << limit.str();
+
+  fp = run(cmd.str());
+  if (!fp) {
+    free(buf);
+    return false;
+  }
+
+  while (getline(&buf, &buf_len, fp) > 0) {
+
+    char *nl = strchr(buf, '\n');
+    ChurnHunk h;
+
+    if (nl) *nl = 0;
+
+    /* Skip the removed and added lines of a hunk, whatever they contain. */
+
+    if (skip) {
+      if (buf[0] != '\\') skip--;
+      continue;
+    }
+
+    if (!strncmp(buf, "@commit ", 8)) {
+
+      if (cur_sha == buf + 8) cur_edge++;
+      else {
+        auto it = node_ids.find(buf + 8);
+        cur_sha.assign(buf + 8);
+        cur_node = (it == node_ids.end()) ? CHURN_NO_NODE : it->second;
+        cur_edge = 0;
+      }
+
+      cur_path = CHURN_NO_NODE;
+      continue;
+
+    }
+
+    if (cur_node == CHURN_NO_NODE || cur_edge >= edges[cur_node].size()) continue;
+
+    if (!strncmp(buf, "diff --git ", 11)) {
+      cur_path = CHURN_NO_NODE;
+      from_null = false;
+    } else if (!strcmp(buf, "--- /dev/null")) {
+      from_null = true;
+    } else if (!strncmp(buf, "+++ b/", 6)) {
+      auto it = path_ids.find(buf + 6);
+      cur_path = (it == path_ids.end()) ? CHURN_NO_NODE : it->second;
+      if (cur_path != CHURN_NO_NODE && from_null)
+        created[cur_node][cur_edge].insert(cur_path);
+    } else if (parse_hunk(buf, h)) {
+      skip = h.old_count + h.new_count;
+      if (cur_path != CHURN_NO_NODE) edges[cur_node][cur_edge][cur_path].push_back(h);
+    }
+
+  }
+
+  free(buf);
+  if (pclose(fp)) return false;
+
+  auto edge_hunks = [&](u32 n, u32 e, u32 p, std::vector<ChurnHunk> &hunks) -> s32 {
+    auto it = edges[n][e].find(p);
+    if (it != edges[n][e].end()) hunks = it->second;
+    return created[n][e].count(p) ? 0 : 1;
+  };
+
+  auto edge_touch = [&](u32 n, u32 e, u32 p, bool &changed) -> s32 {
+    changed = edges[n][e].count(p) || created[n][e].count(p);
+    return created[n][e].count(p) ? 0 : 1;
+  };
+
+  /* Boundary commits and the base are listed with ls-tree on first use. */
+
+  auto base_version = [&](u32 n, u32 p) -> bool {
+    if (base_blobs.empty() && !tree_blobs(base, paths, base_blobs)) return false;
+    if (!boundary_blobs.count(n) &&
+        !tree_blobs(node_blame[n].commit, paths, boundary_blobs[n])) return false;
+    return boundary_blobs[n][paths[p]] == base_blobs[paths[p]] &&
+           !base_blobs[paths[p]].empty();
+  };
+
+  if (base.empty())
+    return walk_churn(nodes, paths.size(), edge_hunks, edge_touch, NULL, budget, walk);
+  return walk_churn(nodes, paths.size(), edge_hunks, edge_touch, base_version, budget, walk);
+
+}
+
+/* Blob SHA-1 of each of paths in commit (git ls-tree). */
+bool PopenHistory::tree_blobs(std::string commit, const std::vector<std::string> &paths,
+                              std::map<std::string, std::string> &blobs) {
+
+  std::ostringstream cmd;
+  char *buf = NULL;
+  size_t buf_len = 0;
+  FILE *fp;
+
+  cmd << "git -c core.quotepath=off ls-tree -r " << commit << " --";
+  for (auto &p : paths) cmd << " " << p;
+
+  fp = run(cmd.str());
+  if (!fp) return false;
+
+  /* "<mode> blob <sha>\t<path>" */
+
+  while (getline(&buf, &buf_len, fp) > 0) {
+    char *tab = strchr(buf, '\t'), *nl = strchr(buf, '\n');
+    if (nl) *nl = 0;
+    if (tab && tab - buf >= 46 && !strncmp(tab - 46, " blob ", 6))
+      blobs[tab + 1].assign(tab - 40, 40);
+  }
+
+  free(buf);
+  return !pclose(fp);
+
+}
+
+bool PopenHistory::churn(const std::vector<std::string> &paths, unsigned long since,
+                         std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+                         ChurnBudget *budget) {
+
+  ChurnWalk walk;
+  std::vector<ChurnBlame> node_blame;
+
+  if (!walk_paths(paths, since, "", budget, walk, node_blame)) return false;
+
+  walk_to_changes(paths, walk, changes, budget);
+  return true;
+
+}
+
+bool PopenHistory::replay(const std::vector<std::string> &paths, std::string base,
+                          std::map<std::string, ChurnReplay> &files) {
+
+  ChurnWalk walk;
+  std::vector<ChurnBlame> node_blame;
+  FILE *fp = run("git merge-base --is-ancestor " + base + " HEAD 2>&1");
+
+  if (!fp || pclose(fp)) return false;
+
+  if (!walk_paths(paths, 0, base, NULL, walk, node_blame)) return false;
+
+  walk_to_replay(paths, walk, node_blame, files);
+  return true;
+
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* In-process backend                                                       */
+/* ------------------------------------------------------------------------ */
+
+enum {
+  /* 00 */ OBJ_NONE,
+  /* 01 */ OBJ_COMMIT,
+  /* 02 */ OBJ_TREE,
+  /* 03 */ OBJ_BLOB,
+  /* 04 */ OBJ_TAG,
+  /* 06 */ OBJ_OFS_DELTA = 6,
+  /* 07 */ OBJ_REF_DELTA
+};
+
+/* Budget for the cache of inflated trees and delta bases. */
+
+#define CHURN_OBJ_CACHE     (64 * 1024 * 1024)
+
+struct GitPack {
+  const u8 *idx, *data;
+  size_t idx_len, data_len;
+  u32 count;
+};
+
+struct GitCommit {
+  std::string tree;
+  std::vector<std::string> parents;
+  unsigned long author_time, commit_time;
+};
+
+class InprocHistory : public ChurnHistory {
+
+  public:
+
+    InprocHistory() { }
+    ~InprocHistory();
+
+    bool open_repo(std::string git_directory);
+
+    std::string head_commit() override;
+    unsigned long head_time() override;
+    unsigned long init_time() override;
+    unsigned int commit_count(std::string commit) override;
+    bool file_exists(std::string path) override;
+    std::string blob_id(std::string path) override;
+    std::string head_blob(std::string path) override;
+    bool blame(std::string path, std::map<unsigned int, ChurnBlame> &lines,
+               ChurnBudget *budget) override;
+    bool churn(const std::vector<std::string> &paths, unsigned long since,
+               std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+               ChurnBudget *budget) override;
+    bool replay(const std::vector<std::string> &paths, std::string base,
+                std::map<std::string, ChurnReplay> &files) override;
+
+  private:
+
+    std::string work_dir, git_dir, common_dir;
+    std::vector<std::string> object_dirs;
+    std::vector<GitPack> packs;
+    std::set<std::string> shallow;
+
+    std::string head;                                   /* raw SHA-1 of HEAD */
+    std::map<std::string, GitCommit> commits;
+    std::map<std::string, unsigned int> counts;
+    unsigned long oldest_time = 0;
+
+    std::map<std::string, std::pair<u8, std::string>> obj_cache;
+    std::map<std::pair<u32, u64>, std::pair<u8, std::string>> delta_cache;
+    size_t cache_size = 0;
+
+    std::map<std::tuple<std::string, u32, size_t>, std::vector<std::string>> blob_memo;
+
+    void add_object_dir(std::string dir, u32 depth);
+    bool read_file(std::string path, std::string &data);
+    std::string read_ref(std::string name, u32 depth);
+
+    bool read_object(const std::string &sha, u8 &type, std::string &data);
+    bool read_loose(const std::string &sha, u8 &type, std::string &data);
+    bool find_packed(const std::string &sha, u32 &pack, u64 &ofs);
+    bool unpack(u32 pack, u64 ofs, u8 &type, std::string &data, u32 depth);
+    void cache_put(size_t size);
+
+    GitCommit *get_commit(const std::string &sha);
+    bool find_blob(const std::string &commit, const std::string &path, std::string &blob);
+    bool resolve(std::string name, std::string &sha);
+    bool walk_all(void);
+    bool ancestors(const std::string &sha, std::set<std::string> &seen);
+    bool blame_head(const std::string &path, std::vector<std::string> &line_commit,
+                    std::string &head_data, const ChurnBudget *budget, ChurnBlameCut &cut);
+    bool tree_blobs(const std::string &tree, const std::vector<std::string> &paths,
+                    u32 lo, u32 hi, size_t plen, std::vector<std::string> &blobs);
+    bool walk_paths(const std::vector<std::string> &paths, unsigned long since,
+                    const std::string &base, const ChurnBudget *budget, ChurnWalk &walk,
+                    std::vector<ChurnBlame> &node_blame);
+
+};
+
+InprocHistory::~InprocHistory() {
+
+  for (auto &p : packs) {
+    munmap((void *)p.idx, p.idx_len);
+    munmap((void *)p.data, p.data_len);
+  }
+
+}
+
+bool InprocHistory::read_file(std::string path, std::string &data) {
+
+  std::ifstream f(path, std::ios::binary);
+  std::ostringstream ss;
+
+  if (!f.is_open()) return false;
+  ss << f.rdbuf();
+  data = ss.str();
+
+  return true;
+
+}
+
+static u32 get_be32(const u8 *p) {
+
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+}
+
+/* Map all pack indexes of an object directory, and follow its alternates. */
+void InprocHistory::add_object_dir(std::string dir, u32 depth) {
+
+  std::string pack_dir = dir + "/pack", alternates;
+  DIR *d;
+  struct dirent *de;
+
+  if (depth > 5) return;
+  object_dirs.push_back(dir);
+
+  d = opendir(pack_dir.c_str());
+
+  while (d && (de = readdir(d))) {
+
+    std::string name(de->d_name), idx_path, pack_path;
+    int idx_fd, pack_fd;
+    struct stat idx_st, pack_st;
+    GitPack p;
+
+    if (name.length() < 5 || name.compare(name.length() - 4, 4, ".idx")) continue;
+
+    idx_path = pack_dir + "/" + name;
+    pack_path = idx_path.substr(0, idx_path.length() - 4) + ".pack";
+
+    idx_fd = open(idx_path.c_str(), O_RDONLY);
+    pack_fd = open(pack_path.c_str(), O_RDONLY);
+
+    if (idx_fd >= 0 && pack_fd >= 0 && !fstat(idx_fd, &idx_st) &&
+        !fstat(pack_fd, &pack_st) && idx_st.st_size >= 8 + 1024 &&
+        pack_st.st_size >= 12) {
+
+      p.idx_len = idx_st.st_size;
+      p.data_len = pack_st.st_size;
+      p.idx = (const u8 *)mmap(NULL, p.idx_len, PROT_READ, MAP_PRIVATE, idx_fd, 0);
+      p.data = (const u8 *)mmap(NULL, p.data_len, PROT_READ, MAP_PRIVATE, pack_fd, 0);
+
+      /* Only version 2 indexes ("\377tOc", 2) are understood. */
+
+      if (p.idx != MAP_FAILED && p.data != MAP_FAILED &&
+          !memcmp(p.idx, "\377tOc\0\0\0\2", 8) && !memcmp(p.data, "PACK", 4)) {
+        p.count = get_be32(p.idx + 8 + 255 * 4);
+        if (8 + 1024 + (size_t)p.count * 28 <= p.idx_len) packs.push_back(p);
+        else {
+          munmap((void *)p.idx, p.idx_len);
+          munmap((void *)p.data, p.data_len);
+        }
+      } else {
+        if (p.idx != MAP_FAILED) munmap((void *)p.idx, p.idx_len);
+        if (p.data != MAP_FAILED) munmap((void *)p.data, p.data_len);
+      }
+
+    }
+
+    if (idx_fd >= 0) close(idx_fd);
+    if (pack_fd >= 0) close(pack_fd);
+
+  }
+
+  if (d) closedir(d);
+
+  if (read_file(dir + "/info/alternates", alternates)) {
+
+    std::istringstream alt(alternates);
+    std::string line;
+
+    while (std::getline(alt, line)) {
+      if (line.empty() || line[0] == '#') continue;
+      if (line[0] != '/') line = dir + "/" + line;
+      add_object_dir(line, depth + 1);
+    }
+
+  }
+
+}
+
+/* Locate .git (a directory, or a "gitdir:" file for worktrees and submodules)
+   and refuse repository formats we cannot read. */
+bool InprocHistory::open_repo(std::string git_directory) {
+
+  std::string dot_git, content, config, shallow_list;
+  struct stat st;
+
+  work_dir = git_directory;
+  dot_git = work_dir + ".git";
+
+  if (stat(dot_git.c_str(), &st)) return false;
+
+  if (S_ISDIR(st.st_mode)) git_dir = dot_git;
+  else {
+    if (!read_file(dot_git, content) || content.compare(0, 8, "gitdir: ")) return false;
+    git_dir = content.substr(8, content.find_last_not_of("\r\n") - 7);
+    if (git_dir[0] != '/') git_dir = work_dir + git_dir;
+  }
+
+  common_dir = git_dir;
+  if (read_file(git_dir + "/commondir", content)) {
+    content = content.substr(0, content.find_last_not_of("\r\n") + 1);
+    common_dir = content[0] == '/' ? content : git_dir + "/" + content;
+  }
+
+  /* SHA-256 repositories and reftable refs are out of scope. */
+
+  if (read_file(common_dir + "/config", config) &&
+      (config.find("objectformat") != std::string::npos ||
+       config.find("refstorage") != std::string::npos)) return false;
+
+  if (read_file(common_dir + "/shallow", shallow_list)) {
+    std::istringstream sl(shallow_list);
+    std::string line, raw;
+    while (std::getline(sl, line))
+      if (hex_to_sha(line, raw)) shallow.insert(raw);
+  }
+
+  add_object_dir(common_dir + "/objects", 0);
+
+  return hex_to_sha(read_ref("HEAD", 0), head) && get_commit(head);
+
+}
+
+/* HEAD lives in the (worktree) git dir, everything else in the common dir. */
+std::string InprocHistory::read_ref(std::string name, u32 depth) {
+
+  std::string content, packed;
+
+  if (depth > 5) return "";
+
+  if (read_file((name == "HEAD" ? git_dir : common_dir) + "/" + name, content)) {
+
+    content = content.substr(0, content.find_last_not_of("\r\n \t") + 1);
+    if (!content.compare(0, 5, "ref: ")) return read_ref(content.substr(5), depth + 1);
+    return content;
+
+  }
+
+  if (read_file(common_dir + "/packed-refs", packed)) {
+
+    std::istringstream pr(packed);
+    std::string line;
+
+    while (std::getline(pr, line))
+      if (line.length() == 41 + name.length() && line[40] == ' ' &&
+          !line.compare(41, std::string::npos, name)) return line.substr(0, 40);
+
+  }
+
+  return "";
+
+}
+
+static bool inflate_data(const u8 *in, size_t in_len, std::string &out, size_t out_len) {
+
+  z_stream zs;
+  int ret;
+  std::vector<u8> buf(out_len ? out_len : 1);
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK) return false;
+
+  zs.next_in = (Bytef *)in;
+  zs.avail_in = in_len;
+  zs.next_out = buf.data();
+  zs.avail_out = buf.size();
+
+  ret = inflate(&zs, Z_FINISH);
+  inflateEnd(&zs);
+
+  if (ret != Z_STREAM_END || zs.total_out != out_len) return false;
+
+  out.assign((const char *)buf.data(), out_len);
+  return true;
+
+}
+
+bool InprocHistory::read_loose(const std::string &sha, u8 &type, std::string &data) {
+
+  std::string hex = sha_to_hex(sha), raw, all;
+  z_stream zs;
+  u8 buf[65536];
+  int ret = Z_OK;
+  size_t nul;
+
+  for (auto &dir : object_dirs)
+    if (read_file(dir + "/" + hex.substr(0, 2) + "/" + hex.substr(2), raw)) break;
+
+  if (raw.empty()) return false;
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK) return false;
+
+  zs.next_in = (Bytef *)raw.data();
+  zs.avail_in = raw.length();
+
+  while (ret == Z_OK) {
+    zs.next_out = buf;
+    zs.avail_out = sizeof(buf);
+    ret = inflate(&zs, Z_NO_FLUSH);
+    all.append((const char *)buf, sizeof(buf) - zs.avail_out);
+  }
+
+  inflateEnd(&zs);
+  if (ret != Z_STREAM_END) return false;
+
+  /* "<type> <size>\0<data>" */
+
+  nul = all.find('\0');
+  if (nul == std::string::npos) return false;
+
+  if (!all.compare(0, 7, "commit ")) type = OBJ_COMMIT;
+  else if (!all.compare(0, 5, "tree ")) type = OBJ_TREE;
+  else if (!all.compare(0, 5, "blob ")) type = OBJ_BLOB;
+  else if (!all.compare(0, 4, "tag ")) type = OBJ_TAG;
+  else return false;
+
+  data = all.substr(nul + 1);
+  return true;
+
+}
+
+bool InprocHistory::find_packed(const std::string &sha, u32 &pack, u64 &ofs) {
+
+  const u8 *raw = (const u8 *)sha.data();
+
+  for (pack = 0; pack < packs.size(); pack++) {
+
+    GitPack &p = packs[pack];
+    const u8 *fanout = p.idx + 8, *shas = fanout + 1024;
+    u32 lo = raw[0] ? get_be32(fanout + (raw[0] - 1) * 4) : 0,
+        hi = get_be32(fanout + raw[0] * 4);
+
+    while (lo < hi) {
+
+      u32 mid = lo + (hi - lo) / 2;
+      int cmp = memcmp(shas + (size_t)mid * 20, raw, 20);
+
+      if (cmp < 0) lo = mid + 1;
+      else if (cmp > 0) hi = mid;
+      else {
+
+        const u8 *offsets = shas + (size_t)p.count * 24;
+        u32 o = get_be32(offsets + (size_t)mid * 4);
+
+        if (o & 0x80000000) {
+          const u8 *large = offsets + (size_t)p.count * 4 + (size_t)(o & 0x7fffffff) * 8;
+          if (large + 8 > p.idx + p.idx_len) return false;
+          ofs = ((u64)get_be32(large) << 32) | get_be32(large + 4);
+        } else ofs = o;
+
+        return ofs < p.data_len;
+
+      }
+
+    }
+
+  }
+
+  return false;
+
+}
+
+/* Apply a git delta to base. */
+static bool apply_delta(const std::string &base, const std::string &delta,
+                        std::string &out) {
+
+  const u8 *p = (const u8 *)delta.data(), *end = p + delta.length();
+  u64 src_size = 0, dst_size = 0;
+  u32 shift = 0;
+
+  do { src_size |= (u64)(*p & 0x7f) << shift; shift += 7; } while (p < end && (*p++ & 0x80));
+  shift = 0;
+  do { dst_size |= (u64)(*p & 0x7f) << shift; shift += 7; } while (p < end && (*p++ & 0x80));
+
+  if (src_size != base.length()) return false;
+
+  out.clear();
+  out.reserve(dst_size);
+
+  while (p < end) {
+
+    u8 op = *p++;
+
+    if (op & 0x80) {
+
+      u64 cp_ofs = 0, cp_size = 0;
+
+      for (u32 i = 0; i < 4; i++)
+        if (op & (1 << i)) { if (p >= end) return false; cp_ofs |= (u64)*p++ << (i * 8); }
+      for (u32 i = 0; i < 3; i++)
+        if (op & (0x10 << i)) { if (p >= end) return false; cp_size |= (u64)*p++ << (i * 8); }
+      if (!cp_size) cp_size = 0x10000;
+
+      if (cp_ofs + cp_size > base.length()) return false;
+      out.append(base, cp_ofs, cp_size);
+
+    } else if (op) {
+
+      if (p + op > end) return false;
+      out.append((const char *)p, op);
+      p += op;
+
+    } else return false;
+
+  }
+
+  return out.length() == dst_size;
+
+}
+
+void InprocHistory::cache_put(size_t size) {
+
+  cache_size += size;
+
+  if (cache_size > CHURN_OBJ_CACHE) {
+    obj_cache.clear();
+    delta_cache.clear();
+    cache_size = size;
+  }
+
+}
+
+bool InprocHistory::unpack(u32 pack, u64 ofs, u8 &type, std::string &data, u32 depth) {
+
+  GitPack &p = packs[pack];
+  const u8 *ptr = p.data + ofs, *end = p.data + p.data_len;
+  u64 size;
+  u32 shift = 4;
+  u8 c;
+  auto cached = delta_cache.find(std::make_pair(pack, ofs));
+
+  if (cached != delta_cache.end()) {
+    type = cached->second.first;
+    data = cached->second.second;
+    return true;
+  }
+
+  if (depth > 64 || ptr >= end) return false;
+
+  c = *ptr++;
+  type = (c >> 4) & 7;
+  size = c & 15;
+
+  while (c & 0x80) {
+    if (ptr >= end) return false;
+    c = *ptr++;
+    size |= (u64)(c & 0x7f) << shift;
+    shift += 7;
+  }
+
+  if (type == OBJ_OFS_DELTA || type == OBJ_REF_DELTA) {
+
+    std::string base, delta;
+    u8 base_type;
+
+    if (type == OBJ_OFS_DELTA) {
+
+      u64 rel;
+
+      if (ptr >= end) return false;
+      c = *ptr++;
+      rel = c & 0x7f;
+      while (c & 0x80) {
+        if (ptr >= end) return false;
+        c = *ptr++;
+        rel = ((rel + 1) << 7) | (c & 0x7f);
+      }
+      if (rel > ofs || !unpack(pack, ofs - rel, base_type, base, depth + 1)) return false;
+
+    } else {
+
+      if (ptr + 20 > end ||
+          !read_object(std::string((const char *)ptr, 20), base_type, base)) return false;
+      ptr += 20;
+
+    }
+
+    if (!inflate_data(ptr, end - ptr, delta, size) ||
+        !apply_delta(base, delta, data)) return false;
+    type = base_type;
+
+    /* Delta chains share their bases; remember the result. */
+
+    cache_put(data.length());
+    delta_cache[std::make_pair(pack, ofs)] = std::make_pair(type, data);
+    return true;
+
+  }
+
+  if (type < OBJ_COMMIT || type > OBJ_TAG) return false;
+
+  return inflate_data(ptr, end - ptr, data, size);
+
+}
+
+bool InprocHistory::read_object(const std::string &sha, u8 &type, std::string &data) {
+
+  u32 pack;
+  u64 ofs;
+  auto cached = obj_cache.find(sha);
+
+  if (cached != obj_cache.end()) {
+    type = cached->second.first;
+    data = cached->second.second;
+    return true;
+  }
+
+  if (!(find_packed(sha, pack, ofs) && unpack(pack, ofs, type, data, 0)) &&
+      !read_loose(sha, type, data)) return false;
+
+  /* Trees are looked up again and again while walking history. */
+
+  if (type == OBJ_TREE) {
+    cache_put(data.length());
+    obj_cache[sha] = std::make_pair(type, data);
+  }
+
+  return true;
+
+}
+
+GitCommit *InprocHistory::get_commit(const std::string &sha) {
+
+  auto known = commits.find(sha);
+  GitCommit c;
+  std::string data, line, raw;
+  u8 type;
+
+  if (known != commits.end()) return &known->second;
+
+  if (!read_object(sha, type, data) || type != OBJ_COMMIT) return NULL;
+
+  std::istringstream lines(data);
+
+  while (std::getline(lines, line) && !line.empty()) {
+
+    size_t gt = line.rfind('>');
+
+    if (!line.compare(0, 5, "tree ") && hex_to_sha(line.substr(5), raw))
+      c.tree = raw;
+    else if (!line.compare(0, 7, "parent ") && hex_to_sha(line.substr(7), raw)) {
+      /* Commits at the shallow boundary have no parents. */
+      if (!shallow.count(sha)) c.parents.push_back(raw);
+    } else if (!line.compare(0, 7, "author ") && gt != std::string::npos)
+      c.author_time = strtoul(line.c_str() + gt + 1, NULL, 10);
+    else if (!line.compare(0, 10, "committer ") && gt != std::string::npos)
+      c.commit_time = strtoul(line.c_str() + gt + 1, NULL, 10);
+
+  }
+
+  if (c.tree.empty()) return NULL;
+
+  return &(commits[sha] = c);
+
+}
+
+/* Blob SHA-1 of path in commit; false if it is not a file there. */
+bool InprocHistory::find_blob(const std::string &commit, const std::string &path,
+                              std::string &blob) {
+
+  GitCommit *c = get_commit(commit);
+  std::string cur, data;
+  size_t start = 0;
+  u8 type;
+
+  if (!c) return false;
+  cur = c->tree;
+
+  while (start <= path.length()) {
+
+    size_t slash = path.find('/', start), pos = 0;
+    std::string name = path.substr(start, slash == std::string::npos ?
+                                          std::string::npos : slash - start);
+    bool is_last = (slash == std::string::npos), found = false;
+
+    if (!read_object(cur, type, data) || type != OBJ_TREE) return false;
+
+    /* "<mode> <name>\0<20-byte sha>" entries */
+
+    while (pos < data.length()) {
+
+      size_t sp = data.find(' ', pos), nul = data.find('\0', pos);
+
+      if (sp == std::string::npos || nul == std::string::npos ||
+          nul + 21 > data.length()) return false;
+
+      if (!data.compare(sp + 1, nul - sp - 1, name)) {
+        bool is_tree = !data.compare(pos, sp - pos, "40000");
+        if (is_tree == is_last) return false;
+        cur = data.substr(nul + 1, 20);
+        found = true;
+        break;
+      }
+
+      pos = nul + 21;
+
+    }
+
+    if (!found) return false;
+    if (is_last) {
+      blob = cur;
+      return true;
+    }
+
+    start = slash + 1;
+
+  }
+
+  return false;
+
+}
+
+/* "HEAD" or a full hex SHA-1. */
+bool InprocHistory::resolve(std::string name, std::string &sha) {
+
+  if (name == "HEAD") {
+    sha = head;
+    return true;
+  }
+
+  return hex_to_sha(name, sha) && get_commit(sha);
+
+}
+
+/* Parse every commit reachable from HEAD once, for counting and the date of
+   the oldest commit. */
+bool InprocHistory::walk_all(void) {
+
+  std::vector<std::string> stack(1, head);
+  std::set<std::string> seen;
+
+  if (oldest_time) return true;
+
+  seen.insert(head);
+
+  while (!stack.empty()) {
+
+    GitCommit *c = get_commit(stack.back());
+    stack.pop_back();
+    if (!c) return false;
+
+    if (!oldest_time || c->commit_time < oldest_time) oldest_time = c->commit_time;
+
+    for (auto &p : c->parents)
+      if (seen.insert(p).second) stack.push_back(p);
+
+  }
+
+  counts[head] = seen.size();
+  return true;
+
+}
+
+std::string InprocHistory::head_commit() {
+
+  return sha_to_hex(head);
+
+}
+
+unsigned long InprocHistory::head_time() {
+
+  GitCommit *c = get_commit(head);
+  return c ? c->commit_time : 0;
+
+}
+
+unsigned long InprocHistory::init_time() {
+
+  return walk_all() ? oldest_time : 0;
+
+}
+
+/* sha and every commit reachable from it. */
+bool InprocHistory::ancestors(const std::string &sha, std::set<std::string> &seen) {
+
+  std::vector<std::string> stack(1, sha);
+
+  seen.insert(sha);
+
+  while (!stack.empty()) {
+
+    GitCommit *c = get_commit(stack.back());
+    stack.pop_back();
+    if (!c) return false;
+
+    for (auto &p : c->parents)
+      if (seen.insert(p).second) stack.push_back(p);
+
+  }
+
+  return true;
+
+}
+
+unsigned int InprocHistory::commit_count(std::string commit) {
+
+  std::string sha;
+  std::set<std::string> seen;
+
+  if (!resolve(commit, sha)) return 0;
+  if (counts.count(sha)) return counts[sha];
+
+  if (!ancestors(sha, seen)) return 0;
+
+  return counts[sha] = seen.size();
+
+}
+
+bool InprocHistory::file_exists(std::string path) {
+
+  std::string blob;
+  return find_blob(head, path, blob);
+
+}
+
+std::string InprocHistory::blob_id(std::string path) {
+
+  return get_churn_blob_id(work_dir + path);
+
+}
+
+std::string InprocHistory::head_blob(std::string path) {
+
+  std::string blob;
+  return find_blob(head, path, blob) ? sha_to_hex(blob) : "";
+
+}
+
+/* Lines waiting to be blamed in some commit: (line in that commit's version
+   of the file, 0-based line in HEAD). */
+
+struct PendingLines {
+  std::string blob;
+  std::vector<std::pair<u32, u32>> lines;
+};
+
+/* Blame every line of path in HEAD. Commits are visited newest first; a commit
+   hands each line down to the first parent in which the line is unchanged
+   (all of them at once if a parent has the same blob) and keeps the rest.
+   Once the budget is spent, the lines still on their way down stay with the
+   commit they have got to, and cut says how many. */
+bool InprocHistory::blame_head(const std::string &path,
+                               std::vector<std::string> &line_commit,
+                               std::string &head_data, const ChurnBudget *budget,
+                               ChurnBlameCut &cut) {
+
+  std::map<std::pair<unsigned long, std::string>, PendingLines,
+           std::greater<std::pair<unsigned long, std::string>>> queue;
+  auto start = std::chrono::steady_clock::now();
+  std::string head_blob;
+  PendingLines first;
+  u8 type;
+
+  cut.commits = cut.lines = cut.cut_lines = 0;
+
+  if (!find_blob(head, path, head_blob) ||
+      !read_object(head_blob, type, head_data) || type != OBJ_BLOB) return false;
+
+  first.blob = head_blob;
+  for (u32 i = 0; i < count_lines(head_data); i++)
+    first.lines.push_back(std::make_pair(i, i));
+
+  line_commit.assign(first.lines.size(), "");
+  cut.lines = first.lines.size();
+  queue[std::make_pair(get_commit(head)->commit_time, head)] = first;
+
+  while (!queue.empty()) {
+
+    if (budget && ((budget->commits && cut.commits >= budget->commits) ||
+                   (budget->usecs &&
+                    (u64)std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start).count() >= budget->usecs))) {
+
+      for (auto &q : queue)
+        for (auto &l : q.second.lines) {
+          line_commit[l.second] = q.first.second;
+          cut.cut_lines++;
+        }
+
+      break;
+
+    }
+
+    std::string sha = queue.begin()->first.second, data;
+    PendingLines pend = queue.begin()->second;
+    GitCommit *c = get_commit(sha);
+    std::vector<std::pair<std::string, std::string>> parent_blobs;
+    bool same = false;
+
+    queue.erase(queue.begin());
+    if (!c) return false;
+
+    for (auto &p : c->parents) {
+      std::string blob;
+      if (!find_blob(p, path, blob)) continue;
+      parent_blobs.push_back(std::make_pair(p, blob));
+    }
+
+    auto enqueue = [&](const std::string &parent, PendingLines &lines) {
+      GitCommit *pc = get_commit(parent);
+      if (!pc) return false;
+      PendingLines &slot = queue[std::make_pair(pc->commit_time, parent)];
+      slot.blob = lines.blob;
+      slot.lines.insert(slot.lines.end(), lines.lines.begin(), lines.lines.end());
+      return true;
+    };
+
+    for (auto &pb : parent_blobs)
+      if (pb.second == pend.blob) {
+        if (!enqueue(pb.first, pend)) return false;
+        same = true;
+        break;
+      }
+
+    if (same) continue;
+
+    cut.commits++;
+
+    if (!parent_blobs.empty() && (!read_object(pend.blob, type, data) || type != OBJ_BLOB))
+      return false;
+
+    for (auto &pb : parent_blobs) {
+
+      std::string parent_data;
+      std::vector<ChurnHunk> hunks;
+      std::vector<s32> new2old;
+      PendingLines to_parent, kept;
+
+      if (pend.lines.empty()) break;
+      if (!read_object(pb.second, type, parent_data) || type != OBJ_BLOB) return false;
+
+      diff_contents(parent_data, data, hunks);
+      map_new_to_old(hunks, count_lines(data), new2old);
+
+      to_parent.blob = pb.second;
+      kept.blob = pend.blob;
+
+      for (auto &l : pend.lines) {
+        if (l.first < new2old.size() && new2old[l.first] >= 0)
+          to_parent.lines.push_back(std::make_pair(new2old[l.first], l.second));
+        else
+          kept.lines.push_back(l);
+      }
+
+      if (!to_parent.lines.empty() && !enqueue(pb.first, to_parent)) return false;
+      pend = kept;
+
+    }
+
+    for (auto &l : pend.lines) line_commit[l.second] = sha;
+
+  }
+
+  return true;
+
+}
+
+bool InprocHistory::blame(std::string path, std::map<unsigned int, ChurnBlame> &lines,
+                          ChurnBudget *budget) {
+
+  std::vector<std::string> line_commit;
+  std::string head_data, work_data;
+  std::vector<ChurnHunk> hunks;
+  std::vector<s32> work2head;
+  ChurnBlameCut cut;
+  u32 work_lines;
+
+  if (!blame_head(path, line_commit, head_data, budget, cut)) return false;
+  if (budget && cut.cut_lines) budget->blame_cut[path] = cut;
+
+  /* git blame works on the working tree; lines that differ from HEAD are
+     not committed yet. */
+
+  if (!read_file(work_dir + path, work_data)) return false;
+
+  diff_contents(head_data, work_data, hunks);
+  work_lines = count_lines(work_data);
+  map_new_to_old(hunks, work_lines, work2head);
+
+  for (u32 i = 0; i < work_lines; i++) {
+
+    ChurnBlame b;
+
+    if (work2head[i] >= 0 && !line_commit[work2head[i]].empty()) {
+      b.commit = sha_to_hex(line_commit[work2head[i]]);
+      b.time = get_commit(line_commit[work2head[i]])->author_time;
+    } else {
+      b.commit = std::string(40, '0');
+      b.time = time(NULL);
+    }
+
+    lines[i + 1] = b;
+
+  }
+
+  return true;
+
+}
+
+/* Blob SHA-1s of the sorted paths[lo, hi), which share their first plen
+   characters, in tree; empty for paths that are not files there. Subtrees
+   rarely change from one commit to the next, so their results are kept. */
+bool InprocHistory::tree_blobs(const std::string &tree, const std::vector<std::string> &paths,
+                               u32 lo, u32 hi, size_t plen, std::vector<std::string> &blobs) {
+
+  std::unordered_map<std::string, std::pair<bool, std::string>> entries;
+  std::string data;
+  size_t pos = 0;
+  u8 type;
+
+  if (plen) {
+    auto known = blob_memo.find(std::make_tuple(tree, lo, plen));
+    if (known != blob_memo.end()) {
+      std::copy(known->second.begin(), known->second.end(), blobs.begin() + lo);
+      return true;
+    }
+  }
+
+  if (!read_object(tree, type, data) || type != OBJ_TREE) return false;
+
+  /* "<mode> <name>\0<20-byte sha>" entries */
+
+  while (pos < data.length()) {
+
+    size_t sp = data.find(' ', pos), nul = data.find('\0', pos);
+
+    if (sp == std::string::npos || nul == std::string::npos ||
+        nul + 21 > data.length()) return false;
+
+    entries[data.substr(sp + 1, nul - sp - 1)] =
+      std::make_pair(!data.compare(pos, sp - pos, "40000"), data.substr(nul + 1, 20));
+
+    pos = nul + 21;
+
+  }
+
+  for (u32 i = lo; i < hi; ) {
+
+    size_t slash = paths[i].find('/', plen);
+    std::string name = paths[i].substr(plen, slash == std::string::npos ?
+                                             std::string::npos : slash - plen);
+    auto entry = entries.find(name);
+    u32 j = i + 1;
+
+    if (slash == std::string::npos) {
+      blobs[i] = (entry != entries.end() && !entry->second.first) ?
+                 entry->second.second : "";
+    } else {
+      while (j < hi && !paths[j].compare(0, slash + 1, paths[i], 0, slash + 1)) j++;
+      if (entry != entries.end() && entry->second.first) {
+        if (!tree_blobs(entry->second.second, paths, i, j, slash + 1, blobs))
+          return false;
+      } else {
+        for (u32 k = i; k < j; k++) blobs[k].clear();
+      }
+    }
+
+    i = j;
+
+  }
+
+  if (plen)
+    blob_memo[std::make_tuple(tree, lo, plen)] =
+      std::vector<std::string>(blobs.begin() + lo, blobs.begin() + hi);
+
+  return true;
+
+}
+
+/* The churn walk over the history of the sorted paths, simplified the way
+   git log simplifies it: a merge with the same blobs as one of its parents
+   only follows that parent. Commits are laid out newest first with Kahn's
+   algorithm, so that each comes after all of its children. With a base, the
+   commits reachable from it are boundary nodes. */
+bool InprocHistory::walk_paths(const std::vector<std::string> &sorted, unsigned long since,
+                               const std::string &base, const ChurnBudget *budget,
+                               ChurnWalk &walk, std::vector<ChurnBlame> &node_blame) {
+
+  std::vector<std::string> shas, blob_shas(1);
+  std::map<std::string, u32> ids, blob_ids;
+  std::vector<std::vector<u32>> blobs, parents;
+  std::vector<bool> counted, boundary, reached;
+  std::vector<u32> queue, children, order, pos;
+  std::priority_queue<std::pair<unsigned long, u32>> ready;
+  std::vector<ChurnNode> nodes;
+  std::set<std::string> base_set;
+  u32 base_id = CHURN_NO_NODE;
+
+  blob_memo.clear();
+
+  /* Commit -> node id, with the blobs of all paths in it. */
+
+  auto visit = [&](const std::string &sha) -> u32 {
+    auto known = ids.find(sha);
+    GitCommit *c;
+    std::vector<std::string> raw(sorted.size());
+    if (known != ids.end()) return known->second;
+    if (!(c = get_commit(sha)) ||
+        !tree_blobs(c->tree, sorted, 0, sorted.size(), 0, raw)) return CHURN_NO_NODE;
+    blobs.push_back(std::vector<u32>());
+    for (auto &b : raw) {
+      u32 id = 0;
+      if (!b.empty()) {
+        id = blob_ids.emplace(b, blob_shas.size()).first->second;
+        if (id == blob_shas.size()) blob_shas.push_back(b);
+      }
+      blobs.back().push_back(id);
+    }
+    shas.push_back(sha);
+    parents.push_back(std::vector<u32>());
+    counted.push_back(false);
+    boundary.push_back(false);
+    queue.push_back(shas.size() - 1);
+    return ids[sha] = shas.size() - 1;
+  };
+
+  if (visit(head) == CHURN_NO_NODE) return false;
+
+  if (!base.empty()) {
+    if (!ancestors(base, base_set)) return false;
+    if ((base_id = visit(base)) == CHURN_NO_NODE) return false;
+  }
+
+  for (u32 q = 0; q < queue.size(); q++) {
+
+    u32 id = queue[q];
+    GitCommit *c = get_commit(shas[id]);
+    std::vector<u32> pids;
+    bool alive = false;
+
+    if (base_set.count(shas[id])) {
+      boundary[id] = true;
+      continue;
+    }
+
+    for (u32 b : blobs[id]) if (b) alive = true;
+    if (!alive || (since && c->commit_time < since)) continue;
+
+    counted[id] = true;
+
+    if (c->parents.empty()) {
+      parents[id].push_back(CHURN_NO_NODE);
+      continue;
+    }
+
+    for (auto &p : c->parents) {
+      u32 pid = visit(p);
+      if (pid == CHURN_NO_NODE) return false;
+      pids.push_back(pid);
+    }
+
+    if (pids.size() > 1)
+      for (u32 pid : pids)
+        if (blobs[pid] == blobs[id]) {
+          pids.assign(1, pid);
+          break;
+        }
+
+    parents[id] = pids;
+
+  }
+
+  /* Parents dropped by the simplification were visited, but are not part of
+     the walk unless another child leads to them. */
+
+  children.assign(shas.size(), 0);
+  queue.assign(1, 0);
+  reached.assign(shas.size(), false);
+  reached[0] = true;
+
+  for (u32 q = 0; q < queue.size(); q++)
+    for (u32 pid : parents[queue[q]]) {
+      if (pid == CHURN_NO_NODE) continue;
+      children[pid]++;
+      if (!reached[pid]) {
+        reached[pid] = true;
+        queue.push_back(pid);
+      }
+    }
+
+  ready.push(std::make_pair(get_commit(head)->commit_time, 0));
+
+  while (!ready.empty()) {
+
+    u32 id = ready.top().second;
+    ready.pop();
+    order.push_back(id);
+
+    for (u32 pid : parents[id])
+      if (pid != CHURN_NO_NODE && !--children[pid])
+        ready.push(std::make_pair(get_commit(shas[pid])->commit_time, pid));
+
+  }
+
+  pos.assign(shas.size(), CHURN_NO_NODE);
+  for (u32 n = 0; n < order.size(); n++) pos[order[n]] = n;
+
+  for (u32 id : order) {
+    ChurnNode node;
+    ChurnBlame nb = { sha_to_hex(shas[id]), get_commit(shas[id])->author_time };
+    node.counted = counted[id];
+    node.boundary = boundary[id];
+    for (u32 pid : parents[id])
+      node.parents.push_back(pid == CHURN_NO_NODE ? CHURN_NO_NODE : pos[pid]);
+    nodes.push_back(node);
+    node_blame.push_back(nb);
+  }
+
+  auto edge_hunks = [&](u32 n, u32 e, u32 p, std::vector<ChurnHunk> &hunks) -> s32 {
+    u32 id = order[n], pid = parents[id][e];
+    u32 cb = blobs[id][p], pb = (pid == CHURN_NO_NODE) ? 0 : blobs[pid][p];
+    std::string old_data, new_data;
+    u8 type;
+    if (!cb) return 0;
+    if (cb == pb) return 1;
+    if (!read_object(blob_shas[cb], type, new_data) || type != OBJ_BLOB) return -1;
+    if (pb && (!read_object(blob_shas[pb], type, old_data) || type != OBJ_BLOB)) return -1;
+    diff_contents(old_data, new_data, hunks);
+    return pb ? 1 : 0;
+  };
+
+  auto edge_touch = [&](u32 n, u32 e, u32 p, bool &changed) -> s32 {
+    u32 id = order[n], pid = parents[id][e];
+    u32 cb = blobs[id][p], pb = (pid == CHURN_NO_NODE) ? 0 : blobs[pid][p];
+    changed = cb && cb != pb;
+    return cb && pb;
+  };
+
+  auto base_version = [&](u32 n, u32 p) -> bool {
+    u32 b = blobs[order[n]][p];
+    return b && b == blobs[base_id][p];
+  };
+
+  if (base.empty())
+    return walk_churn(nodes, sorted.size(), edge_hunks, edge_touch, NULL, budget, walk);
+  return walk_churn(nodes, sorted.size(), edge_hunks, edge_touch, base_version, budget, walk);
+
+}
+
+bool InprocHistory::churn(const std::vector<std::string> &paths, unsigned long since,
+                          std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+                          ChurnBudget *budget) {
+
+  std::vector<std::string> sorted(paths);
+  std::vector<ChurnBlame> node_blame;
+  ChurnWalk walk;
+
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  if (!walk_paths(sorted, since, "", budget, walk, node_blame)) return false;
+
+  walk_to_changes(sorted, walk, changes, budget);
+  return true;
+
+}
+
+bool InprocHistory::replay(const std::vector<std::string> &paths, std::string base,
+                           std::map<std::string, ChurnReplay> &files) {
+
+  std::vector<std::string> sorted(paths);
+  std::vector<ChurnBlame> node_blame;
+  std::set<std::string> head_set;
+  std::string base_sha;
+  ChurnWalk walk;
+
+  if (!resolve(base, base_sha) || !ancestors(head, head_set) ||
+      !head_set.count(base_sha)) return false;
+
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  if (!walk_paths(sorted, 0, base_sha, NULL, walk, node_blame)) return false;
+
+  walk_to_replay(sorted, walk, node_blame, files);
+  return true;
+
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Backend selection                                                        */
+/* ------------------------------------------------------------------------ */
+
+class FallbackHistory : public ChurnHistory {
+
+  public:
+
+    FallbackHistory(InprocHistory *in, PopenHistory *out) : inproc(in), git(out) { }
+    ~FallbackHistory() { delete inproc; delete git; }
+
+    std::string head_commit() override {
+      std::string ret = inproc->head_commit();
+      return ret.empty() ? git->head_commit() : ret;
+    }
+
+    unsigned long head_time() override {
+      unsigned long ret = inproc->head_time();
+      return ret ? ret : git->head_time();
+    }
+
+    unsigned long init_time() override {
+      unsigned long ret = inproc->init_time();
+      return ret ? ret : git->init_time();
+    }
+
+    unsigned int commit_count(std::string commit) override {
+      unsigned int ret = inproc->commit_count(commit);
+      return ret ? ret : git->commit_count(commit);
+    }
+
+    bool file_exists(std::string path) override {
+      return inproc->file_exists(path) || git->file_exists(path);
+    }
+
+    std::string blob_id(std::string path) override {
+      std::string ret = inproc->blob_id(path);
+      return ret.empty() ? git->blob_id(path) : ret;
+    }
+
+    std::string head_blob(std::string path) override {
+      std::string ret = inproc->head_blob(path);
+      return ret.empty() ? git->head_blob(path) : ret;
+    }
+
+    bool blame(std::string path, std::map<unsigned int, ChurnBlame> &lines,
+               ChurnBudget *budget) override {
+      if (inproc->blame(path, lines, budget)) return true;
+      lines.clear();
+      if (budget) budget->blame_cut.erase(path);
+      return git->blame(path, lines, budget);
+    }
+
+    bool churn(const std::vector<std::string> &paths, unsigned long since,
+               std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+               ChurnBudget *budget) override {
+      if (inproc->churn(paths, since, changes, budget)) return true;
+      changes.clear();
+      if (budget) budget->cut.clear();
+      return git->churn(paths, since, changes, budget);
+    }
+
+    bool replay(const std::vector<std::string> &paths, std::string base,
+                std::map<std::string, ChurnReplay> &files) override {
+      if (inproc->replay(paths, base, files)) return true;
+      files.clear();
+      return git->replay(paths, base, files);
+    }
+
+  private:
+
+    InprocHistory *inproc;
+    PopenHistory *git;
+
+};
+
+/* Times every query of another history (AFLCHURN_PROFILE). */
+
+const char *churn_query_names[CHURN_Q_COUNT] = {
+  "head_commit", "head_time", "init_time", "commit_count", "file_exists",
+  "blob_id", "head_blob", "blame", "churn", "replay"
+};
+
+class ProfiledHistory : public ChurnHistory {
+
+  public:
+
+    ProfiledHistory(ChurnHistory *h, ChurnStats *s) : history(h), stats(s) { }
+    ~ProfiledHistory() { delete history; }
+
+    std::string head_commit() override {
+      return timed(CHURN_Q_HEAD_COMMIT, [&]() { return history->head_commit(); });
+    }
+
+    unsigned long head_time() override {
+      return timed(CHURN_Q_HEAD_TIME, [&]() { return history->head_time(); });
+    }
+
+    unsigned long init_time() override {
+      return timed(CHURN_Q_INIT_TIME, [&]() { return history->init_time(); });
+    }
+
+    unsigned int commit_count(std::string commit) override {
+      return timed(CHURN_Q_COMMIT_COUNT, [&]() { return history->commit_count(commit); });
+    }
+
+    bool file_exists(std::string path) override {
+      return timed(CHURN_Q_FILE_EXISTS, [&]() { return history->file_exists(path); });
+    }
+
+    std::string blob_id(std::string path) override {
+      return timed(CHURN_Q_BLOB_ID, [&]() { return history->blob_id(path); });
+    }
+
+    std::string head_blob(std::string path) override {
+      return timed(CHURN_Q_HEAD_BLOB, [&]() { return history->head_blob(path); });
+    }
+
+    bool blame(std::string path, std::map<unsigned int, ChurnBlame> &lines,
+               ChurnBudget *budget) override {
+      return timed(CHURN_Q_BLAME, [&]() { return history->blame(path, lines, budget); });
+    }
+
+    bool churn(const std::vector<std::string> &paths, unsigned long since,
+               std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+               ChurnBudget *budget) override {
+      return timed(CHURN_Q_CHURN, [&]() { return history->churn(paths, since, changes, budget); });
+    }
+
+    bool replay(const std::vector<std::string> &paths, std::string base,
+                std::map<std::string, ChurnReplay> &files) override {
+      return timed(CHURN_Q_REPLAY, [&]() { return history->replay(paths, base, files); });
+    }
+
+  private:
+
+    ChurnHistory *history;
+    ChurnStats *stats;
+
+    template <typename F> auto timed(u32 query, F call) -> decltype(call()) {
+      auto start = std::chrono::steady_clock::now();
+      auto ret = call();
+      stats->calls[query]++;
+      stats->usecs[query] += std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - start).count();
+      return ret;
+    }
+
+};
+
+ChurnHistory *open_churn_history(std::string git_directory, ChurnStats *stats) {
+
+  char *backend = getenv("AFLCHURN_GIT_BACKEND");
+  PopenHistory *git = new PopenHistory(git_directory);
+  InprocHistory *inproc;
+  ChurnHistory *history = git;
+
+  if (!backend || strcmp(backend, "popen")) {
+    inproc = new InprocHistory();
+    if (inproc->open_repo(git_directory)) history = new FallbackHistory(inproc, git);
+    else delete inproc;
+  }
+
+  return stats ? new ProfiledHistory(history, stats) : history;
+
+}
+
+unsigned long long get_churn_subprocess_count(void) {
+
+  return subprocess_count;
+
+}
+
+std::string get_churn_blob_id(std::string file_path) {
+
+  std::ifstream f(file_path, std::ios::binary);
+  std::ostringstream ss;
+  std::string data;
+
+  if (!f.is_open()) return "";
+  ss << f.rdbuf();
+  data = ss.str();
+
+  return sha_to_hex(sha1("blob " + std::to_string(data.length()) + '\0' + data));
+
+}
+
+unsigned long get_churn_since_time(void) {
+
+  char *ch_month = getenv("AFLCHURN_SINCE_MONTHS");
+  time_t now = time(NULL);
+  struct tm since;
+
+  // if env variable is not digits, use all commits
+  if (!ch_month || !*ch_month ||
+      std::string(ch_month).find_first_not_of("0123456789") != std::string::npos)
+    return 0;
+
+  /* Calendar months, like git's approxidate "<n>.months", from the start of
+     the (UTC) day, so that the window only moves once a day. */
+
+  localtime_r(&now, &since);
+  since.tm_mon -= atoi(ch_month);
+
+  return mktime(&since) / 86400 * 86400;
+
+}
+
+bool get_churn_budget(ChurnBudget &budget) {
+
+  char *ch_commits = getenv("AFLCHURN_HISTORY_COMMITS"),
+       *ch_ms = getenv("AFLCHURN_HISTORY_MS");
+
+  budget.commits = 0;
+  budget.usecs = 0;
+  budget.cut.clear();
+
+  if (ch_commits && *ch_commits &&
+      std::string(ch_commits).find_first_not_of("0123456789") == std::string::npos)
+    budget.commits = atoi(ch_commits);
+
+  if (ch_ms && *ch_ms &&
+      std::string(ch_ms).find_first_not_of("0123456789") == std::string::npos)
+    budget.usecs = strtoull(ch_ms, NULL, 10) * 1000;
+
+  return budget.commits || budget.usecs;
+
+}
+
+std::string get_churn_settings(void) {
+
+  ChurnBudget budget;
+
+  get_churn_budget(budget);
+
+  return "since=" + std::to_string(get_churn_since_time()) +
+         " budget=" + std::to_string(budget.commits) + "/" + std::to_string(budget.usecs);
+
+}
@@ -0,0 +1,182 @@
+/*
+   aflchurn - git history access for the LLVM pass
+   -----------------------------------------------
+
+   The instrumentation pass needs blame and churn information for every
+   source file it instruments. ChurnHistory hides where that information comes
+   from: either git itself (one popen() per query, the traditional way), or
+   an in-process reader of the object database (loose objects and packfiles)
+   that stays open for the lifetime of the pass.
+
+   The backend is picked with AFLCHURN_GIT_BACKEND=inproc|popen; the default
+   is the in-process reader, and queries it cannot answer (e.g. unsupported
+   repository formats) fall back to popen().
+*/
+
+#ifndef _HAVE_CHURN_HISTORY_H
+#define _HAVE_CHURN_HISTORY_H
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+/* Who last touched a line of the working tree (git blame), with the author
+   time of that commit. Lines that are not committed yet carry an all-zero
+   commit and the current time. */
+
+struct ChurnBlame {
+  std::string commit;
+  unsigned long time;
+};
+
+/* Lines [start, end) of some version of a file, which end up as the HEAD
+   lines head, head + 1, ..., or all as head if collapsed. end is ~0U for the
+   rest of the file. */
+
+struct ChurnSeg {
+  unsigned int start, end, head;
+  bool collapsed;
+};
+
+/* The history of a file between a base commit and HEAD: the churn of each
+   HEAD line over the commits since base, the newest of those commits (with
+   its author time, as in ChurnBlame), and where the lines of base went. */
+
+struct ChurnReplay {
+  std::map<unsigned int, unsigned int> changes;
+  std::map<unsigned int, ChurnBlame> last;
+  std::vector<ChurnSeg> base;
+};
+
+/* A cap on the work churn() puts into each path. Once it has diffed
+   'commits' commits of a path, or spent 'usecs' microseconds on them (0 for
+   no limit), older commits are only checked for whether they change the
+   path, and the churn of its lines is scaled up from the diffed commits to
+   all of them. 'cut' tells, for the paths that ran out, how many of their
+   commits were diffed out of how many changed them.
+   blame() takes the same cap per path: the lines it has not traced to their
+   last change by then are given to the commit they have got to (the boundary,
+   as with git blame ^<commit>). 'blame_cut' tells, for the paths that ran
+   out, how many commits were walked and how many of their lines went to the
+   boundary. */
+
+struct ChurnCut {
+  unsigned int diffed, total;
+};
+
+struct ChurnBlameCut {
+  unsigned int commits, lines, cut_lines;
+};
+
+struct ChurnBudget {
+  unsigned int commits;
+  unsigned long long usecs;
+  std::map<std::string, ChurnCut> cut;
+  std::map<std::string, ChurnBlameCut> blame_cut;
+};
+
+class ChurnHistory {
+
+  public:
+
+    virtual ~ChurnHistory() { }
+
+    /* Full SHA-1 of HEAD; empty on failure. */
+    virtual std::string head_commit() = 0;
+
+    /* Committer time of HEAD and of the oldest commit; 0 on failure. */
+    virtual unsigned long head_time() = 0;
+    virtual unsigned long init_time() = 0;
+
+    /* Number of commits reachable from commit (git rev-list --count);
+       0 on failure. */
+    virtual unsigned int commit_count(std::string commit) = 0;
+
+    /* Does the repository-relative path exist in HEAD? */
+    virtual bool file_exists(std::string path) = 0;
+
+    /* Blob SHA-1 of the working tree file (git hash-object); empty on failure. */
+    virtual std::string blob_id(std::string path) = 0;
+
+    /* Blob SHA-1 of path in HEAD; empty if it is not a file there. */
+    virtual std::string head_blob(std::string path) = 0;
+
+    /* Line number -> last change of each line of the working tree file.
+       With a budget, lines may be given to a boundary commit instead. */
+    virtual bool blame(std::string path, std::map<unsigned int, ChurnBlame> &lines,
+                       ChurnBudget *budget = NULL) = 0;
+
+    /* path -> HEAD line -> number of commits that changed it, since a unix
+       time (0 for all). Lines are traced back through every diff of their
+       history, and all paths are done in a single walk over the commits.
+       With a budget, the history of a path may be cut short. */
+    virtual bool churn(const std::vector<std::string> &paths, unsigned long since,
+                       std::map<std::string, std::map<unsigned int, unsigned int>> &changes,
+                       ChurnBudget *budget = NULL) = 0;
+
+    /* churn() over the commits reachable from HEAD but not from base, so that
+       results computed at base can be carried over to HEAD. Paths whose lines
+       also lead to versions other than the one in base (e.g. through a branch
+       forked before base) are left out. false if base is not an ancestor of
+       HEAD. */
+    virtual bool replay(const std::vector<std::string> &paths, std::string base,
+                        std::map<std::string, ChurnReplay> &files) = 0;
+
+};
+
+/* Calls to and wall time (in microseconds) spent in each kind of query,
+   for AFLCHURN_PROFILE. May be shared by histories used from several
+   threads. */
+
+enum {
+  CHURN_Q_HEAD_COMMIT,
+  CHURN_Q_HEAD_TIME,
+  CHURN_Q_INIT_TIME,
+  CHURN_Q_COMMIT_COUNT,
+  CHURN_Q_FILE_EXISTS,
+  CHURN_Q_BLOB_ID,
+  CHURN_Q_HEAD_BLOB,
+  CHURN_Q_BLAME,
+  CHURN_Q_CHURN,
+  CHURN_Q_REPLAY,
+  CHURN_Q_COUNT
+};
+
+extern const char *churn_query_names[CHURN_Q_COUNT];
+
+struct ChurnStats {
+  std::atomic<unsigned long long> calls[CHURN_Q_COUNT], usecs[CHURN_Q_COUNT];
+  ChurnStats() { for (int i = 0; i < CHURN_Q_COUNT; i++) calls[i] = usecs[i] = 0; }
+};
+
+/* Open the history of the repository whose top-level directory (with a
+   trailing '/') is git_directory. Never returns NULL. With stats, every
+   query is timed into it. */
+
+ChurnHistory *open_churn_history(std::string git_directory, ChurnStats *stats = NULL);
+
+/* git processes started by all histories so far. */
+
+unsigned long long get_churn_subprocess_count(void);
+
+/* git hash-object of a file, computed without git; empty if unreadable. */
+
+std::string get_churn_blob_id(std::string file_path);
+
+/* Start of the AFLCHURN_SINCE_MONTHS window as a unix time, rounded down to
+   the day; 0 if unset. */
+
+unsigned long get_churn_since_time(void);
+
+/* Limits of AFLCHURN_HISTORY_COMMITS and AFLCHURN_HISTORY_MS; false if
+   neither is set. */
+
+bool get_churn_budget(ChurnBudget &budget);
+
+/* The two above as one string, to tell whether two processes would count
+   the same churn. */
+
+std::string get_churn_settings(void);
+
+#endif /* ! _HAVE_CHURN_HISTORY_H */
@@ -0,0 +1,161 @@
+/*
+   aflchurn - precomputed line-score index
+   ---------------------------------------
+
+   aflchurn-index walks the history of a repository once and stores, for every
+   line of every indexed file, what the pass would otherwise ask git for: the
+   day of its last change, the number of commits reachable from that change
+   (for ranks) and how many commits changed it. With AFLCHURN_INDEX pointing to
+   that file, the pass maps it and never runs git, so the source tree can be
+   built without its .git directory.
+
+   The file is meant to be used on the machine that wrote it (native byte
+   order and alignment). Layout:
+
+     ChurnIndexHeader
+     ChurnIndexFile[file_cnt]      sorted by path
+     ChurnIndexLine[...]           line_cnt records per file, line 1 first
+     path strings                  not NUL-terminated
+*/
+
+#ifndef _HAVE_CHURN_INDEX_H
+#define _HAVE_CHURN_INDEX_H
+
+#include "../types.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+
+#define CHURN_INDEX_MAGIC   "AFLCHIDX"
+#define CHURN_INDEX_VERSION 1
+
+struct ChurnIndexHeader {
+  char magic[8];
+  u32  version;
+  u32  file_cnt;
+  u64  head_time;         /* Committer time of HEAD                  */
+  u64  init_time;         /* Committer time of the oldest commit     */
+  u64  since_time;        /* Start of the churn window, 0 for all    */
+  u32  head_count;        /* Commits reachable from HEAD             */
+  u32  reserved;
+  char head[40];          /* HEAD commit (hex SHA-1)                 */
+  u64  lines_ofs;         /* Offset of the first ChurnIndexLine      */
+  u64  strings_ofs;       /* Offset of the path strings              */
+};
+
+struct ChurnIndexFile {
+  u64  line_idx;          /* First line in the ChurnIndexLine array  */
+  u32  line_cnt;
+  u32  path_ofs;          /* Relative to strings_ofs                 */
+  u32  path_len;
+  char blob[40];          /* git hash-object of the indexed file     */
+  char head_blob[40];     /* The file in HEAD                        */
+  u32  reserved;
+};
+
+struct ChurnIndexLine {
+  u32  day;               /* Author day (time / 86400) of the last change */
+  u32  count;             /* Commits reachable from it; 0 if uncommitted  */
+  u32  changes;           /* Commits that changed the line                */
+};
+
+struct ChurnIndex {
+  const u8 *data;
+  size_t len;
+  const ChurnIndexHeader *hdr;
+  const ChurnIndexFile *files;
+  const ChurnIndexLine *lines;
+  const char *strings;
+};
+
+/* Map the index at path; false if it is missing or malformed. */
+
+static inline bool open_churn_index(const char *path, ChurnIndex &idx) {
+
+  struct stat st;
+  u64 line_total = 0;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return false;
+
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ChurnIndexHeader)) {
+    close(fd);
+    return false;
+  }
+
+  idx.len  = st.st_size;
+  idx.data = (const u8 *)mmap(NULL, idx.len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (idx.data == MAP_FAILED) return false;
+
+  idx.hdr = (const ChurnIndexHeader *)idx.data;
+
+  if (memcmp(idx.hdr->magic, CHURN_INDEX_MAGIC, 8) ||
+      idx.hdr->version != CHURN_INDEX_VERSION ||
+      sizeof(ChurnIndexHeader) + (u64)idx.hdr->file_cnt * sizeof(ChurnIndexFile) >
+        idx.hdr->lines_ofs ||
+      idx.hdr->lines_ofs > idx.hdr->strings_ofs || idx.hdr->strings_ofs > idx.len)
+    goto bad;
+
+  idx.files   = (const ChurnIndexFile *)(idx.data + sizeof(ChurnIndexHeader));
+  idx.lines   = (const ChurnIndexLine *)(idx.data + idx.hdr->lines_ofs);
+  idx.strings = (const char *)(idx.data + idx.hdr->strings_ofs);
+
+  for (u32 i = 0; i < idx.hdr->file_cnt; i++) {
+
+    const ChurnIndexFile &f = idx.files[i];
+
+    if (f.line_idx != line_total ||
+        idx.hdr->strings_ofs + f.path_ofs + f.path_len > idx.len) goto bad;
+
+    line_total += f.line_cnt;
+
+  }
+
+  if (idx.hdr->lines_ofs + line_total * sizeof(ChurnIndexLine) > idx.hdr->strings_ofs)
+    goto bad;
+
+  return true;
+
+bad:
+
+  munmap((void *)idx.data, idx.len);
+  return false;
+
+}
+
+static inline std::string churn_index_path(const ChurnIndex &idx, const ChurnIndexFile *f) {
+
+  return std::string(idx.strings + f->path_ofs, f->path_len);
+
+}
+
+/* Binary search for a repository-relative path; NULL if not indexed. */
+
+static inline const ChurnIndexFile *find_churn_index_file(const ChurnIndex &idx,
+                                                          const std::string &path) {
+
+  u32 lo = 0, hi = idx.hdr->file_cnt;
+
+  while (lo < hi) {
+
+    u32 mid = lo + (hi - lo) / 2;
+    int cmp = churn_index_path(idx, &idx.files[mid]).compare(path);
+
+    if (!cmp) return &idx.files[mid];
+    if (cmp < 0) lo = mid + 1; else hi = mid;
+
+  }
+
+  return NULL;
+
+}
+
+#endif /* ! _HAVE_CHURN_INDEX_H */
@@ -0,0 +1,113 @@
+/*
+   american fuzzy lop - asking the target for its map size
+   -------------------------------------------------------
+
+   Shared by afl-fuzz, afl-showmap, afl-tmin and afl-analyze. LTO builds
+   answer the MAP_SIZE_ENV_VAR query with a fork server hello that carries
+   the size of their map, before running any code of their own; anything
+   else gets MAP_SIZE.
+
+   The probe runs under the same memory limit as the target does later on,
+   and is given FORK_WAIT_MULT times the timeout to answer.
+
+*/
+
+#ifndef _HAVE_MAP_SIZE_H
+#define _HAVE_MAP_SIZE_H
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static u32 get_target_map_size(u8* target_path, u64 mem_limit, u32 exec_tmout) {
+
+  char* probe_argv[] = { (char*)target_path, NULL };
+  struct pollfd pfd;
+  s32 st_pipe[2], status, child;
+  u32 hello = 0, size;
+  s32 rlen = 0;
+
+  if (pipe(st_pipe)) PFATAL("pipe() failed");
+
+  child = fork();
+
+  if (child < 0) PFATAL("fork() failed");
+
+  if (!child) {
+
+    struct rlimit r;
+    s32 dev_null_fd = open("/dev/null", O_RDWR);
+
+    if (dev_null_fd < 0) exit(1);
+
+    if (mem_limit) {
+
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+    }
+
+    r.rlim_max = r.rlim_cur = 0;
+
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+    setenv(MAP_SIZE_ENV_VAR, "1", 1);
+
+    if (dup2(dev_null_fd, 0) < 0 || dup2(dev_null_fd, 1) < 0 ||
+        dup2(dev_null_fd, 2) < 0 || dup2(st_pipe[1], FORKSRV_FD + 1) < 0)
+      exit(1);
+
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+    close(dev_null_fd);
+
+    execv(target_path, probe_argv);
+    exit(0);
+
+  }
+
+  close(st_pipe[1]);
+
+  pfd.fd = st_pipe[0];
+  pfd.events = POLLIN;
+
+  if (!exec_tmout) exec_tmout = EXEC_TIMEOUT;
+
+  if (poll(&pfd, 1, exec_tmout * FORK_WAIT_MULT) > 0)
+    rlen = read(st_pipe[0], &hello, 4);
+
+  kill(child, SIGKILL);
+  if (waitpid(child, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+  close(st_pipe[0]);
+
+  if (rlen != 4 || !(hello & FS_OPT_MAP_SIZE)) return MAP_SIZE;
+
+  size = hello & ~FS_OPT_MAP_SIZE;
+
+  if (!size || size > MAP_SIZE_MAX || size % MAP_SIZE_ALIGN)
+    FATAL("The target asks for a map of %u bytes, which is not supported", size);
+
+  return size;
+
+}
+
+#endif /* !_HAVE_MAP_SIZE_H */